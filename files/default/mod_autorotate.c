@@ -27,8 +27,19 @@
  *
  * -------------------------------------------------------------------------- */
 
+/* For fallocate() flags */
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "apr_time.h"
 #include "apr_strings.h"
+#include "apr_poll.h"
+#include "apr_signal.h"
+#include "apr_hash.h"
+#include "apr_portable.h"
+#include "apr_shm.h"
+#include "apr_optional_hooks.h"
 
 #define CORE_PRIVATE
 
@@ -37,11 +48,54 @@
 #include "http_log.h"
 #include "mpm_common.h"
 #include "scoreboard.h"
+#include "mod_status.h"
+
+#include <sys/statvfs.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+
+#if defined(__linux__)
+#include <linux/falloc.h>
+#include <sys/syscall.h>
+#endif
 
 /* ---------  Forward declarations   ---------------------------------------*/
 
 #define FORMAT_SZ 256
 
+/* Size of the buffers used when streaming a log through the compressor */
+#define COMPRESS_BUF_SZ (64 * 1024)
+
+/* How often the monitor checks disk usage against the space limits */
+#define SPACE_CHECK_INTERVAL apr_time_from_sec(60)
+
+/* How often the monitor checks whether external writers have closed the
+ * archives held back from compression, and how long before it gives up
+ * on them, leaving them uncompressed */
+#define HELD_CHECK_INTERVAL apr_time_from_sec(10)
+#define HELD_TIMEOUT apr_time_from_sec(60 * 60)
+
+/* Percentage of an uncompressed archive we expect compression to free */
+#define COMPRESS_SAVING_PCT 80
+
+/* Most rotated files a compression dictionary is trained from, the block
+ * size they're cut into as samples, and the biggest dictionary made */
+#define DICT_TRAIN_FILES 8
+#define DICT_SAMPLE_SZ 4096
+#define DICT_MAX_SZ (112 * 1024)
+
+/* How much of a log is compressed at each level when choosing one */
+#define COMPRESS_SAMPLE_SZ (4 * 1024 * 1024)
+
+/* Size at which the trace file is moved aside and a new one started */
+#define TRACE_MAX_SZ (16 * 1024 * 1024)
+
+/* Per log buffer in the log sink, and the longest data waits in it */
+#define SINK_BUF_SZ (16 * 1024)
+#define SINK_FLUSH_INTERVAL apr_time_from_sec(1)
+
 module AP_MODULE_DECLARE_DATA autorotate_module;
 
 
@@ -67,6 +121,15 @@ typedef struct
     rotate_interval_t ePeriod;
 } period_map_t;
 
+/* How deep archives are partitioned by date under AutorotateArchiveDir */
+typedef enum
+{
+    PARTITION_AUTO = 0,         /* Day for hourly logs, month otherwise */
+    PARTITION_YEAR,
+    PARTITION_MONTH,
+    PARTITION_DAY
+} partition_depth_t;
+
 /* Restart methods */
 typedef enum
 {
@@ -74,24 +137,179 @@ typedef enum
     FULL
 } restartmethod_t;
 
+/* A rotated log file awaiting compression, or a finished container
+ * period whose archives are awaiting consolidation */
+typedef struct
+{
+    const char *szLogPath;      /* Path of the uncompressed log, or of the
+                                 * live log when consolidating */
+    apr_time_t tPeriodStart;    /* Start of the period the log covers */
+    apr_time_t tPeriodEnd;      /* Start of the following period */
+    int bConsolidate;           /* Consolidate rather than compress */
+    const char *szOrigName;     /* The live log the archive is of */
+} compress_job_t;
+
 typedef struct
 {
     apr_pool_t *pPool;          /* Sub-pool used during compress operations */
-    apr_proc_t *pProc;          /* Gzip process */
+    apr_proc_t *pProc;          /* Compress worker process */
     const char *szLogPath;      /* The log currently being compressed */
 
-    /* Queue of log files awaiting compression */
+    /* Queue of compress_job_t awaiting compression */
     apr_array_header_t *aCompressQueue;
 
     /* Compression program */
     const char *szCompressProgram;
 
+    /* Suffix the compressed file is written with */
+    const char *szCompressSuffix;
+
     /* Nice level */
     int nNiceLevel;
 
+    /* Record checksums of each archive in the directory manifest */
+    int bManifest;
+
+    /* Compressions that failed since the last disk space check */
+    int nFailures;
+
+    /* Compress with a dictionary trained for each log, and how many
+     * rotate periods each dictionary is used for before retraining */
+    int bDictionary;
+    int nDictionaryRetrain;
+
+    /* Levels of the compress program to choose from, and the most CPU
+     * seconds per GB of log the chosen level may take */
+    apr_array_header_t *aLevels;
+    apr_int64_t nCompressBudget;
+
 } compress_child_info_t;
 
 
+/* What went through a filter program */
+typedef struct
+{
+    apr_off_t nInBytes;
+    apr_uint32_t nInCrc;
+    apr_off_t nOutBytes;
+    apr_uint32_t nOutCrc;
+    apr_int64_t nCpuUsec;       /* User and system time of the program */
+} filter_stats_t;
+
+
+/* An archived log found on disk */
+typedef struct
+{
+    const char *szPath;
+    const char *szOrigName;     /* The live log it is an archive of */
+    apr_off_t nSize;
+    apr_time_t tPeriodStart;
+    apr_time_t tPeriodEnd;
+    int bCompressed;
+    int bContainer;             /* Consolidated archives of several periods */
+    int nPeriods;               /* Number of rotate periods covered */
+} archive_info_t;
+
+/* What create_compress_queue() passes to queue_archive_cb() for a log */
+typedef struct
+{
+    int nNumFound;              /* Uncompressed archives found so far */
+    apr_hash_t *hOpen;          /* Files the writer has open, for logs
+                                 * written outside the server, else NULL */
+    int bUnknown;               /* Not all of the writer's files could be
+                                 * looked at, so take them all as open */
+} queue_baton_t;
+
+/* Formats that consolidated containers can be written in */
+typedef enum
+{
+    CONTAINER_NONE = 0,
+    CONTAINER_GZIP,
+    CONTAINER_ZSTD
+} container_codec_t;
+
+
+/* A piped log served by the log sink */
+typedef struct
+{
+    const char *szFifo;         /* FIFO the server's log directive writes to */
+    const char *szLogPath;      /* Log file the sink writes to */
+    int nFifo;                  /* Read end of the FIFO */
+} sink_stream_t;
+
+
+/* The log sink process */
+typedef struct
+{
+    apr_pool_t *pPool;          /* Pool the sink lives as long as */
+    apr_proc_t *pProc;          /* Sink process, NULL when not running */
+    apr_array_header_t *aStreams;       /* Array of sink_stream_t */
+} sink_info_t;
+
+
+/* Identity of a file, whatever path it's reached by, as a hash key */
+typedef struct
+{
+    dev_t nDev;
+    ino_t nIno;
+} file_ident_t;
+
+
+/* A log written by a process other than the server, which is told to
+ * reopen it with a signal */
+typedef struct
+{
+    const char *szLogPath;
+    const char *szPidFile;      /* File holding the writer's process ID */
+    int nSignal;                /* Signal that makes the writer reopen */
+} external_log_t;
+
+
+/* Counters and gauges shown by mod_status.  They live in shared memory
+ * made once for the life of the server, so they survive restarts, and
+ * each is only written by one process: the parent, or the compress child
+ * for the compression figures of its own job. */
+typedef struct
+{
+    apr_time_t tLastRotate;     /* When the last rotation started */
+    apr_time_t tNextRotate;
+    apr_int64_t nRotateUsec;    /* How long the last rotation took */
+    apr_uint64_t nRotations;
+    apr_uint64_t nFilesRotated;
+    apr_uint64_t nFilesPruned;
+    apr_uint32_t nQueueDepth;   /* Jobs queued or running */
+    apr_uint64_t nJobsDone;
+    apr_uint64_t nJobsFailed;
+    apr_uint64_t nBytesIn;      /* Logs compressed */
+    apr_uint64_t nBytesOut;     /* Archives written from them */
+    apr_int64_t nCompressUsec;  /* Wall time of all compressions */
+    apr_int64_t nCompressCpuUsec;       /* CPU time of all compressions */
+    apr_int64_t nLastJobUsec;   /* Wall and CPU time of the last one */
+    apr_int64_t nLastJobCpuUsec;
+    apr_time_t tRestartRequested;       /* Set until the restart is done */
+    apr_int64_t nDrainUsec;     /* How long the last restart took to drain */
+    apr_uint64_t nDrainTimeouts;        /* Restarts that took too long */
+#if defined(ENABLE_SIMULATION)
+    apr_time_t tSimBase;        /* Real time the simulated clock started */
+    apr_time_t tSimEpoch;       /* Simulated time it started at */
+    apr_uint64_t nSimCycles;
+#endif
+} autorotate_metrics_t;
+
+
+/* A phase of work being traced, from trace_begin() to trace_end() */
+typedef struct
+{
+    const char *szName;
+    apr_time_t tStart;
+    apr_int64_t nCpuStart;      /* User and system time, or -1 if unknown */
+    long nFaultsStart;          /* Minor page faults, as heap grows */
+#if defined(ENABLE_SIMULATION)
+    apr_uint64_t nProbesStart;
+#endif
+} trace_span_t;
+
+
 /* Directives from other modules that define log files */
 typedef struct
 {
@@ -126,6 +344,49 @@ typedef struct
     /* List of log files that we are working with */
     apr_array_header_t *aLogFiles;
 
+    /* Log files (resolved paths) that are rotated by copying and then
+     * truncating in place, rather than by renaming and restarting */
+    apr_table_t *tTruncateFiles;
+
+    /* Piped logs written by the log sink, keyed by resolved log file and
+     * by FIFO path */
+    apr_table_t *tSinkFiles;
+    apr_table_t *tSinkFifos;
+
+    /* The log sink process and the logs it serves */
+    sink_info_t sinkInfo;
+
+    /* Logs of other services, external_log_t keyed by resolved path */
+    apr_hash_t *hExternalLogs;
+
+    /* Directory archives are written under, partitioned by date, or
+     * empty to keep them beside the logs.  Relative to each log's
+     * directory unless absolute, when each log's directory is mirrored
+     * under it. */
+    char szArchiveDir[APR_PATH_MAX + 1];
+    partition_depth_t ePartition;
+
+    /* Archive directories known to exist, so each is only made once */
+    apr_hash_t *hArchiveDirs;
+
+    /* File that a trace of each phase of work is written to, or NULL */
+    const char *szTraceFile;
+
+    /* Scratch pool for each run of the monitor, cleared after it */
+    apr_pool_t *pCyclePool;
+
+#if defined(ENABLE_SIMULATION)
+    /* How many times faster than real time the simulated clock runs, and
+     * the local time it starts at, or zero for now */
+    int nSimSpeed;
+    apr_time_t tSimStart;
+
+    /* Synthetic tree of logs and archives made for benchmarking */
+    const char *szSimTreeDir;
+    int nSimTreeLogs;
+    int nSimTreePeriods;
+#endif
+
     /* Time that the next rotate is due */
     apr_time_t tNextRotate;
 
@@ -135,9 +396,49 @@ typedef struct
     /* How to restart - full or graceful */
     restartmethod_t eRestartMethod;
 
+    /* Seconds to wait for the old generation to exit after a restart
+     * before compressing the archives it no longer has open, or zero to
+     * wait for ever */
+    int nDrainTimeout;
+
+    /* Old generation processes still to exit, found once after the
+     * restart, and when the restart started */
+    apr_array_header_t *aDrainPids;
+    apr_time_t tDrainStart;
+
+    /* Archives of external and sink logs that their writers still had
+     * open, as they hadn't reopened the log yet, kept out of the compress
+     * queue until they close them, and the pool they're kept in */
+    apr_array_header_t *aHeldJobs;
+    apr_pool_t *pHeldPool;
+    apr_time_t tHeldSince;      /* When the first of them was held back */
+    apr_time_t tNextHeldCheck;  /* When they're next checked */
+
+    /* Archives still open when the drain timed out were left out of the
+     * compress queue, so queue them once it's over */
+    int bRequeueAfterDrain;
+
     /* Number of logs to keep */
     int nKeepLogs;
 
+    /* Maximum bytes of archives to keep in each log directory */
+    apr_off_t nKeepBytes;
+
+    /* Minimum percentage of free space to keep on each log filesystem */
+    int nKeepFreePct;
+
+    /* Time that disk usage is next checked against the limits above */
+    apr_time_t tNextSpaceCheck;
+
+    /* Merge the archives of each finished period of this length into a
+     * single container */
+    int bConsolidate;
+    rotate_interval_t eConsolidate;
+
+    /* Lower case name of the consolidation period, used in container
+     * file names */
+    char szConsolidateName[16];
+
 
     /* 
      * Compression related params
@@ -162,6 +463,8 @@ typedef struct
 
 
 typedef void child_cb_func_t(int, void *, int);
+typedef apr_time_t clock_func_t(void);
+typedef void archive_cb_func_t(apr_pool_t *, const archive_info_t *, void *);
 
 
 /* ---------  Constants  ----------------------------------------------------*/
@@ -169,6 +472,18 @@ typedef void child_cb_func_t(int, void *, int);
 static const char *DEFAULT_FORMAT = "%Y%m%d-%H:%M:%S";
 static const char *DEFAULT_COMPRESS_PROGRAM = "/usr/bin/gzip";
 static const char *DEFAULT_COMPRESS_SUFFIX = ".gz";
+static const char *MANIFEST_NAME = "autorotate.manifest";
+
+/* Infix of compression dictionaries, eg. access_log.dict.3, and suffix
+ * of the link to the one a log is compressed with now, eg. access_log.dict */
+static const char *DICTIONARY_INFIX = ".dict.";
+static const char *DICTIONARY_LINK = ".dict";
+
+/* First line of the index at the head of each container */
+static const char *CONTAINER_INDEX_MAGIC = "autorotate-index 1\n";
+
+/* Container periods to look back over for archives still to consolidate */
+#define CONSOLIDATE_LOOKBACK 3
 
 static const period_map_t PERIOD_MAP[] = {
     {"Hourly", HOURLY},
@@ -212,7 +527,7 @@ static const char *cmd_add_log_directive(cmd_parms * pCmd, void *pDummy,
                                          const char *szArg1,
                                          const char *szArg2);
 static const char *cmd_add_log_file(cmd_parms * pCmd, void *pDummy,
-                                    const char *szArg1);
+                                    const char *szArg1, const char *szArg2);
 static const char *cmd_rotate_period(cmd_parms * pCmd, void *pDummy,
                                      const char *szArg);
 static const char *cmd_rotate_offset(cmd_parms * pCmd, void *pDummy,
@@ -229,10 +544,52 @@ static const char *cmd_rotate_restartmethod(cmd_parms * pCmd, void *pDummy,
                                             const char *szArg);
 static const char *cmd_rotate_keep(cmd_parms * pCmd, void *pDummy,
                                    const char *szArg);
+static const char *cmd_rotate_keepbytes(cmd_parms * pCmd, void *pDummy,
+                                        const char *szArg);
+static const char *cmd_rotate_keepfree(cmd_parms * pCmd, void *pDummy,
+                                       const char *szArg);
 static const char *cmd_rotate_compressafter(cmd_parms * pCmd, void *pDummy,
                                             const char *szArg);
+static const char *cmd_rotate_manifest(cmd_parms * pCmd, void *pDummy,
+                                       int nArg);
+static const char *cmd_rotate_consolidate(cmd_parms * pCmd, void *pDummy,
+                                          const char *szArg);
+static const char *cmd_rotate_dictionary(cmd_parms * pCmd, void *pDummy,
+                                         const char *szArg,
+                                         const char *szRetrain);
+static const char *cmd_rotate_compresslevels(cmd_parms * pCmd, void *pDummy,
+                                             const char *szArg);
+static const char *cmd_rotate_compressbudget(cmd_parms * pCmd, void *pDummy,
+                                             const char *szArg);
+static const char *cmd_rotate_pipedlog(cmd_parms * pCmd, void *pDummy,
+                                       const char *szFifo,
+                                       const char *szLog);
+static const char *cmd_rotate_externallog(cmd_parms * pCmd, void *pDummy,
+                                          const char *szLog,
+                                          const char *szPidFile,
+                                          const char *szSignal);
+static const char *cmd_rotate_archivedir(cmd_parms * pCmd, void *pDummy,
+                                         const char *szDir,
+                                         const char *szDepth);
+static const char *cmd_rotate_tracefile(cmd_parms * pCmd, void *pDummy,
+                                        const char *szArg);
+static const char *cmd_rotate_draintimeout(cmd_parms * pCmd, void *pDummy,
+                                           const char *szArg);
+#if defined(ENABLE_SIMULATION)
+static const char *cmd_rotate_simulate(cmd_parms * pCmd, void *pDummy,
+                                       const char *szSpeed,
+                                       const char *szStart);
+static const char *cmd_rotate_simulatetree(cmd_parms * pCmd, void *pDummy,
+                                           const char *szDir,
+                                           const char *szLogs,
+                                           const char *szPeriods);
+static void make_sim_tree(apr_pool_t * pconf, apr_pool_t * ptemp,
+                          autorotate_config_t * pConfig);
+static clock_func_t sim_clock;
+#endif
 /* Hook handlers */
 static int monitor_func(apr_pool_t * p);
+static int monitor_cycle(apr_pool_t * pconf, apr_pool_t * p);
 static int open_logs_func(apr_pool_t * pconf, apr_pool_t * plog,
                           apr_pool_t * ptemp, server_rec * s);
 
@@ -255,9 +612,40 @@ static void find_log_names(autorotate_config_t * pConfig, apr_pool_t * pool,
 static int check_logfile_dates(apr_pool_t * ptemp, server_rec * s,
                                apr_array_header_t * aFiles);
 static rotate_interval_t valid_period(const char *szPeriod);
-static int is_fully_restarted(apr_pool_t * p);
+static int is_fully_restarted(apr_pool_t * pconf, apr_pool_t * p);
+static int drain_timed_out(apr_pool_t * p);
+static int drop_open_jobs(apr_pool_t * p, compress_child_info_t * pInfo);
+static void release_held_jobs(apr_pool_t * p);
+static int is_held(const char *szPath);
+static void start_compression(void);
 static int do_rotate(apr_pool_t * p, apr_array_header_t * aList);
+static void signal_pidfile(apr_pool_t * p, const char *szPidFile,
+                           int nSignal);
+static apr_status_t truncate_rotate(apr_pool_t * p, const char *szOrigName,
+                                    const char *szNewName);
 static int do_prune(apr_pool_t * p);
+static void do_space_prune(apr_pool_t * p);
+static const char *log_dir_name(apr_pool_t * p, const char *szPath);
+static const char *archive_root(apr_pool_t * p, const char *szOrigName);
+static const char *archive_name(apr_pool_t * p, const char *szOrigName,
+                                char *szSuffix, apr_time_t tStart);
+static apr_status_t make_archive_dir(apr_pool_t * p, const char *szPath);
+static void remove_empty_partitions(apr_pool_t * p,
+                                    const archive_info_t * pArchive);
+static void walk_archives(apr_pool_t * p, const char *szOrigName,
+                          int nFirstPeriod, archive_cb_func_t * pFunc,
+                          void *pvBaton);
+static void scan_archives(apr_pool_t * p, const char *szDir, int nDepth,
+                          const char *szOrigName,
+                          const apr_array_header_t * aPrefixes,
+                          apr_hash_t * hSeen, archive_cb_func_t * pFunc,
+                          void *pvBaton);
+static const char *container_name(apr_pool_t * p, const char *szOrigName,
+                                  char *szSuffix, apr_time_t tStart);
+static container_codec_t container_codec(const char *szSuffix);
+static apr_status_t consolidate_archives(apr_pool_t * p,
+                                         compress_child_info_t * pData,
+                                         const compress_job_t * pJob);
 static void record_next_rotate_time(apr_pool_t * ptemp,
                                     autorotate_config_t * pConfig);
 static void restart_server(apr_pool_t * ptemp, autorotate_config_t * pConfig);
@@ -265,6 +653,28 @@ static apr_status_t run_next_compress_child(compress_child_info_t * pData);
 static child_cb_func_t compress_cb_func;
 static int create_compress_queue(apr_pool_t * pconf, apr_pool_t * ptemp,
                                  autorotate_config_t * pConfig);
+static archive_cb_func_t prune_archive_cb;
+static archive_cb_func_t collect_archive_cb;
+static archive_cb_func_t queue_archive_cb;
+static void queue_consolidation(apr_pool_t * ptemp,
+                                compress_child_info_t * pInfo,
+                                const char *szOrigName);
+static const char *dictionary_for(apr_pool_t * p,
+                                  compress_child_info_t * pData,
+                                  const compress_job_t * pJob);
+static apr_status_t compress_stream(apr_pool_t * p,
+                                    compress_child_info_t * pData,
+                                    const compress_job_t * pJob);
+static apr_uint32_t crc32c_update(apr_uint32_t nCrc, const void *pvBuf,
+                                  apr_size_t nLen);
+static apr_status_t run_log_sink(sink_info_t * pSink);
+static int status_func(request_rec * r, int nFlags);
+static void trace_begin(trace_span_t * pSpan, const char *szName);
+static apr_int64_t rusage_cpu_usec(const struct rusage *pUsage);
+static void trace_end(apr_pool_t * p, trace_span_t * pSpan,
+                      const char *szArgs);
+static const char *json_string(apr_pool_t * p, const char *szValue);
+static child_cb_func_t sink_cb_func;
 
 /* ---------  Configuration directive handlers  -----------------------------*/
 /* Nasty.  The monitor hook doesn't have access to a server_rec so keep this
@@ -272,6 +682,20 @@ static int create_compress_queue(apr_pool_t * pconf, apr_pool_t * ptemp,
  */
 static autorotate_config_t *pgConfigData = NULL;
 
+/* The clock that periods are worked out from and rotations are timed
+ * by.  Durations are always measured with apr_time_now(). */
+static clock_func_t *pgClock = apr_time_now;
+
+#if defined(ENABLE_SIMULATION)
+/* Archive probes made by walk_archives() since the last cycle */
+static apr_uint64_t ngSimProbes = 0;
+static apr_uint64_t ngSimArchives = 0;
+#endif
+
+/* Where the metrics go, local until the shared segment is made */
+static autorotate_metrics_t sgLocalMetrics;
+static autorotate_metrics_t *pgMetrics = &sgLocalMetrics;
+
 /* ---------  Configuration directive handlers  -----------------------------*/
 
 /*
@@ -297,6 +721,20 @@ static rotate_interval_t valid_period(const char *szPeriod)
     return -1;
 }
 
+/*
+ * Order the rotate periods from shortest to longest
+ */
+static int period_rank(rotate_interval_t ePeriod)
+{
+#if defined(ENABLE_PERMINUTE)
+    if (ePeriod == PERMINUTE) {
+        return -1;
+    }
+#endif
+
+    return ePeriod;
+}
+
 /*
  * Create the per-server config record
  */
@@ -324,11 +762,37 @@ static void *create_autorotate_config(apr_pool_t * pPool,
 
     /* Initialize array of logfile names */
     pConfig->aLogFiles = apr_array_make(pPool, 5, sizeof(char *));
+    pConfig->tTruncateFiles = apr_table_make(pPool, 1);
+    pConfig->tSinkFiles = apr_table_make(pPool, 1);
+    pConfig->tSinkFifos = apr_table_make(pPool, 1);
+    pConfig->hExternalLogs = apr_hash_make(pPool);
+    pConfig->szArchiveDir[0] = '\0';
+    pConfig->ePartition = PARTITION_AUTO;
+    pConfig->hArchiveDirs = apr_hash_make(pPool);
+    pConfig->szTraceFile = NULL;
+    pConfig->pCyclePool = NULL;
+    pConfig->sinkInfo.pPool = NULL;
+    pConfig->sinkInfo.pProc = NULL;
+    pConfig->sinkInfo.aStreams =
+        apr_array_make(pPool, 1, sizeof(sink_stream_t));
 
     pConfig->tNextRotate = 0;
     pConfig->bIsRotating = 0;
     pConfig->eRestartMethod = GRACEFUL;
+    pConfig->nDrainTimeout = 0;
+    pConfig->aDrainPids = NULL;
+    pConfig->tDrainStart = 0;
+    pConfig->bRequeueAfterDrain = 0;
+    pConfig->aHeldJobs = NULL;
+    pConfig->pHeldPool = NULL;
+    pConfig->tHeldSince = 0;
+    pConfig->tNextHeldCheck = 0;
     pConfig->nKeepLogs = 0;
+    pConfig->nKeepBytes = 0;
+    pConfig->nKeepFreePct = 0;
+    pConfig->tNextSpaceCheck = 0;
+    pConfig->bConsolidate = 0;
+    pConfig->eConsolidate = DAILY;
     pConfig->nCompressAfter = 1;
 
     pConfig->compressInfo.pPool = NULL;
@@ -336,6 +800,11 @@ static void *create_autorotate_config(apr_pool_t * pPool,
     pConfig->compressInfo.szLogPath = NULL;
     pConfig->compressInfo.aCompressQueue = NULL;
     pConfig->compressInfo.nNiceLevel = 5;
+    pConfig->compressInfo.bManifest = 1;
+    pConfig->compressInfo.bDictionary = 0;
+    pConfig->compressInfo.nDictionaryRetrain = 24;
+    pConfig->compressInfo.aLevels = NULL;
+    pConfig->compressInfo.nCompressBudget = 60;
     pConfig->pDirectiveList = NULL;
 
     /* Initialize the directive list from the static mapping */
@@ -371,8 +840,11 @@ static const char *cmd_rotate_enabled(cmd_parms * pCmd, void *pDummy,
     return NULL;
 }
 
+/*
+ * Process the 'AutorotateAddLogFile' directive
+ */
 static const char *cmd_add_log_file(cmd_parms * pCmd, void *pDummy,
-                                    const char *szArg1)
+                                    const char *szArg1, const char *szArg2)
 {
     autorotate_config_t *pConfig;
 
@@ -387,6 +859,17 @@ static const char *cmd_add_log_file(cmd_parms * pCmd, void *pDummy,
         return "AutorotateAddLogFile only supported in the main server";
     }
 
+    if (szArg2) {
+        if (apr_strnatcasecmp(szArg2, "Truncate") == 0) {
+            apr_table_setn(pConfig->tTruncateFiles,
+                           ap_server_root_relative(pCmd->pool, szArg1), "");
+        }
+        else if (apr_strnatcasecmp(szArg2, "Rename") != 0) {
+            return "AutorotateAddLogFile method must be \"Rename\" or "
+                "\"Truncate\"";
+        }
+    }
+
     *(const char **) apr_array_push(pConfig->aLogFiles) =
         apr_pstrdup(pCmd->pool, szArg1);
 
@@ -690,6 +1173,99 @@ static const char *cmd_rotate_keep(cmd_parms * pCmd, void *pDummy,
     return NULL;
 }
 
+/*
+ * Process the 'AutorotateKeepBytes' directive
+ * Takes a size in bytes with an optional K, M, G or T multiplier
+ */
+static const char *cmd_rotate_keepbytes(cmd_parms * pCmd, void *pDummy,
+                                        const char *szArg)
+{
+    autorotate_config_t *pConfig;
+
+    AP_DEBUG_ASSERT(pCmd != NULL);
+    AP_DEBUG_ASSERT(szArg != NULL);
+
+    pConfig = ap_get_module_config(pCmd->server->module_config,
+                                   &autorotate_module);
+    AP_DEBUG_ASSERT(pConfig != NULL);
+
+    if (pCmd->server->is_virtual) {
+        return "AutorotateKeepBytes only supported in the main server";
+    }
+
+    char *szEnd;
+    int nShift = 0;
+    errno = 0;
+    apr_int64_t nBytes = apr_strtoi64(szArg, &szEnd, 10);
+    if (errno == ERANGE || szEnd == szArg || nBytes < 0) {
+        return "AutorotateKeepBytes out of range";
+    }
+
+    switch (apr_toupper(*szEnd)) {
+    case 'T':
+        nShift += 10;
+        /* fall through */
+    case 'G':
+        nShift += 10;
+        /* fall through */
+    case 'M':
+        nShift += 10;
+        /* fall through */
+    case 'K':
+        nShift += 10;
+        szEnd++;
+        /* fall through */
+    case '\0':
+        break;
+    default:
+        return "AutorotateKeepBytes must be a size such as 500M or 200G";
+    }
+
+    if (*szEnd != '\0') {
+        return "AutorotateKeepBytes must be a size such as 500M or 200G";
+    }
+    if (nBytes > (APR_INT64_MAX >> nShift)) {
+        return "AutorotateKeepBytes out of range";
+    }
+
+    pConfig->nKeepBytes = nBytes << nShift;
+
+    return NULL;
+}
+
+/*
+ * Process the 'AutorotateKeepFree' directive
+ */
+static const char *cmd_rotate_keepfree(cmd_parms * pCmd, void *pDummy,
+                                       const char *szArg)
+{
+    autorotate_config_t *pConfig;
+
+    AP_DEBUG_ASSERT(pCmd != NULL);
+    AP_DEBUG_ASSERT(szArg != NULL);
+
+    pConfig = ap_get_module_config(pCmd->server->module_config,
+                                   &autorotate_module);
+    AP_DEBUG_ASSERT(pConfig != NULL);
+
+    if (pCmd->server->is_virtual) {
+        return "AutorotateKeepFree only supported in the main server";
+    }
+
+    char *szEnd;
+    int nPct = strtol(szArg, &szEnd, 10);
+    if (*szEnd == '%') {
+        szEnd++;
+    }
+    if (*szArg == '\0' || *szEnd != '\0' || nPct < 0 || nPct >= 100) {
+        return "AutorotateKeepFree must be a percentage from 0 to 99";
+    }
+
+    pConfig->nKeepFreePct = nPct;
+
+    return NULL;
+}
+
 /*
  * Process the 'AutorotateCompressAfter' directive
  */
@@ -721,927 +1297,4969 @@ static const char *cmd_rotate_compressafter(cmd_parms * pCmd, void *pDummy,
 
 
 /*
- * Handler for the 'monitor' hook
- *
- * Runs every 10 seconds in the caretaker process.
- * Make sure that this routine is kept light weight!
+ * Process the 'AutorotateManifest' directive
  */
-static int monitor_func(apr_pool_t * p)
+static const char *cmd_rotate_manifest(cmd_parms * pCmd, void *pDummy,
+                                       int nArg)
 {
-    AP_DEBUG_ASSERT(pgConfigData != NULL);
-    AP_DEBUG_ASSERT(p != NULL);
-
-    /* Why wouldn't we have a valid global config ? */
-    if (pgConfigData == NULL) {
-        ap_log_perror(APLOG_MARK, APLOG_ERR, OK, p,
-                      "mod_autorotate: NULL configuration found - bug?");
-        return HTTP_INTERNAL_SERVER_ERROR;
-    }
+    autorotate_config_t *pConfig;
 
-    /* Do nothing if we're not enabled */
-    if (!pgConfigData->bEnabled)
-        return DECLINED;
+    AP_DEBUG_ASSERT(pCmd != NULL);
 
-    /* Do nothing if we're currently rotating */
-    if (pgConfigData->bIsRotating)
-        return DECLINED;
+    pConfig = ap_get_module_config(pCmd->server->module_config,
+                                   &autorotate_module);
+    AP_DEBUG_ASSERT(pConfig != NULL);
 
-    /* Don't do anything until the server is fully restarted */
-    if (!is_fully_restarted(p)) {
-        return DECLINED;
+    if (pCmd->server->is_virtual) {
+        return "AutorotateManifest only supported in the main server";
     }
 
-    /* Check if a rotate is due */
-    apr_time_t tNow = apr_time_now();
-    if (tNow >= pgConfigData->tNextRotate) {
-        ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
-                      "mod_autorotate: Log rotation now due");
+    pConfig->compressInfo.bManifest = nArg;
+    return NULL;
+}
 
-        /* Prune old logs */
-        do_prune(p);
 
-        /* Rotate and record whether we need a restart */
-        int nNeedRestart = do_rotate(p, NULL);
+/*
+ * Process the 'AutorotateCompressLevels' directive
+ * Called once for each level given
+ */
+static const char *cmd_rotate_compresslevels(cmd_parms * pCmd, void *pDummy,
+                                             const char *szArg)
+{
+    autorotate_config_t *pConfig;
 
-        /* Signal a restart if we rotated any files */
-        if (nNeedRestart) {
-            restart_server(p, pgConfigData);
-        }
+    AP_DEBUG_ASSERT(pCmd != NULL);
+    AP_DEBUG_ASSERT(szArg != NULL);
 
-        record_next_rotate_time(p, pgConfigData);
-    }
+    pConfig = ap_get_module_config(pCmd->server->module_config,
+                                   &autorotate_module);
+    AP_DEBUG_ASSERT(pConfig != NULL);
 
-    /* Start compressing if something has filled the queue
-     * and it hasn't started yet */
-    if ((pgConfigData->compressInfo.aCompressQueue != NULL) &&
-        (pgConfigData->compressInfo.szLogPath == NULL)) {
+    if (pCmd->server->is_virtual) {
+        return "AutorotateCompressLevels only supported in the main server";
+    }
 
-        pgConfigData->compressInfo.szCompressProgram =
-            pgConfigData->szCompressProgram;
-        run_next_compress_child(&pgConfigData->compressInfo);
+    char *szEnd;
+    errno = 0;
+    apr_int64_t nLevel = apr_strtoi64(szArg, &szEnd, 10);
+    if (errno == ERANGE || szEnd == szArg || *szEnd != '\0' ||
+        nLevel < 1 || nLevel > 19) {
+        return "AutorotateCompressLevels must be between 1 and 19";
+    }
 
+    if (!pConfig->compressInfo.aLevels) {
+        pConfig->compressInfo.aLevels =
+            apr_array_make(pCmd->pool, 4, sizeof(int));
     }
+    *(int *) apr_array_push(pConfig->compressInfo.aLevels) = nLevel;
 
-    return OK;
+    return NULL;
 }
 
-static void restart_server(apr_pool_t * ptemp, autorotate_config_t * pConfig)
+
+/*
+ * Process the 'AutorotateCompressBudget' directive
+ * Takes the CPU seconds that compressing a GB of log may take
+ */
+static const char *cmd_rotate_compressbudget(cmd_parms * pCmd, void *pDummy,
+                                             const char *szArg)
 {
+    autorotate_config_t *pConfig;
+
+    AP_DEBUG_ASSERT(pCmd != NULL);
+    AP_DEBUG_ASSERT(szArg != NULL);
+
+    pConfig = ap_get_module_config(pCmd->server->module_config,
+                                   &autorotate_module);
     AP_DEBUG_ASSERT(pConfig != NULL);
-    AP_DEBUG_ASSERT(ptemp != NULL);
 
-    if (pConfig->eRestartMethod == GRACEFUL) {
-        ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, ptemp,
-                      "mod_autorotate: Requesting graceful restart");
-        kill(getpid(), AP_SIG_GRACEFUL);
+    if (pCmd->server->is_virtual) {
+        return "AutorotateCompressBudget only supported in the main server";
     }
-    else {
-        ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, ptemp,
-                      "mod_autorotate: Requesting FULL restart");
-        kill(getpid(), SIGHUP);
+
+    apr_int64_t nBudget = apr_atoi64(szArg);
+    if (errno == ERANGE || nBudget < 1) {
+        return "AutorotateCompressBudget out of range";
     }
+
+    pConfig->compressInfo.nCompressBudget = nBudget;
+
+    return NULL;
 }
 
 
 /*
- *  Remove old log files
+ * Process the 'AutorotateDictionary' directive
+ * Takes On or Off, and optionally the number of rotate periods to use each
+ * dictionary for
  */
-static int do_prune(apr_pool_t * p)
+static const char *cmd_rotate_dictionary(cmd_parms * pCmd, void *pDummy,
+                                         const char *szArg,
+                                         const char *szRetrain)
 {
-    AP_DEBUG_ASSERT(pgConfigData != NULL);
-    AP_DEBUG_ASSERT(p != NULL);
-
-    /* Decline to prune if KeepLogs is zero */
-    if (pgConfigData->nKeepLogs == 0) {
-        ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
-                      "mod_autorotate: Log pruning disabled");
-        return OK;
-    }
-
-    pgConfigData->bIsRotating = 1;
-    ap_log_perror(APLOG_MARK, APLOG_DEBUG, OK, p,
-                  "mod_autorotate: Pruning logs");
-    char *szSuffix = apr_pcalloc(p, 256);
-
-
-    /* Cycle through the log files */
+    autorotate_config_t *pConfig;
 
-    int i;
-    char **pszLogFiles = (char **) pgConfigData->aLogFiles->elts;
-    for (i = 0; i < pgConfigData->aLogFiles->nelts; i++) {
-        /* File might be relative to server root */
-        const char *szOrigName = ap_server_root_relative(p, pszLogFiles[i]);
-        const char *szNewName = NULL;
+    AP_DEBUG_ASSERT(pCmd != NULL);
+    AP_DEBUG_ASSERT(szArg != NULL);
 
-        /* go back one period at a time, decrementing the number to keep
-         * each time a log exists for that previous period.  After we get to
-         * zero, start deleting for subsequent periods */
+    pConfig = ap_get_module_config(pCmd->server->module_config,
+                                   &autorotate_module);
+    AP_DEBUG_ASSERT(pConfig != NULL);
 
-        int nCurrentPeriod = -1;
-        int nNumFound = 0;
-        for (nCurrentPeriod = -1; nCurrentPeriod > -100; nCurrentPeriod--) {
-            apr_time_t tStart = offset_period_start(nCurrentPeriod,
-                                                    pgConfigData->eInterval,
-                                                    pgConfigData->nOffset);
+    if (pCmd->server->is_virtual) {
+        return "AutorotateDictionary only supported in the main server";
+    }
 
-            apr_time_exp_t tExp;
-            apr_time_exp_lt(&tExp, tStart);
+    if (!strcasecmp(szArg, "On")) {
+        pConfig->compressInfo.bDictionary = 1;
+    }
+    else if (!strcasecmp(szArg, "Off")) {
+        pConfig->compressInfo.bDictionary = 0;
+    }
+    else {
+        return "AutorotateDictionary must be On or Off";
+    }
 
-            apr_size_t nSuffixLen;
-            apr_strftime(szSuffix, &nSuffixLen, 255,
-                         pgConfigData->szFormat, &tExp);
+    if (szRetrain) {
+        apr_int64_t nRetrain = apr_atoi64(szRetrain);
+        if (errno == ERANGE || nRetrain < 1 || nRetrain > 1000) {
+            return "AutorotateDictionary retrain periods out of range";
+        }
+        pConfig->compressInfo.nDictionaryRetrain = nRetrain;
+    }
 
+    return NULL;
+}
 
-            szNewName = apr_psprintf(p, "%s.%s", szOrigName, szSuffix);
 
-            /* Check if a log exists for this previous period */
-            apr_finfo_t fs;
-            apr_status_t nStatus =
-                apr_stat(&fs, szNewName, APR_FINFO_MTIME, p);
-            if (nStatus == OK) {        /* File exists */
-                nNumFound++;
+/*
+ * Process the 'AutorotateConsolidate' directive
+ */
+static const char *cmd_rotate_consolidate(cmd_parms * pCmd, void *pDummy,
+                                          const char *szArg)
+{
+    autorotate_config_t *pConfig;
+    rotate_interval_t ePeriod;
 
-                if (nNumFound >= pgConfigData->nKeepLogs) {
-                    nStatus = apr_file_remove(szNewName, p);
-                    if (nStatus == APR_SUCCESS) {
-                        ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
-                                      "mod_autorotate: Removed %s",
-                                      szNewName);
-                    }
-                    else {
-                        ap_log_perror(APLOG_MARK, APLOG_ERR, nStatus, p,
-                                      "mod_autorotate: removing %s ",
-                                      szNewName);
-                    }
-                }
-            }
+    AP_DEBUG_ASSERT(pCmd != NULL);
+    AP_DEBUG_ASSERT(szArg != NULL);
 
-            szNewName = apr_psprintf(p, "%s.%s%s", szOrigName, szSuffix,
-                                     pgConfigData->szCompressSuffix);
+    pConfig = ap_get_module_config(pCmd->server->module_config,
+                                   &autorotate_module);
+    AP_DEBUG_ASSERT(pConfig != NULL);
 
-            nStatus = apr_stat(&fs, szNewName, APR_FINFO_MTIME, p);
-            if (nStatus == OK) {        /* File exists */
-                nNumFound++;
+    if (pCmd->server->is_virtual) {
+        return "AutorotateConsolidate only supported in the main server";
+    }
 
-                if (nNumFound >= pgConfigData->nKeepLogs) {
-                    nStatus = apr_file_remove(szNewName, p);
-                    if (nStatus == APR_SUCCESS) {
-                        ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
-                                      "mod_autorotate: Removed %s",
-                                      szNewName);
-                    }
-                    else {
-                        ap_log_perror(APLOG_MARK, APLOG_ERR, nStatus, p,
-                                      "mod_autorotate: removing %s ",
-                                      szNewName);
-                    }
-                }
-            }
+    if (apr_strnatcasecmp(szArg, "Off") == 0) {
+        pConfig->bConsolidate = 0;
+        return NULL;
+    }
 
-        }                       /* End for (period) */
+    /* Turn the string into a period identifier */
+    ePeriod = valid_period(szArg);
+    if (ePeriod == -1) {
+        return apr_psprintf(pCmd->temp_pool,
+                            "Invalid consolidate period [%s].", szArg);
+    }
 
-    }                           /* End for (log file) */
+    pConfig->bConsolidate = 1;
+    pConfig->eConsolidate = ePeriod;
 
+    char *pDst = pConfig->szConsolidateName;
+    for (; *szArg && pDst < pConfig->szConsolidateName + 15; szArg++) {
+        *pDst++ = apr_tolower(*szArg);
+    }
+    *pDst = '\0';
 
-    pgConfigData->bIsRotating = 0;
+    return NULL;
 }
 
 
-
 /*
- * Rotate the log files, and return whether we did anything or not
+ * Process the 'AutorotatePipedLog' directive
+ *
+ * The FIFO is made and opened here, while the configuration is read, so
+ * that it's ready before any module opens it for writing.  We hold it
+ * open for reading and writing for the life of the server: opening it
+ * never blocks, and writers never see it without a reader, even while the
+ * sink is restarting.
  */
-static int do_rotate(apr_pool_t * p, apr_array_header_t * aList)
+static const char *cmd_rotate_pipedlog(cmd_parms * pCmd, void *pDummy,
+                                       const char *szFifo,
+                                       const char *szLog)
 {
-    AP_DEBUG_ASSERT(pgConfigData != NULL);
-    AP_DEBUG_ASSERT(p != NULL);
+    autorotate_config_t *pConfig;
 
-    int nNumRotated = 0;
-    apr_status_t nStatus;
+    AP_DEBUG_ASSERT(pCmd != NULL);
+    AP_DEBUG_ASSERT(szFifo != NULL);
+    AP_DEBUG_ASSERT(szLog != NULL);
 
-    ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
-                  "mod_autorotate: Rotating logs");
-    pgConfigData->bIsRotating = 1;
+    pConfig = ap_get_module_config(pCmd->server->module_config,
+                                   &autorotate_module);
+    AP_DEBUG_ASSERT(pConfig != NULL);
 
-    /* Start of the current period -+ offset */
-    apr_time_t tStart = offset_period_start(-1, pgConfigData->eInterval,
-                                            pgConfigData->nOffset);
+    if (pCmd->server->is_virtual) {
+        return "AutorotatePipedLog only supported in the main server";
+    }
 
-    apr_time_exp_t tExp;
-    apr_time_exp_lt(&tExp, tStart);
+    apr_pool_t *pProcPool = pCmd->server->process->pool;
+    szFifo = ap_server_root_relative(pProcPool, szFifo);
+    szLog = ap_server_root_relative(pCmd->pool, szLog);
+
+    /* FIFOs opened by earlier readings of the configuration */
+    apr_hash_t *hFifos = NULL;
+    apr_pool_userdata_get((void **) &hFifos, "mod_autorotate_fifos",
+                          pProcPool);
+    if (!hFifos) {
+        hFifos = apr_hash_make(pProcPool);
+        apr_pool_userdata_set(hFifos, "mod_autorotate_fifos",
+                              apr_pool_cleanup_null, pProcPool);
+    }
 
-    /* Suffix to append to log file names */
-    char *szSuffix = apr_pcalloc(p, 256);
-    apr_size_t nSuffixLen;
-    apr_strftime(szSuffix, &nSuffixLen, 255, pgConfigData->szFormat, &tExp);
+    int *pnFd = apr_hash_get(hFifos, szFifo, APR_HASH_KEY_STRING);
+    if (!pnFd) {
+        struct stat sStat;
+        if (mkfifo(szFifo, 0600) != 0 && errno != EEXIST) {
+            return apr_psprintf(pCmd->temp_pool,
+                                "AutorotatePipedLog couldn't create %s: %s",
+                                szFifo, strerror(errno));
+        }
+        if (stat(szFifo, &sStat) != 0 || !S_ISFIFO(sStat.st_mode)) {
+            return apr_psprintf(pCmd->temp_pool,
+                                "AutorotatePipedLog %s is not a FIFO",
+                                szFifo);
+        }
 
-    ap_log_perror(APLOG_MARK, APLOG_DEBUG, OK, p,
-                  "log file suffix: %s", szSuffix);
+        pnFd = apr_palloc(pProcPool, sizeof(int));
+        *pnFd = open(szFifo, O_RDWR | O_NONBLOCK);
+        if (*pnFd < 0) {
+            return apr_psprintf(pCmd->temp_pool,
+                                "AutorotatePipedLog couldn't open %s: %s",
+                                szFifo, strerror(errno));
+        }
 
-    /* Array of log files to use might be specified */
-    if (!aList) {
-        aList = pgConfigData->aLogFiles;
+        /* Only the sink, which is forked rather than exec'd, needs it */
+        fcntl(*pnFd, F_SETFD, FD_CLOEXEC);
+        apr_hash_set(hFifos, szFifo, APR_HASH_KEY_STRING, pnFd);
     }
 
-    /* Cycle through the log files */
-    char **pszLogFiles = (char **) aList->elts;
+    sink_stream_t *pStream = apr_array_push(pConfig->sinkInfo.aStreams);
+    pStream->szFifo = szFifo;
+    pStream->szLogPath = szLog;
+    pStream->nFifo = *pnFd;
 
-    int i;
-    for (i = 0; i < aList->nelts; i++) {
+    apr_table_setn(pConfig->tSinkFiles, szLog, szFifo);
+    apr_table_setn(pConfig->tSinkFifos, szFifo, szLog);
 
-        /* File might be relative to server root */
-        const char *szOrigName = ap_server_root_relative(p, pszLogFiles[i]);
-        const char *szNewName =
-            apr_psprintf(p, "%s.%s", szOrigName, szSuffix);
+    *(const char **) apr_array_push(pConfig->aLogFiles) = szLog;
 
-        /* Do nothing if the source doesn't exist */
-        apr_finfo_t fs;
-        nStatus = apr_stat(&fs, szOrigName, APR_FINFO_MTIME, p);
-        if (APR_STATUS_IS_ENOENT(nStatus)) {    /* File doesn't exist */
-            ap_log_perror(APLOG_MARK, APLOG_DEBUG, OK, p,
-                          "no file %s to rotate", szOrigName);
-            continue;
-        }
+    return NULL;
+}
 
-        /* Do nothing if the destination already exists */
-        nStatus = apr_stat(&fs, szNewName, APR_FINFO_MTIME, p);
-        if (nStatus == OK) {    /* File exists */
-            ap_log_perror(APLOG_MARK, APLOG_WARNING, OK, p,
-                          "mod_autorotate: destination already exists: %s ",
-                          szNewName);
-            continue;
-        };
 
-        nStatus = apr_file_rename(szOrigName, szNewName, p);
-        if (nStatus == APR_SUCCESS) {
-            ap_log_perror(APLOG_MARK, APLOG_INFO, OK, p,
-                          "mod_autorotate: Renamed %s to %s ", szOrigName,
-                          szNewName);
-            nNumRotated++;
-        }
-        else {
-            ap_log_perror(APLOG_MARK, APLOG_ERR, nStatus, p,
-                          "mod_autorotate: renaming %s to %s ", szOrigName,
-                          szNewName);
-        }
+#if defined(ENABLE_SIMULATION)
+/*
+ * Process the 'AutorotateSimulate' directive
+ * Takes the speed up and optionally a start time in seconds since the
+ * epoch
+ */
+static const char *cmd_rotate_simulate(cmd_parms * pCmd, void *pDummy,
+                                       const char *szSpeed,
+                                       const char *szStart)
+{
+    autorotate_config_t *pConfig;
+
+    AP_DEBUG_ASSERT(pCmd != NULL);
+    AP_DEBUG_ASSERT(szSpeed != NULL);
 
+    pConfig = ap_get_module_config(pCmd->server->module_config,
+                                   &autorotate_module);
+    AP_DEBUG_ASSERT(pConfig != NULL);
+
+    if (pCmd->server->is_virtual) {
+        return "AutorotateSimulate only supported in the main server";
     }
 
+    apr_int64_t nSpeed = apr_atoi64(szSpeed);
+    if (errno == ERANGE || nSpeed < 1 || nSpeed > 1000000) {
+        return "AutorotateSimulate speed out of range";
+    }
+    pConfig->nSimSpeed = nSpeed;
 
-    pgConfigData->bIsRotating = 0;
-    return (nNumRotated ? 1 : 0);
+    if (szStart) {
+        apr_int64_t nStart = apr_atoi64(szStart);
+        if (errno == ERANGE || nStart <= 0) {
+            return "AutorotateSimulate start time out of range";
+        }
+        pConfig->tSimStart = apr_time_from_sec(nStart);
+    }
+
+    return NULL;
 }
 
 
 /*
- * Checks whether all children are from the server's current generation
- * If they're not then we've just been gracefully restarted and there are
- * still some children left finishing old requests
+ * Process the 'AutorotateSimulateTree' directive
+ * Takes a scratch directory, the number of logs to make in it and the
+ * number of past periods to make archives for
  */
-static int is_fully_restarted(apr_pool_t * p)
+static const char *cmd_rotate_simulatetree(cmd_parms * pCmd, void *pDummy,
+                                           const char *szDir,
+                                           const char *szLogs,
+                                           const char *szPeriods)
 {
-    int nNumCurrent = 0, nNumOld = 0;
-    static int nIsRestarted = 0;
+    autorotate_config_t *pConfig;
 
-    AP_DEBUG_ASSERT(p != NULL);
+    AP_DEBUG_ASSERT(pCmd != NULL);
 
-    /* Cache the result once we know we're fully up and running, to save
-     * CPU cycles.  A server restart will reload this module and reset the
-     * static back to 0
-     */
-    if (nIsRestarted) {
-        return 1;
+    pConfig = ap_get_module_config(pCmd->server->module_config,
+                                   &autorotate_module);
+    AP_DEBUG_ASSERT(pConfig != NULL);
+
+    if (pCmd->server->is_virtual) {
+        return "AutorotateSimulateTree only supported in the main server";
     }
 
-    /* get the scoreboard */
-    global_score *pGlobalScore = ap_get_scoreboard_global();
-    if (!pGlobalScore) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, OK, NULL,
-                     "mod_autorotate: Error finding global scoreboard record");
-        return 0;
+    apr_int64_t nLogs = apr_atoi64(szLogs);
+    if (errno == ERANGE || nLogs < 1 || nLogs > 100000) {
+        return "AutorotateSimulateTree log count out of range";
+    }
+    apr_int64_t nPeriods = apr_atoi64(szPeriods);
+    if (errno == ERANGE || nPeriods < 0 || nPeriods > 100000) {
+        return "AutorotateSimulateTree period count out of range";
     }
 
-    /* Check each process's generation and worker status */
-    process_score *pProcScore;
-    int nProc;
-    for (nProc = 0; nProc < pGlobalScore->server_limit; nProc++) {
-        pProcScore = ap_get_scoreboard_process(nProc);
+    pConfig->szSimTreeDir = ap_server_root_relative(pCmd->pool, szDir);
+    pConfig->nSimTreeLogs = nLogs;
+    pConfig->nSimTreePeriods = nPeriods;
 
-        int nWorker;
-        for (nWorker = 0; nWorker < pGlobalScore->thread_limit; nWorker++) {
-            worker_score *pWorkerScore;
-            pWorkerScore = ap_get_scoreboard_worker(nProc, nWorker);
+    return NULL;
+}
+#endif
 
-            int nRes = pWorkerScore->status;
 
-            /* For debugging the scoreboard code */
-            /*
-               ap_log_perror(APLOG_MARK,APLOG_DEBUG,OK,p,
-               "Slot %02d  Thread %d: Gen %d, PID %d  %s %d",
-               nProc, nWorker,
-               pProcScore->generation,
-               pProcScore->pid,
-               (pProcScore->quiescing ? "Quiescing" : "Not Quiescing"),
-               nRes );
-             */
+/*
+ * Process the 'AutorotateTraceFile' directive
+ */
+static const char *cmd_rotate_tracefile(cmd_parms * pCmd, void *pDummy,
+                                        const char *szArg)
+{
+    autorotate_config_t *pConfig;
 
-            if (nRes != SERVER_DEAD &&
-                nRes != SERVER_STARTING && nRes != SERVER_IDLE_KILL) {
+    AP_DEBUG_ASSERT(pCmd != NULL);
+    AP_DEBUG_ASSERT(szArg != NULL);
 
-                if (pProcScore->generation ==
-                    pGlobalScore->running_generation)
-                    nNumCurrent++;
-                else
-                    nNumOld++;
+    pConfig = ap_get_module_config(pCmd->server->module_config,
+                                   &autorotate_module);
+    AP_DEBUG_ASSERT(pConfig != NULL);
 
-            }
-        }
+    if (pCmd->server->is_virtual) {
+        return "AutorotateTraceFile only supported in the main server";
     }
 
-    /* We're fully restarted if there are no previous generation
-     * processes around */
-    if (nNumOld == 0) {
-        ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
-                      "mod_autorotate: Now fully restarted (generation %d)",
-                      pGlobalScore->running_generation);
-        nIsRestarted = 1;
-        return 1;
-    }
+    pConfig->szTraceFile = ap_server_root_relative(pCmd->pool, szArg);
 
-    /* If we still have old process then cary of checking */
-    ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
-                  "mod_autorotate: Waiting for full restart: %d x current, %d x old",
-                  nNumCurrent, nNumOld);
-    return 0;
+    return NULL;
 }
 
 
-char *get_word(apr_pool_t * pool, int nWord, const char *szArgs)
+/*
+ * Process the 'AutorotateDrainTimeout' directive
+ * Takes the seconds to wait for the old generation to exit after a restart
+ */
+static const char *cmd_rotate_draintimeout(cmd_parms * pCmd, void *pDummy,
+                                           const char *szArg)
 {
-    AP_DEBUG_ASSERT(pool != NULL);
-    AP_DEBUG_ASSERT(szArgs != NULL);
+    autorotate_config_t *pConfig;
 
-    /* ap_getword_conf modifies the args to copy them first */
-    char *szCopy = apr_pstrdup(pool, szArgs);
-    char *szWord;
-    int nArg = 1;
+    AP_DEBUG_ASSERT(pCmd != NULL);
+    AP_DEBUG_ASSERT(szArg != NULL);
 
-    /* Grab the nth argument */
-    while (*szCopy && nArg <= nWord) {
-        szWord = ap_getword_conf(pool, &szArgs);
-        nArg++;
+    pConfig = ap_get_module_config(pCmd->server->module_config,
+                                   &autorotate_module);
+    AP_DEBUG_ASSERT(pConfig != NULL);
+
+    if (pCmd->server->is_virtual) {
+        return "AutorotateDrainTimeout only supported in the main server";
     }
 
-    return (*szWord ? szWord : NULL);
+    pConfig->nDrainTimeout = atoi(szArg);
+    if (pConfig->nDrainTimeout < 0) {
+        return "AutorotateDrainTimeout out of range";
+    }
+
+    return NULL;
 }
 
 
-/* Find the log file argument for all supported configuration directives
+/*
+ * Process the 'AutorotateArchiveDir' directive
+ * Takes the directory and optionally how deep to partition it: Year, Month
+ * or Day
  */
-static void
-find_log_names(autorotate_config_t * pConfig, apr_pool_t * pool,
-               server_rec * s, apr_table_t * tLogFiles, ap_directive_t * node)
+static const char *cmd_rotate_archivedir(cmd_parms * pCmd, void *pDummy,
+                                         const char *szDir,
+                                         const char *szDepth)
 {
-    ap_directive_t *dir;
-    char *szWord = NULL;
-
-    /* Cycle the directives at this level */
-    for (dir = node; dir; dir = dir->next) {
+    autorotate_config_t *pConfig;
 
-        /* Look for a match with the directives we handle */
-        directive_map_list_t *pItem = pConfig->pDirectiveList;
-        while (pItem) {
+    AP_DEBUG_ASSERT(pCmd != NULL);
+    AP_DEBUG_ASSERT(szDir != NULL);
+
+    pConfig = ap_get_module_config(pCmd->server->module_config,
+                                   &autorotate_module);
+    AP_DEBUG_ASSERT(pConfig != NULL);
+
+    if (pCmd->server->is_virtual) {
+        return "AutorotateArchiveDir only supported in the main server";
+    }
+
+    if (!szDepth) {
+        pConfig->ePartition = PARTITION_AUTO;
+    }
+    else if (!strcasecmp(szDepth, "Year")) {
+        pConfig->ePartition = PARTITION_YEAR;
+    }
+    else if (!strcasecmp(szDepth, "Month")) {
+        pConfig->ePartition = PARTITION_MONTH;
+    }
+    else if (!strcasecmp(szDepth, "Day")) {
+        pConfig->ePartition = PARTITION_DAY;
+    }
+    else {
+        return "AutorotateArchiveDir partitioning must be Year, Month or Day";
+    }
+
+    /* Always ends in a slash, so the partition can just be appended */
+    apr_size_t nLen = strlen(szDir);
+    while (nLen > 1 && szDir[nLen - 1] == '/') {
+        nLen--;
+    }
+    if (nLen + 1 > APR_PATH_MAX) {
+        return "AutorotateArchiveDir too long";
+    }
+    apr_cpystrn(pConfig->szArchiveDir, szDir, nLen + 1);
+    strcat(pConfig->szArchiveDir, "/");
+
+    return NULL;
+}
+
+
+/*
+ * Process the 'AutorotateExternalLog' directive
+ *
+ * Takes the log of another service, the pidfile of the process writing
+ * it, and the signal that makes it reopen its logs: one of USR1 (the
+ * default, as for nginx), USR2 or HUP.  The log is rotated, pruned and
+ * compressed like the server's own, without restarting the server.
+ */
+static const char *cmd_rotate_externallog(cmd_parms * pCmd, void *pDummy,
+                                          const char *szLog,
+                                          const char *szPidFile,
+                                          const char *szSignal)
+{
+    autorotate_config_t *pConfig;
+
+    AP_DEBUG_ASSERT(pCmd != NULL);
+    AP_DEBUG_ASSERT(szLog != NULL);
+    AP_DEBUG_ASSERT(szPidFile != NULL);
+
+    pConfig = ap_get_module_config(pCmd->server->module_config,
+                                   &autorotate_module);
+    AP_DEBUG_ASSERT(pConfig != NULL);
+
+    if (pCmd->server->is_virtual) {
+        return "AutorotateExternalLog only supported in the main server";
+    }
+
+    external_log_t *pLog = apr_palloc(pCmd->pool, sizeof(external_log_t));
+    pLog->szLogPath = ap_server_root_relative(pCmd->pool, szLog);
+    pLog->szPidFile = ap_server_root_relative(pCmd->pool, szPidFile);
+
+    if (!szSignal || !strcasecmp(szSignal, "USR1")) {
+        pLog->nSignal = SIGUSR1;
+    }
+    else if (!strcasecmp(szSignal, "USR2")) {
+        pLog->nSignal = SIGUSR2;
+    }
+    else if (!strcasecmp(szSignal, "HUP")) {
+        pLog->nSignal = SIGHUP;
+    }
+    else {
+        return "AutorotateExternalLog signal must be USR1, USR2 or HUP";
+    }
+
+    apr_hash_set(pConfig->hExternalLogs, pLog->szLogPath,
+                 APR_HASH_KEY_STRING, pLog);
+    *(const char **) apr_array_push(pConfig->aLogFiles) = pLog->szLogPath;
+
+    return NULL;
+}
+
+
+/*
+ * Handler for the 'monitor' hook
+ *
+ * Runs every 10 seconds in the caretaker process.
+ * Make sure that this routine is kept light weight!
+ */
+static int monitor_func(apr_pool_t * p)
+{
+    AP_DEBUG_ASSERT(pgConfigData != NULL);
+    AP_DEBUG_ASSERT(p != NULL);
+
+    /* Why wouldn't we have a valid global config ? */
+    if (pgConfigData == NULL) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, OK, p,
+                      "mod_autorotate: NULL configuration found - bug?");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* Do nothing if we're not enabled */
+    if (!pgConfigData->bEnabled)
+        return DECLINED;
+
+    /* Bring the log sink back if it died.  This can't wait for a rotation
+     * or a restart to finish: the parent holds the FIFOs open, so the
+     * server's writers block rather than fail once they fill. */
+    if (pgConfigData->sinkInfo.aStreams->nelts &&
+        pgConfigData->sinkInfo.pPool && !pgConfigData->sinkInfo.pProc) {
+        run_log_sink(&pgConfigData->sinkInfo);
+    }
+
+    /* The parent lives for months, so nothing a run allocates may
+     * outlive it.  Work in a scratch pool that's cleared afterwards. */
+    if (!pgConfigData->pCyclePool &&
+        apr_pool_create(&pgConfigData->pCyclePool, p) != APR_SUCCESS) {
+        pgConfigData->pCyclePool = NULL;
+        return DECLINED;
+    }
+
+    int rc = monitor_cycle(p, pgConfigData->pCyclePool);
+    apr_pool_clear(pgConfigData->pCyclePool);
+
+    return rc;
+}
+
+
+/*
+ * One run of the monitor.  pconf is only for what must outlive the run,
+ * everything else comes from the scratch pool p.
+ */
+static int monitor_cycle(apr_pool_t * pconf, apr_pool_t * p)
+{
+    /* Do nothing if we're currently rotating */
+    if (pgConfigData->bIsRotating)
+        return DECLINED;
+
+    /* Don't do anything until the server is fully restarted, except
+     * compress what the old generation has closed if it's taking too long */
+    if (!is_fully_restarted(pconf, p)) {
+        if (drain_timed_out(p)) {
+            start_compression();
+        }
+        return DECLINED;
+    }
+
+    /* Pick up the archives left out when the drain timed out */
+    if (pgConfigData->bRequeueAfterDrain &&
+        pgConfigData->compressInfo.aCompressQueue == NULL) {
+        pgConfigData->bRequeueAfterDrain = 0;
+        create_compress_queue(pconf, p, pgConfigData);
+    }
+
+    /* Check if a rotate is due */
+    apr_time_t tNow = pgClock();
+    if (tNow >= pgConfigData->tNextRotate) {
+        ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
+                      "mod_autorotate: Log rotation now due");
+
+        trace_span_t sCycle;
+        trace_begin(&sCycle, "rotation_cycle");
+
+        /* Prune old logs */
+        do_prune(p);
+
+        /* Rotate and record whether we need a restart */
+        int nNeedRestart = do_rotate(p, NULL);
+
+        /* Signal a restart if we rotated any files.  Otherwise only
+         * truncated logs have new archives, so queue them for compression
+         * now rather than at the restart */
+        if (nNeedRestart) {
+            restart_server(p, pgConfigData);
+        }
+        else if (pgConfigData->compressInfo.aCompressQueue == NULL) {
+            create_compress_queue(pconf, p, pgConfigData);
+        }
+
+        record_next_rotate_time(p, pgConfigData);
+
+        /* Archive sizes have changed, so look at disk usage again now */
+        pgConfigData->tNextSpaceCheck = 0;
+
+        trace_end(p, &sCycle, apr_psprintf(p, "\"restart\":%d",
+                                           nNeedRestart));
+
+#if defined(ENABLE_SIMULATION)
+        if (pgClock == sim_clock) {
+            struct rusage sUsage;
+            char szAscTime[APR_CTIME_LEN + 1];
+
+            getrusage(RUSAGE_SELF, &sUsage);
+            apr_ctime(szAscTime, tNow);
+            ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
+                          "mod_autorotate: Simulated cycle %" APR_UINT64_T_FMT
+                          " at %s: %" APR_INT64_T_FMT " us, %"
+                          APR_UINT64_T_FMT " probes, %" APR_UINT64_T_FMT
+                          " archives, %ld KB max RSS",
+                          ++pgMetrics->nSimCycles, szAscTime,
+                          (apr_int64_t) (apr_time_now() - sCycle.tStart),
+                          ngSimProbes, ngSimArchives, sUsage.ru_maxrss);
+            ngSimProbes = 0;
+            ngSimArchives = 0;
+        }
+#endif
+    }
+
+    /* Enforce the disk space limits, if there are any */
+    if ((pgConfigData->nKeepBytes || pgConfigData->nKeepFreePct) &&
+        (tNow >= pgConfigData->tNextSpaceCheck)) {
+        do_space_prune(p);
+        pgConfigData->tNextSpaceCheck = tNow + SPACE_CHECK_INTERVAL;
+    }
+
+    /* Queue what external writers have closed since they were told to
+     * reopen their logs */
+    release_held_jobs(p);
+
+    start_compression();
+
+    return OK;
+}
+
+
+/*
+ * Start compressing if something has filled the queue and it hasn't
+ * started yet
+ */
+static void start_compression(void)
+{
+    if ((pgConfigData->compressInfo.aCompressQueue != NULL) &&
+        (pgConfigData->compressInfo.szLogPath == NULL)) {
+
+        pgConfigData->compressInfo.szCompressProgram =
+            pgConfigData->szCompressProgram;
+        pgConfigData->compressInfo.szCompressSuffix =
+            pgConfigData->szCompressSuffix;
+        run_next_compress_child(&pgConfigData->compressInfo);
+
+    }
+
+    pgMetrics->nQueueDepth =
+        (pgConfigData->compressInfo.aCompressQueue ?
+         pgConfigData->compressInfo.aCompressQueue->nelts : 0) +
+        (pgConfigData->compressInfo.szLogPath ? 1 : 0);
+}
+
+static void restart_server(apr_pool_t * ptemp, autorotate_config_t * pConfig)
+{
+    AP_DEBUG_ASSERT(pConfig != NULL);
+    AP_DEBUG_ASSERT(ptemp != NULL);
+
+    /* Drained once is_fully_restarted() says so */
+    pgMetrics->tRestartRequested = apr_time_now();
+
+    if (pConfig->eRestartMethod == GRACEFUL) {
+        ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, ptemp,
+                      "mod_autorotate: Requesting graceful restart");
+        kill(getpid(), AP_SIG_GRACEFUL);
+    }
+    else {
+        ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, ptemp,
+                      "mod_autorotate: Requesting FULL restart");
+        kill(getpid(), SIGHUP);
+    }
+}
+
+
+/*
+ *  Remove old log files
+ */
+static int do_prune(apr_pool_t * p)
+{
+    AP_DEBUG_ASSERT(pgConfigData != NULL);
+    AP_DEBUG_ASSERT(p != NULL);
+
+    /* Decline to prune if KeepLogs is zero */
+    if (pgConfigData->nKeepLogs == 0) {
+        ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
+                      "mod_autorotate: Log pruning disabled");
+        return OK;
+    }
+
+    pgConfigData->bIsRotating = 1;
+    ap_log_perror(APLOG_MARK, APLOG_DEBUG, OK, p,
+                  "mod_autorotate: Pruning logs");
+
+    trace_span_t sSpan;
+    apr_uint64_t nPruned = pgMetrics->nFilesPruned;
+    trace_begin(&sSpan, "do_prune");
+
+
+    /* Cycle through the log files */
+
+    /* Each log's paths are only needed while it's being pruned */
+    apr_pool_t *pIter;
+    if (apr_pool_create(&pIter, p) != APR_SUCCESS) {
+        pgConfigData->bIsRotating = 0;
+        return OK;
+    }
+
+    int i;
+    char **pszLogFiles = (char **) pgConfigData->aLogFiles->elts;
+    for (i = 0; i < pgConfigData->aLogFiles->nelts; i++) {
+        /* File might be relative to server root */
+        const char *szOrigName =
+            ap_server_root_relative(pIter, pszLogFiles[i]);
+
+        /* go back one period at a time, decrementing the number to keep
+         * each time a log exists for that previous period.  After we get to
+         * zero, start deleting for subsequent periods */
+
+        int nNumFound = 0;
+        walk_archives(pIter, szOrigName, -1, prune_archive_cb, &nNumFound);
+
+        apr_pool_clear(pIter);
+    }                           /* End for (log file) */
+
+    apr_pool_destroy(pIter);
+
+    trace_end(p, &sSpan, apr_psprintf(p, "\"logs\":%d,\"pruned\":%"
+                                      APR_UINT64_T_FMT,
+                                      pgConfigData->aLogFiles->nelts,
+                                      pgMetrics->nFilesPruned - nPruned));
+
+    pgConfigData->bIsRotating = 0;
+    return OK;
+}
+
+
+/*
+ * Archive callback for do_prune().  pvBaton points to the number of
+ * periods found so far for this log.  A container is only removed once
+ * all the periods it covers are due for removal.
+ */
+static void
+prune_archive_cb(apr_pool_t * p, const archive_info_t * pArchive,
+                 void *pvBaton)
+{
+    int *pnNumFound = pvBaton;
+
+    (*pnNumFound)++;
+
+    if (*pnNumFound >= pgConfigData->nKeepLogs) {
+        apr_status_t nStatus = apr_file_remove(pArchive->szPath, p);
+        if (nStatus == APR_SUCCESS) {
+            ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
+                          "mod_autorotate: Removed %s", pArchive->szPath);
+            remove_empty_partitions(p, pArchive);
+            pgMetrics->nFilesPruned++;
+        }
+        else {
+            ap_log_perror(APLOG_MARK, APLOG_ERR, nStatus, p,
+                          "mod_autorotate: removing %s ", pArchive->szPath);
+        }
+    }
+
+    if (pArchive->bContainer) {
+        *pnNumFound += pArchive->nPeriods - 1;
+    }
+}
+
+
+/*
+ * Look for the plain and compressed archives of a single period and pass
+ * any that exist to pFunc
+ */
+static void
+probe_period(apr_pool_t * p, const char *szOrigName, char *szSuffix,
+             apr_time_t tStart, apr_time_t tEnd,
+             archive_cb_func_t * pFunc, void *pvBaton)
+{
+    const char *szArchive = archive_name(p, szOrigName, szSuffix, tStart);
+
+    int bCompressed;
+    for (bCompressed = 0; bCompressed <= 1; bCompressed++) {
+        const char *szName =
+            apr_pstrcat(p, szArchive,
+                        bCompressed ? pgConfigData->szCompressSuffix : "",
+                        NULL);
+
+        apr_finfo_t fs;
+#if defined(ENABLE_SIMULATION)
+        ngSimProbes++;
+#endif
+        if (apr_stat(&fs, szName, APR_FINFO_SIZE, p) == APR_SUCCESS) {
+#if defined(ENABLE_SIMULATION)
+            ngSimArchives++;
+#endif
+            archive_info_t sArchive;
+            sArchive.szPath = szName;
+            sArchive.szOrigName = szOrigName;
+            sArchive.nSize = fs.size;
+            sArchive.tPeriodStart = tStart;
+            sArchive.tPeriodEnd = tEnd;
+            sArchive.bCompressed = bCompressed;
+            sArchive.bContainer = 0;
+            sArchive.nPeriods = 1;
+            pFunc(p, &sArchive, pvBaton);
+        }
+    }
+}
+
+
+/*
+ * Length of a rotate period in the wall clock time periods are worked out
+ * in, or zero for months, which vary
+ */
+static apr_interval_time_t period_length(rotate_interval_t ePeriod)
+{
+    switch (ePeriod) {
+    case HOURLY:
+        return apr_time_from_sec(60 * 60);
+    case DAILY:
+        return apr_time_from_sec(24 * 60 * 60);
+    case WEEKLY:
+        return apr_time_from_sec(7 * 24 * 60 * 60);
+#if defined(ENABLE_PERMINUTE)
+    case PERMINUTE:
+        return apr_time_from_sec(60);
+#endif
+    default:
+        return 0;
+    }
+}
+
+
+/*
+ * Call pFunc for each archive of the given log, newest first, starting
+ * nFirstPeriod periods from now and going back up to 100 periods.
+ *
+ * When consolidating, periods before the current container period are
+ * looked for in containers instead, going back up to 100 container
+ * periods.  The individual archives of a container period are only probed
+ * for when it has no container yet.
+ */
+static void
+walk_archives(apr_pool_t * p, const char *szOrigName, int nFirstPeriod,
+              archive_cb_func_t * pFunc, void *pvBaton)
+{
+    char szSuffix[256] = "";
+    int nPeriod = nFirstPeriod;
+    apr_time_t tStart;
+    apr_time_t tEnd = offset_period_start(nPeriod + 1,
+                                          pgConfigData->eInterval,
+                                          pgConfigData->nOffset);
+
+    /* Start of the current container period */
+    apr_time_t tHorizon = 0;
+    if (pgConfigData->bConsolidate) {
+        tHorizon = offset_period_start(0, pgConfigData->eConsolidate,
+                                       pgConfigData->nOffset);
+    }
+
+    for (; nPeriod > -100; nPeriod--, tEnd = tStart) {
+        tStart = offset_period_start(nPeriod, pgConfigData->eInterval,
+                                     pgConfigData->nOffset);
+        if (tStart < tHorizon) {
+            break;
+        }
+
+        probe_period(p, szOrigName, szSuffix, tStart, tEnd, pFunc, pvBaton);
+    }
+
+    if (!pgConfigData->bConsolidate) {
+        return;
+    }
+
+    apr_interval_time_t nLength = period_length(pgConfigData->eInterval);
+    int nContainer;
+    for (nContainer = -1; nContainer > -100; nContainer--) {
+        archive_info_t sContainer;
+        apr_finfo_t fs;
+
+        sContainer.tPeriodStart =
+            offset_period_start(nContainer, pgConfigData->eConsolidate,
+                                pgConfigData->nOffset);
+        sContainer.tPeriodEnd = tEnd;
+        sContainer.szPath = container_name(p, szOrigName, szSuffix,
+                                           sContainer.tPeriodStart);
+        sContainer.szOrigName = szOrigName;
+        sContainer.bCompressed = 1;
+        sContainer.bContainer = 1;
+        sContainer.nPeriods = 0;
+
+        int bFound = (apr_stat(&fs, sContainer.szPath, APR_FINFO_SIZE, p)
+                      == APR_SUCCESS);
+        sContainer.nSize = bFound ? fs.size : 0;
+
+        /* Step over the rotate periods this container covers, in one go
+         * when there's nothing to probe for and they're all as long */
+        if (bFound && nLength) {
+            int nSkip = (int) ((tEnd - sContainer.tPeriodStart) / nLength);
+            nPeriod -= nSkip;
+            tEnd -= nSkip * nLength;
+            sContainer.nPeriods = nSkip;
+        }
+        for (; !bFound || !nLength; nPeriod--, tEnd = tStart) {
+            tStart = offset_period_start(nPeriod, pgConfigData->eInterval,
+                                         pgConfigData->nOffset);
+            if (tStart < sContainer.tPeriodStart) {
+                break;
+            }
+
+            if (!bFound && nPeriod > -100) {
+                probe_period(p, szOrigName, szSuffix, tStart, tEnd,
+                             pFunc, pvBaton);
+            }
+            sContainer.nPeriods++;
+        }
+
+        if (bFound) {
+            pFunc(p, &sContainer, pvBaton);
+        }
+    }
+}
+
+
+/*
+ * Name of the container holding the archives of the consolidation period
+ * starting at tStart, eg. access_log.20130401-00:00:00.daily.gz
+ */
+static const char *
+container_name(apr_pool_t * p, const char *szOrigName, char *szSuffix,
+               apr_time_t tStart)
+{
+    return apr_psprintf(p, "%s.%s%s",
+                        archive_name(p, szOrigName, szSuffix, tStart),
+                        pgConfigData->szConsolidateName,
+                        pgConfigData->szCompressSuffix);
+}
+
+
+/*
+ * Return the directory that a log's archives are kept under, including
+ * the trailing slash.  Under an absolute AutorotateArchiveDir, each log's
+ * directory is mirrored, so logs of the same name in different
+ * directories don't share archive names.
+ */
+static const char *archive_root(apr_pool_t * p, const char *szOrigName)
+{
+    const char *szArchiveDir = pgConfigData->szArchiveDir;
+
+    if (!*szArchiveDir) {
+        return log_dir_name(p, szOrigName);
+    }
+    if (*szArchiveDir == '/') {
+        return apr_pstrcat(p, szArchiveDir, log_dir_name(p, szOrigName) + 1,
+                           NULL);
+    }
+
+    return apr_pstrcat(p, log_dir_name(p, szOrigName), szArchiveDir, NULL);
+}
+
+
+/*
+ * Name of the archive of a log for the period starting at tStart, eg.
+ * access_log.20130401-00:00:00 or archive/2013/04/access_log.20130401-00:00:00
+ * with AutorotateArchiveDir.  The formatted suffix is left in szSuffix.
+ */
+static const char *
+archive_name(apr_pool_t * p, const char *szOrigName, char *szSuffix,
+             apr_time_t tStart)
+{
+    apr_time_exp_t tExp;
+    apr_time_exp_lt(&tExp, tStart);
+
+    apr_size_t nSuffixLen;
+    apr_strftime(szSuffix, &nSuffixLen, 255, pgConfigData->szFormat, &tExp);
+
+    if (!pgConfigData->szArchiveDir[0]) {
+        return apr_psprintf(p, "%s.%s", szOrigName, szSuffix);
+    }
+
+    static const char *const aPartitionFormats[] =
+        { "", "%Y/", "%Y/%m/", "%Y/%m/%d/" };
+    char szPartition[16];
+    apr_size_t nPartitionLen;
+    apr_strftime(szPartition, &nPartitionLen, sizeof(szPartition) - 1,
+                 aPartitionFormats[pgConfigData->ePartition], &tExp);
+
+    return apr_psprintf(p, "%s%s%s.%s", archive_root(p, szOrigName),
+                        szPartition, apr_filepath_name_get(szOrigName),
+                        szSuffix);
+}
+
+
+/*
+ * Make sure the directory an archive is to be written to exists.
+ * Directories already made or seen are remembered, so this costs nothing
+ * for all but the first archive of each partition.
+ */
+static apr_status_t make_archive_dir(apr_pool_t * p, const char *szPath)
+{
+    if (!pgConfigData->szArchiveDir[0]) {
+        return APR_SUCCESS;
+    }
+
+    const char *szDir = log_dir_name(p, szPath);
+    if (apr_hash_get(pgConfigData->hArchiveDirs, szDir, APR_HASH_KEY_STRING)) {
+        return APR_SUCCESS;
+    }
+
+    apr_status_t rc = apr_dir_make_recursive(szDir, APR_OS_DEFAULT, p);
+    if (rc != APR_SUCCESS && !APR_STATUS_IS_EEXIST(rc)) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                      "mod_autorotate: couldn't create archive directory %s",
+                      szDir);
+        return rc;
+    }
+
+    apr_pool_t *pHashPool = apr_hash_pool_get(pgConfigData->hArchiveDirs);
+    szDir = apr_pstrdup(pHashPool, szDir);
+    apr_hash_set(pgConfigData->hArchiveDirs, szDir, APR_HASH_KEY_STRING,
+                 szDir);
+
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Remove the partition directories above a removed archive that are now
+ * empty, stopping at the first that isn't
+ */
+static void remove_empty_partitions(apr_pool_t * p,
+                                    const archive_info_t * pArchive)
+{
+    if (!pgConfigData->szArchiveDir[0]) {
+        return;
+    }
+
+    const char *szRoot = archive_root(p, pArchive->szOrigName);
+    apr_size_t nRootLen = strlen(szRoot);
+    char *szDir = apr_pstrdup(p, pArchive->szPath);
+
+    for (;;) {
+        char *szSlash = strrchr(szDir, '/');
+        if (!szSlash || (apr_size_t) (szSlash - szDir) < nRootLen) {
+            break;
+        }
+        *szSlash = '\0';
+
+        if (apr_dir_remove(szDir, p) != APR_SUCCESS) {
+            break;
+        }
+        apr_hash_set(pgConfigData->hArchiveDirs,
+                     apr_pstrcat(p, szDir, "/", NULL), APR_HASH_KEY_STRING,
+                     NULL);
+    }
+}
+
+
+/*
+ * Containers are made by concatenating compressed archives, so they can
+ * only be made from formats that allow that and give us somewhere to
+ * put an index that decompressors will skip
+ */
+static container_codec_t container_codec(const char *szSuffix)
+{
+    if (strcmp(szSuffix, ".gz") == 0) {
+        return CONTAINER_GZIP;
+    }
+    if (strcmp(szSuffix, ".zst") == 0) {
+        return CONTAINER_ZSTD;
+    }
+
+    return CONTAINER_NONE;
+}
+
+
+/*
+ * Return the directory part of a path, including the trailing slash
+ */
+static const char *log_dir_name(apr_pool_t * p, const char *szPath)
+{
+    return apr_pstrndup(p, szPath, apr_filepath_name_get(szPath) - szPath);
+}
+
+
+/*
+ * Archive callback for find_archives().  pvBaton is the array of
+ * archive_info_t to add to.
+ */
+static void
+collect_archive_cb(apr_pool_t * p, const archive_info_t * pArchive,
+                   void *pvBaton)
+{
+    *(archive_info_t *) apr_array_push(pvBaton) = *pArchive;
+}
+
+
+/*
+ * Find the archives of every log.  Returns a hash of log directory name to
+ * an array of archive_info_t.  walk_archives() only probes so many periods
+ * back, so the archive directories are then looked through for any older
+ * ones, which space limits have to count too.
+ */
+static apr_hash_t *find_archives(apr_pool_t * p)
+{
+    apr_hash_t *hDirs = apr_hash_make(p);
+
+    /* Every log's archive name prefix, eg. access_log. */
+    apr_array_header_t *aPrefixes =
+        apr_array_make(p, pgConfigData->aLogFiles->nelts, sizeof(char *));
+
+    int i;
+    char **pszLogFiles = (char **) pgConfigData->aLogFiles->elts;
+    for (i = 0; i < pgConfigData->aLogFiles->nelts; i++) {
+        *(const char **) apr_array_push(aPrefixes) =
+            apr_pstrcat(p, apr_filepath_name_get(pszLogFiles[i]), ".", NULL);
+    }
+
+    for (i = 0; i < pgConfigData->aLogFiles->nelts; i++) {
+        /* File might be relative to server root */
+        const char *szOrigName = ap_server_root_relative(p, pszLogFiles[i]);
+        const char *szDir = archive_root(p, szOrigName);
+
+        apr_array_header_t *aArchives =
+            apr_hash_get(hDirs, szDir, APR_HASH_KEY_STRING);
+        if (!aArchives) {
+            aArchives = apr_array_make(p, 16, sizeof(archive_info_t));
+            apr_hash_set(hDirs, szDir, APR_HASH_KEY_STRING, aArchives);
+        }
+
+        int nFirst = aArchives->nelts;
+        walk_archives(p, szOrigName, 0, collect_archive_cb, aArchives);
+
+        apr_hash_t *hSeen = apr_hash_make(p);
+        int j;
+        for (j = nFirst; j < aArchives->nelts; j++) {
+            const char *szPath = ((archive_info_t *) aArchives->elts)[j].szPath;
+            apr_hash_set(hSeen, szPath, APR_HASH_KEY_STRING, szPath);
+        }
+        scan_archives(p, szDir, pgConfigData->szArchiveDir[0] ? 3 : 0,
+                      szOrigName, aPrefixes, hSeen, collect_archive_cb,
+                      aArchives);
+    }
+
+    return hDirs;
+}
+
+
+/*
+ * Call pFunc for each archive of the given log found in szDir, and in the
+ * partitions up to nDepth below it, that isn't in hSeen.  Files of other
+ * logs whose archive names start with this one's, given in aPrefixes, are
+ * left out, as are dictionaries and files still being written.  Which
+ * period such an archive is of can't be told from its name, so its age is
+ * taken from when it was last written.
+ */
+static void
+scan_archives(apr_pool_t * p, const char *szDir, int nDepth,
+              const char *szOrigName, const apr_array_header_t * aPrefixes,
+              apr_hash_t * hSeen, archive_cb_func_t * pFunc, void *pvBaton)
+{
+    const char *szBase = apr_filepath_name_get(szOrigName);
+    const char *szPrefix = apr_pstrcat(p, szBase, ".", NULL);
+    const char *szDictionary = apr_pstrcat(p, szBase, DICTIONARY_LINK, NULL);
+    const char *szSuffix = pgConfigData->szCompressSuffix;
+    const char *szContainer = apr_pstrcat(p, ".",
+                                          pgConfigData->szConsolidateName,
+                                          szSuffix, NULL);
+    apr_size_t nPrefixLen = strlen(szPrefix);
+    apr_size_t nDictionaryLen = strlen(szDictionary);
+    apr_size_t nSuffixLen = strlen(szSuffix);
+    apr_size_t nContainerLen = strlen(szContainer);
+    const char **pszPrefixes = (const char **) aPrefixes->elts;
+    apr_dir_t *pDir;
+    apr_finfo_t fs;
+
+    if (apr_dir_open(&pDir, szDir, p) != APR_SUCCESS) {
+        return;
+    }
+
+    while (apr_dir_read(&fs, APR_FINFO_NAME | APR_FINFO_TYPE, pDir)
+           == APR_SUCCESS) {
+        if (fs.filetype == APR_DIR) {
+            if (nDepth > 0 && fs.name[0] != '.') {
+                scan_archives(p, apr_pstrcat(p, szDir, fs.name, "/", NULL),
+                              nDepth - 1, szOrigName, aPrefixes, hSeen,
+                              pFunc, pvBaton);
+            }
+            continue;
+        }
+
+        apr_size_t nLen = strlen(fs.name);
+        if (fs.filetype != APR_REG ||
+            strncmp(fs.name, szPrefix, nPrefixLen) ||
+            !strncmp(fs.name, szDictionary, nDictionaryLen) ||
+            (nLen > 4 && !strcmp(fs.name + nLen - 4, ".tmp"))) {
+            continue;
+        }
+
+        int i, bOther = 0;
+        for (i = 0; !bOther && i < aPrefixes->nelts; i++) {
+            apr_size_t nOtherLen = strlen(pszPrefixes[i]);
+            bOther = (nOtherLen > nPrefixLen &&
+                      !strncmp(pszPrefixes[i], szPrefix, nPrefixLen) &&
+                      !strncmp(fs.name, pszPrefixes[i], nOtherLen));
+        }
+        if (bOther) {
+            continue;
+        }
+
+        const char *szPath = apr_pstrcat(p, szDir, fs.name, NULL);
+        apr_finfo_t fsFile;
+        if (apr_hash_get(hSeen, szPath, APR_HASH_KEY_STRING) ||
+            apr_stat(&fsFile, szPath, APR_FINFO_SIZE | APR_FINFO_MTIME, p)
+            != APR_SUCCESS) {
+            continue;
+        }
+
+        archive_info_t sArchive;
+        sArchive.szPath = szPath;
+        sArchive.szOrigName = szOrigName;
+        sArchive.nSize = fsFile.size;
+        sArchive.tPeriodStart = fsFile.mtime;
+        sArchive.tPeriodEnd = fsFile.mtime;
+        sArchive.bCompressed = (nSuffixLen && nLen > nSuffixLen &&
+                                !strcmp(fs.name + nLen - nSuffixLen,
+                                        szSuffix));
+        sArchive.bContainer = (pgConfigData->bConsolidate &&
+                               nLen > nContainerLen &&
+                               !strcmp(fs.name + nLen - nContainerLen,
+                                       szContainer));
+        sArchive.nPeriods = 1;
+        pFunc(p, &sArchive, pvBaton);
+    }
+
+    apr_dir_close(pDir);
+}
+
+
+/*
+ * Work out how many bytes need freeing in a log directory to bring it
+ * back within AutorotateKeepBytes
+ */
+static apr_off_t keep_bytes_needed(const apr_array_header_t * aArchives)
+{
+    const archive_info_t *pArchives =
+        (const archive_info_t *) aArchives->elts;
+    apr_off_t nUsed = 0;
+    int i;
+
+    if (!pgConfigData->nKeepBytes) {
+        return 0;
+    }
+
+    for (i = 0; i < aArchives->nelts; i++) {
+        if (pArchives[i].szPath) {
+            nUsed += pArchives[i].nSize;
+        }
+    }
+
+    return (nUsed > pgConfigData->nKeepBytes)
+        ? nUsed - pgConfigData->nKeepBytes : 0;
+}
+
+
+/*
+ * Work out how many bytes need freeing on the filesystem holding the
+ * given directory to bring it back within AutorotateKeepFree
+ */
+static apr_off_t keep_free_needed(apr_pool_t * p, const char *szDir)
+{
+    struct statvfs sStat;
+
+    if (statvfs(szDir, &sStat) != 0) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, errno, p,
+                      "mod_autorotate: couldn't get free space of %s",
+                      szDir);
+        return 0;
+    }
+
+    apr_off_t nWant = (apr_off_t) sStat.f_blocks * sStat.f_frsize
+        / 100 * pgConfigData->nKeepFreePct;
+    apr_off_t nFree = (apr_off_t) sStat.f_bavail * sStat.f_frsize;
+
+    return (nWant > nFree) ? nWant - nFree : 0;
+}
+
+
+/*
+ * Whether the given archive is the log being compressed right now, or
+ * the output of that compression
+ */
+static int is_compressing(apr_pool_t * p, const char *szPath)
+{
+    compress_child_info_t *pInfo = &pgConfigData->compressInfo;
+
+    if (pInfo->szLogPath == NULL) {
+        return 0;
+    }
+
+    return (strcmp(szPath, pInfo->szLogPath) == 0 ||
+            strcmp(szPath, apr_pstrcat(p, pInfo->szLogPath,
+                                       pgConfigData->szCompressSuffix,
+                                       NULL)) == 0);
+}
+
+
+/* qsort() comparisons for archive_info_t and pointers to them */
+static int archive_cmp_age(const void *pvA, const void *pvB)
+{
+    const archive_info_t *pA = pvA, *pB = pvB;
+
+    return (pA->tPeriodStart > pB->tPeriodStart) -
+        (pA->tPeriodStart < pB->tPeriodStart);
+}
+
+static int archive_cmp_age_ptr(const void *pvA, const void *pvB)
+{
+    return archive_cmp_age(*(archive_info_t * const *) pvA,
+                           *(archive_info_t * const *) pvB);
+}
+
+static int archive_cmp_size(const void *pvA, const void *pvB)
+{
+    const archive_info_t *pA = *(archive_info_t * const *) pvA;
+    const archive_info_t *pB = *(archive_info_t * const *) pvB;
+
+    return (pA->nSize > pB->nSize) - (pA->nSize < pB->nSize);
+}
+
+
+/*
+ * Put the given archives at the head of the compress queue, biggest first.
+ * Anything already queued keeps its place behind them, apart from the
+ * archives in hRemoved, which have been deleted to free space.
+ */
+static void
+queue_emergency_compress(apr_pool_t * p, apr_array_header_t * aToCompress,
+                         apr_hash_t * hRemoved)
+{
+    compress_child_info_t *pInfo = &pgConfigData->compressInfo;
+    archive_info_t **ppArchives = (archive_info_t **) aToCompress->elts;
+    apr_array_header_t *aOld = pInfo->aCompressQueue;
+    apr_hash_t *hQueued = apr_hash_make(p);
+    int i, nQueue = 0;
+
+    /* Some may have been deleted after all, or found over two limits */
+    for (i = 0; i < aToCompress->nelts; i++) {
+        if (ppArchives[i]->szPath &&
+            !apr_hash_get(hQueued, ppArchives[i]->szPath,
+                          APR_HASH_KEY_STRING)) {
+            apr_hash_set(hQueued, ppArchives[i]->szPath, APR_HASH_KEY_STRING,
+                         ppArchives[i]);
+            ppArchives[nQueue++] = ppArchives[i];
+        }
+    }
+
+    if (nQueue == 0 && (aOld == NULL || apr_hash_count(hRemoved) == 0)) {
+        return;
+    }
+
+    /* The queue is popped from the end, so sort the biggest last */
+    qsort(ppArchives, nQueue, sizeof(archive_info_t *), archive_cmp_size);
+
+    apr_array_header_t *aNew =
+        apr_array_make(pInfo->pPool, nQueue + (aOld ? aOld->nelts : 0),
+                       sizeof(compress_job_t));
+
+    if (aOld) {
+        compress_job_t *pJobs = (compress_job_t *) aOld->elts;
+        for (i = 0; i < aOld->nelts; i++) {
+            if (!apr_hash_get(hQueued, pJobs[i].szLogPath,
+                              APR_HASH_KEY_STRING) &&
+                !apr_hash_get(hRemoved, pJobs[i].szLogPath,
+                              APR_HASH_KEY_STRING)) {
+                *(compress_job_t *) apr_array_push(aNew) = pJobs[i];
+            }
+        }
+    }
+
+    for (i = 0; i < nQueue; i++) {
+        compress_job_t *pJob = apr_array_push(aNew);
+        pJob->szLogPath = apr_pstrdup(pInfo->pPool, ppArchives[i]->szPath);
+        pJob->szOrigName =
+            apr_pstrdup(pInfo->pPool, ppArchives[i]->szOrigName);
+        pJob->tPeriodStart = ppArchives[i]->tPeriodStart;
+        pJob->tPeriodEnd = ppArchives[i]->tPeriodEnd;
+        pJob->bConsolidate = 0;
+    }
+
+    if (nQueue) {
+        ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
+                      "mod_autorotate: Compressing %d archives early to "
+                      "free space", nQueue);
+    }
+
+    pInfo->aCompressQueue = aNew;
+}
+
+
+/*
+ * Free nNeed bytes from the given archives, sorted oldest first: add the
+ * ones not yet compressed to aToCompress and then, if compressing them
+ * won't save enough, delete the oldest.  Deleted archives are added to
+ * hRemoved and their szPath cleared.
+ */
+static void
+free_archive_space(apr_pool_t * p, const char *szWhat,
+                   archive_info_t ** ppArchives, int nArchives,
+                   apr_off_t nNeed, int bCanCompress,
+                   apr_array_header_t * aToCompress, apr_hash_t * hRemoved)
+{
+    apr_off_t nSaving = 0;
+    int i;
+
+    ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
+                  "mod_autorotate: %s is over its space limits by %"
+                  APR_OFF_T_FMT " bytes", szWhat, nNeed);
+
+    /* First try compressing whatever isn't already */
+    for (i = 0; bCanCompress && i < nArchives; i++) {
+        if (ppArchives[i]->szPath && !ppArchives[i]->bCompressed &&
+            !is_compressing(p, ppArchives[i]->szPath) &&
+            !is_held(ppArchives[i]->szPath)) {
+            *(archive_info_t **) apr_array_push(aToCompress) = ppArchives[i];
+            nSaving += ppArchives[i]->nSize / 100 * COMPRESS_SAVING_PCT;
+        }
+    }
+
+    /* Then delete the oldest until that will be enough */
+    for (i = 0; i < nArchives && nNeed > nSaving; i++) {
+        archive_info_t *pArchive = ppArchives[i];
+
+        if (pArchive->szPath == NULL || is_compressing(p, pArchive->szPath) ||
+            is_held(pArchive->szPath)) {
+            continue;
+        }
+
+        apr_status_t nStatus = apr_file_remove(pArchive->szPath, p);
+        if (nStatus == APR_SUCCESS) {
+            ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
+                          "mod_autorotate: Removed %s to free space",
+                          pArchive->szPath);
+            remove_empty_partitions(p, pArchive);
+            pgMetrics->nFilesPruned++;
+            nNeed -= pArchive->nSize;
+            if (bCanCompress && !pArchive->bCompressed) {
+                nSaving -= pArchive->nSize / 100 * COMPRESS_SAVING_PCT;
+            }
+            apr_hash_set(hRemoved, pArchive->szPath, APR_HASH_KEY_STRING,
+                         pArchive->szPath);
+            pArchive->szPath = NULL;
+        }
+        else {
+            ap_log_perror(APLOG_MARK, APLOG_ERR, nStatus, p,
+                          "mod_autorotate: removing %s ", pArchive->szPath);
+        }
+    }
+}
+
+
+/*
+ *  Keep each log directory within AutorotateKeepBytes and each log
+ *  filesystem above AutorotateKeepFree.  When a directory is over its
+ *  limits, first compress its biggest uncompressed archives and then, if
+ *  compression alone won't free enough, delete its oldest archives.  The
+ *  free space of a filesystem is shared by every log directory on it, so
+ *  its deficit is worked out once and freed from the oldest archives of
+ *  all of them.  Called from the monitor, so limits apply without a
+ *  restart.
+ */
+static void do_space_prune(apr_pool_t * pParent)
+{
+    compress_child_info_t *pInfo = &pgConfigData->compressInfo;
+    apr_pool_t *p;
+
+    AP_DEBUG_ASSERT(pgConfigData != NULL);
+    AP_DEBUG_ASSERT(pParent != NULL);
+
+    if (apr_pool_create(&p, pParent) != APR_SUCCESS) {
+        return;
+    }
+
+    trace_span_t sSpan;
+    apr_uint64_t nPruned = pgMetrics->nFilesPruned;
+    trace_begin(&sSpan, "do_space_prune");
+
+    /* Only count on compression to free space if it's been succeeding;
+     * it may well be failing because the disk is full */
+    int bCanCompress = (pgConfigData->nCompressAfter != 0 &&
+                        pInfo->pPool != NULL && pInfo->nFailures == 0);
+    pInfo->nFailures = 0;
+
+    apr_array_header_t *aToCompress =
+        apr_array_make(p, 16, sizeof(archive_info_t *));
+    apr_hash_t *hRemoved = apr_hash_make(p);
+
+    /* Archives of every log directory on each filesystem, keyed by
+     * device, and a directory on it to find its free space from */
+    apr_hash_t *hDevices = apr_hash_make(p);
+    apr_hash_t *hDeviceDirs = apr_hash_make(p);
+
+    apr_hash_t *hDirs = find_archives(p);
+    apr_hash_index_t *hi;
+    for (hi = apr_hash_first(p, hDirs); hi; hi = apr_hash_next(hi)) {
+        const void *pvDir;
+        void *pvArchives;
+        apr_hash_this(hi, &pvDir, NULL, &pvArchives);
+
+        const char *szDir = pvDir;
+        apr_array_header_t *aArchives = pvArchives;
+
+        qsort(aArchives->elts, aArchives->nelts, sizeof(archive_info_t),
+              archive_cmp_age);
+
+        apr_array_header_t *aPtrs =
+            apr_array_make(p, aArchives->nelts, sizeof(archive_info_t *));
+        int i;
+        for (i = 0; i < aArchives->nelts; i++) {
+            *(archive_info_t **) apr_array_push(aPtrs) =
+                &((archive_info_t *) aArchives->elts)[i];
+        }
+
+        apr_off_t nNeed = keep_bytes_needed(aArchives);
+        if (nNeed > 0) {
+            free_archive_space(p, szDir, (archive_info_t **) aPtrs->elts,
+                               aPtrs->nelts, nNeed, bCanCompress,
+                               aToCompress, hRemoved);
+        }
+
+        apr_finfo_t sInfo;
+        if (!pgConfigData->nKeepFreePct ||
+            apr_stat(&sInfo, szDir, APR_FINFO_DEV, p) != APR_SUCCESS) {
+            continue;
+        }
+
+        apr_dev_t *pDev = apr_pmemdup(p, &sInfo.device, sizeof(apr_dev_t));
+        apr_array_header_t *aDevice =
+            apr_hash_get(hDevices, pDev, sizeof(apr_dev_t));
+        if (aDevice == NULL) {
+            aDevice = apr_array_make(p, aPtrs->nelts,
+                                     sizeof(archive_info_t *));
+            apr_hash_set(hDevices, pDev, sizeof(apr_dev_t), aDevice);
+            apr_hash_set(hDeviceDirs, pDev, sizeof(apr_dev_t), szDir);
+        }
+        apr_array_cat(aDevice, aPtrs);
+    }
+
+    for (hi = apr_hash_first(p, hDevices); hi; hi = apr_hash_next(hi)) {
+        const void *pvDev;
+        void *pvArchives;
+        apr_hash_this(hi, &pvDev, NULL, &pvArchives);
+
+        const char *szDir = apr_hash_get(hDeviceDirs, pvDev,
+                                         sizeof(apr_dev_t));
+        apr_array_header_t *aDevice = pvArchives;
+
+        apr_off_t nNeed = keep_free_needed(p, szDir);
+        if (nNeed <= 0) {
+            continue;
+        }
+
+        qsort(aDevice->elts, aDevice->nelts, sizeof(archive_info_t *),
+              archive_cmp_age_ptr);
+        free_archive_space(p, apr_pstrcat(p, "filesystem of ", szDir, NULL),
+                           (archive_info_t **) aDevice->elts, aDevice->nelts,
+                           nNeed, bCanCompress, aToCompress, hRemoved);
+    }
+
+    if (pInfo->pPool != NULL) {
+        queue_emergency_compress(p, aToCompress, hRemoved);
+    }
+
+    trace_end(p, &sSpan, apr_psprintf(p, "\"pruned\":%" APR_UINT64_T_FMT
+                                      ",\"compress\":%d",
+                                      pgMetrics->nFilesPruned - nPruned,
+                                      aToCompress->nelts));
+
+    apr_pool_destroy(p);
+}
+
+
+
+/*
+ * Rotate the log files, and return whether we did anything or not
+ */
+static int do_rotate(apr_pool_t * p, apr_array_header_t * aList)
+{
+    AP_DEBUG_ASSERT(pgConfigData != NULL);
+    AP_DEBUG_ASSERT(p != NULL);
+
+    int nNumRotated = 0;
+    int nNumReopen = 0;
+    apr_status_t nStatus;
+
+    /* Writers of external logs to signal, external_log_t keyed by pidfile */
+    apr_hash_t *hSignal = apr_hash_make(p);
+
+    ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
+                  "mod_autorotate: Rotating logs");
+    pgConfigData->bIsRotating = 1;
+
+    apr_time_t tBegan = apr_time_now();
+    int nNumFiles = 0;
+
+    trace_span_t sSpan;
+    trace_begin(&sSpan, "do_rotate");
+
+    /* Start of the current period -+ offset */
+    apr_time_t tStart = offset_period_start(-1, pgConfigData->eInterval,
+                                            pgConfigData->nOffset);
+
+    apr_time_exp_t tExp;
+    apr_time_exp_lt(&tExp, tStart);
+
+    /* Suffix to append to log file names */
+    char szSuffix[256];
+    apr_size_t nSuffixLen;
+    apr_strftime(szSuffix, &nSuffixLen, 255, pgConfigData->szFormat, &tExp);
+
+    ap_log_perror(APLOG_MARK, APLOG_DEBUG, OK, p,
+                  "log file suffix: %s", szSuffix);
+
+    /* Array of log files to use might be specified */
+    if (!aList) {
+        aList = pgConfigData->aLogFiles;
+    }
+
+    /* Per-file scratch, cleared before each file.  hSignal and what goes
+     * into it must outlive the loop, so they stay in p */
+    apr_pool_t *pIter;
+    if (apr_pool_create(&pIter, p) != APR_SUCCESS) {
+        pgConfigData->bIsRotating = 0;
+        return 0;
+    }
+
+    /* Cycle through the log files */
+    char **pszLogFiles = (char **) aList->elts;
+
+    int i;
+    for (i = 0; i < aList->nelts; i++) {
+        apr_pool_clear(pIter);
+
+        /* File might be relative to server root */
+        const char *szOrigName =
+            ap_server_root_relative(pIter, pszLogFiles[i]);
+        const char *szNewName =
+            archive_name(pIter, szOrigName, szSuffix, tStart);
+
+        /* Do nothing if the source doesn't exist */
+        apr_finfo_t fs;
+        nStatus = apr_stat(&fs, szOrigName, APR_FINFO_MTIME, pIter);
+        if (APR_STATUS_IS_ENOENT(nStatus)) {    /* File doesn't exist */
+            ap_log_perror(APLOG_MARK, APLOG_DEBUG, OK, pIter,
+                          "no file %s to rotate", szOrigName);
+            continue;
+        }
+
+        /* Do nothing if the destination already exists */
+        nStatus = apr_stat(&fs, szNewName, APR_FINFO_MTIME, pIter);
+        if (nStatus == OK) {    /* File exists */
+            ap_log_perror(APLOG_MARK, APLOG_WARNING, OK, pIter,
+                          "mod_autorotate: destination already exists: %s ",
+                          szNewName);
+            continue;
+        };
+
+        if (make_archive_dir(pIter, szNewName) != APR_SUCCESS) {
+            continue;
+        }
+
+        trace_span_t sFile;
+        trace_begin(&sFile, "rotate_file");
+        if (apr_stat(&fs, szOrigName, APR_FINFO_SIZE, pIter)
+            != APR_SUCCESS) {
+            fs.size = 0;
+        }
+
+        /* Writers of these keep their descriptor, so no restart needed */
+        if (apr_table_get(pgConfigData->tTruncateFiles, szOrigName)) {
+            nStatus = truncate_rotate(pIter, szOrigName, szNewName);
+            if (nStatus != APR_SUCCESS) {
+                ap_log_perror(APLOG_MARK, APLOG_ERR, nStatus, pIter,
+                              "mod_autorotate: copying %s to %s ",
+                              szOrigName, szNewName);
+            }
+            else {
+                nNumFiles++;
+            }
+            trace_end(pIter, &sFile,
+                      apr_psprintf(pIter, "\"file\":%s,\"bytes\":%"
+                                   APR_OFF_T_FMT ",\"mode\":\"truncate\"",
+                                   json_string(pIter, szOrigName), fs.size));
+            continue;
+        }
+
+        nStatus = apr_file_rename(szOrigName, szNewName, pIter);
+        if (nStatus == APR_SUCCESS) {
+            ap_log_perror(APLOG_MARK, APLOG_INFO, OK, pIter,
+                          "mod_autorotate: Renamed %s to %s ", szOrigName,
+                          szNewName);
+            nNumFiles++;
+
+            external_log_t *pExternal =
+                apr_hash_get(pgConfigData->hExternalLogs, szOrigName,
+                             APR_HASH_KEY_STRING);
+
+            /* The log sink reopens its own logs, the server needn't */
+            if (apr_table_get(pgConfigData->tSinkFiles, szOrigName)) {
+                nNumReopen++;
+            }
+            else if (pExternal) {
+                apr_hash_set(hSignal, pExternal->szPidFile,
+                             APR_HASH_KEY_STRING, pExternal);
+            }
+            else {
+                nNumRotated++;
+            }
+        }
+        else {
+            ap_log_perror(APLOG_MARK, APLOG_ERR, nStatus, pIter,
+                          "mod_autorotate: renaming %s to %s ", szOrigName,
+                          szNewName);
+        }
+
+        trace_end(pIter, &sFile,
+                  apr_psprintf(pIter, "\"file\":%s,\"bytes\":%"
+                               APR_OFF_T_FMT ",\"mode\":\"rename\"",
+                               json_string(pIter, szOrigName), fs.size));
+
+    }
+
+    apr_pool_destroy(pIter);
+
+    /* Tell the writers of external logs to reopen them, once each */
+    apr_hash_index_t *hi;
+    for (hi = apr_hash_first(p, hSignal); hi; hi = apr_hash_next(hi)) {
+        external_log_t *pExternal;
+        apr_hash_this(hi, NULL, NULL, (void **) &pExternal);
+        signal_pidfile(p, pExternal->szPidFile, pExternal->nSignal);
+    }
+
+    /* Tell the log sink to move on to the new files */
+    if (nNumReopen && pgConfigData->sinkInfo.pProc) {
+        ap_log_perror(APLOG_MARK, APLOG_INFO, OK, p,
+                      "mod_autorotate: Asking log sink to reopen %d logs",
+                      nNumReopen);
+        apr_proc_kill(pgConfigData->sinkInfo.pProc, SIGHUP);
+    }
+
+    trace_end(p, &sSpan, apr_psprintf(p, "\"files\":%d", nNumFiles));
+
+    pgMetrics->tLastRotate = tBegan;
+    pgMetrics->nRotateUsec = apr_time_now() - tBegan;
+    pgMetrics->nRotations++;
+    pgMetrics->nFilesRotated += nNumFiles;
+
+    pgConfigData->bIsRotating = 0;
+    return (nNumRotated ? 1 : 0);
+}
+
+
+/*
+ * Read the process ID in the given pidfile into *pnPid, which is left 0
+ * if there's none in it
+ */
+static apr_status_t read_pidfile(apr_pool_t * p, const char *szPidFile,
+                                 long *pnPid)
+{
+    char szPid[32];
+    apr_size_t nLen = sizeof(szPid) - 1;
+    apr_file_t *pFile;
+
+    *pnPid = 0;
+    apr_status_t rc = apr_file_open(&pFile, szPidFile, APR_FOPEN_READ,
+                                    APR_OS_DEFAULT, p);
+    if (rc == APR_SUCCESS) {
+        rc = apr_file_read(pFile, szPid, &nLen);
+        apr_file_close(pFile);
+    }
+    if (rc == APR_SUCCESS) {
+        szPid[nLen] = '\0';
+        *pnPid = strtol(szPid, NULL, 10);
+    }
+
+    return rc;
+}
+
+
+/*
+ * Send a signal to the process whose ID is in the given pidfile
+ */
+static void signal_pidfile(apr_pool_t * p, const char *szPidFile,
+                           int nSignal)
+{
+    long nPid;
+    apr_status_t rc = read_pidfile(p, szPidFile, &nPid);
+    if (rc != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                      "mod_autorotate: couldn't read pidfile %s", szPidFile);
+        return;
+    }
+
+    if (nPid <= 1) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, OK, p,
+                      "mod_autorotate: no process ID in pidfile %s",
+                      szPidFile);
+        return;
+    }
+
+    if (kill((pid_t) nPid, nSignal) != 0) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, errno, p,
+                      "mod_autorotate: couldn't signal process %ld from %s",
+                      nPid, szPidFile);
+        return;
+    }
+
+    ap_log_perror(APLOG_MARK, APLOG_INFO, OK, p,
+                  "mod_autorotate: Sent signal %d to process %ld from %s",
+                  nSignal, nPid, szPidFile);
+}
+
+
+/*
+ * Copy nLen bytes from nOffset in one descriptor to the current position
+ * of another.  Uses copy_file_range() so the data needn't pass through
+ * user space, falling back to read and write where that isn't possible.
+ */
+static apr_status_t
+copy_range(int nIn, apr_off_t nOffset, int nOut, apr_off_t nLen)
+{
+#if defined(__NR_copy_file_range)
+    loff_t nInOff = nOffset;
+    while (nLen > 0) {
+        ssize_t n = syscall(__NR_copy_file_range, nIn, &nInOff, nOut, NULL,
+                            (size_t) nLen, 0);
+        if (n > 0) {
+            nLen -= n;
+        }
+        else if (n == 0) {
+            return APR_EOF;
+        }
+        else if (errno == EINTR) {
+            continue;
+        }
+        else if (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                 errno == EOPNOTSUPP) {
+            break;
+        }
+        else {
+            return errno;
+        }
+    }
+    nOffset = nInOff;
+#endif
+
+    char aBuf[COMPRESS_BUF_SZ];
+    while (nLen > 0) {
+        ssize_t nRead = pread(nIn, aBuf, nLen < sizeof(aBuf) ?
+                              (size_t) nLen : sizeof(aBuf), nOffset);
+        if (nRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nRead <= 0) {
+            return nRead ? errno : APR_EOF;
+        }
+
+        ssize_t nDone = 0;
+        while (nDone < nRead) {
+            ssize_t nWritten = write(nOut, aBuf + nDone, nRead - nDone);
+            if (nWritten < 0 && errno == EINTR) {
+                continue;
+            }
+            if (nWritten < 0) {
+                return errno;
+            }
+            nDone += nWritten;
+        }
+
+        nOffset += nRead;
+        nLen -= nRead;
+    }
+
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Rotate a log without renaming it, for writers that keep their
+ * descriptor open.  The content is copied to the archive and the copied
+ * range freed in place: collapsed out of the file where the filesystem
+ * allows it, otherwise punched out leaving a hole.  Only whole blocks are
+ * freed, so a partial last block stays for the next rotation.  Without
+ * either, the file is truncated after copying, losing anything written in
+ * between.  Writers must open the log with O_APPEND.
+ */
+static apr_status_t
+truncate_rotate(apr_pool_t * p, const char *szOrigName, const char *szNewName)
+{
+    apr_file_t *pSrc, *pDst;
+    apr_os_file_t nSrc, nDst;
+    struct stat sStat;
+    apr_status_t rc;
+
+    if ((rc = apr_file_open(&pSrc, szOrigName,
+                            APR_FOPEN_READ | APR_FOPEN_WRITE |
+                            APR_FOPEN_BINARY, APR_OS_DEFAULT,
+                            p)) != APR_SUCCESS) {
+        return rc;
+    }
+    apr_os_file_get(&nSrc, pSrc);
+
+    if (fstat(nSrc, &sStat) != 0) {
+        rc = errno;
+        apr_file_close(pSrc);
+        return rc;
+    }
+
+    /* Stop short of the end, which must stay in place for the collapse */
+    apr_off_t nStart = 0;
+    apr_off_t nEnd = 0;
+    if (sStat.st_size > 0 && sStat.st_blksize > 0) {
+        nEnd = ((sStat.st_size - 1) / sStat.st_blksize) * sStat.st_blksize;
+    }
+
+#if defined(SEEK_DATA)
+    /* Skip any hole left by an earlier punch */
+    off_t nData = lseek(nSrc, 0, SEEK_DATA);
+    if (nData > 0) {
+        nStart = (nData < nEnd) ? nData : nEnd;
+    }
+#endif
+
+    if (nEnd <= nStart) {
+        ap_log_perror(APLOG_MARK, APLOG_INFO, OK, p,
+                      "mod_autorotate: less than a block in %s, leaving it "
+                      "for the next rotation", szOrigName);
+        apr_file_close(pSrc);
+        return APR_SUCCESS;
+    }
+
+    if ((rc = apr_file_open(&pDst, szNewName,
+                            APR_FOPEN_WRITE | APR_FOPEN_CREATE |
+                            APR_FOPEN_EXCL | APR_FOPEN_BINARY,
+                            APR_OS_DEFAULT, p)) != APR_SUCCESS) {
+        apr_file_close(pSrc);
+        return rc;
+    }
+    apr_os_file_get(&nDst, pDst);
+
+    /* The copy must be on disk before the original goes */
+    rc = copy_range(nSrc, nStart, nDst, nEnd - nStart);
+    if (rc == APR_SUCCESS && fdatasync(nDst) != 0) {
+        rc = errno;
+    }
+
+    const char *szHow = NULL;
+#if defined(FALLOC_FL_COLLAPSE_RANGE)
+    if (rc == APR_SUCCESS &&
+        fallocate(nSrc, FALLOC_FL_COLLAPSE_RANGE, 0, nEnd) == 0) {
+        szHow = "collapsed";
+    }
+#endif
+#if defined(FALLOC_FL_PUNCH_HOLE)
+    if (rc == APR_SUCCESS && !szHow &&
+        fallocate(nSrc, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  nStart, nEnd - nStart) == 0) {
+        szHow = "punched";
+    }
+#endif
+    if (rc == APR_SUCCESS && !szHow) {
+        /* Take the rest as well, then empty the file */
+        if (fstat(nSrc, &sStat) != 0) {
+            rc = errno;
+        }
+        else if ((rc = copy_range(nSrc, nEnd, nDst,
+                                  sStat.st_size - nEnd)) == APR_SUCCESS) {
+            rc = apr_file_trunc(pSrc, 0);
+            szHow = "truncated";
+        }
+    }
+
+    apr_file_close(pSrc);
+    apr_status_t rcClose = apr_file_close(pDst);
+    if (rc == APR_SUCCESS) {
+        rc = rcClose;
+    }
+
+    if (rc != APR_SUCCESS) {
+        apr_file_remove(szNewName, p);
+        return rc;
+    }
+
+    ap_log_perror(APLOG_MARK, APLOG_INFO, OK, p,
+                  "mod_autorotate: Copied %s to %s and %s it", szOrigName,
+                  szNewName, szHow);
+
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Whether the scoreboard still has the given process as a live child of
+ * an earlier generation
+ */
+static int is_old_child(global_score * pGlobalScore, pid_t nPid)
+{
+    apr_proc_t sProc;
+    sProc.pid = nPid;
+
+    int nProc = ap_find_child_by_pid(&sProc);
+    if (nProc < 0 || ap_get_scoreboard_process(nProc)->generation ==
+        pGlobalScore->running_generation) {
+        return 0;
+    }
+
+    int nWorker;
+    for (nWorker = 0; nWorker < pGlobalScore->thread_limit; nWorker++) {
+        if (ap_get_scoreboard_worker(nProc, nWorker)->status != SERVER_DEAD) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Checks whether all children are from the server's current generation
+ * If they're not then we've just been gracefully restarted and there are
+ * still some children left finishing old requests
+ */
+static int is_fully_restarted(apr_pool_t * pconf, apr_pool_t * p)
+{
+    static int nIsRestarted = 0;
+
+    AP_DEBUG_ASSERT(p != NULL);
+
+    /* Cache the result once we know we're fully up and running, to save
+     * CPU cycles.  A server restart will reload this module and reset the
+     * static back to 0
+     */
+    if (nIsRestarted) {
+        return 1;
+    }
+
+    /* get the scoreboard */
+    global_score *pGlobalScore = ap_get_scoreboard_global();
+    if (!pGlobalScore) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, OK, NULL,
+                     "mod_autorotate: Error finding global scoreboard record");
+        return 0;
+    }
+
+    /* Sweep the scoreboard once for the old generation's processes.  After
+     * that only they need looking at, however many worker slots there are
+     */
+    if (!pgConfigData->aDrainPids) {
+        pgConfigData->aDrainPids = apr_array_make(pconf, 8, sizeof(pid_t));
+        pgConfigData->tDrainStart = pgMetrics->tRestartRequested ?
+            pgMetrics->tRestartRequested : apr_time_now();
+
+        process_score *pProcScore;
+        int nProc;
+        for (nProc = 0; nProc < pGlobalScore->server_limit; nProc++) {
+            pProcScore = ap_get_scoreboard_process(nProc);
+            if (pProcScore->pid <= 0 ||
+                pProcScore->generation == pGlobalScore->running_generation) {
+                continue;
+            }
+
+            /* A process with only dead slots is long gone */
+            int nWorker;
+            for (nWorker = 0; nWorker < pGlobalScore->thread_limit;
+                 nWorker++) {
+                worker_score *pWorkerScore;
+                pWorkerScore = ap_get_scoreboard_worker(nProc, nWorker);
+
+                int nRes = pWorkerScore->status;
+                if (nRes != SERVER_DEAD &&
+                    nRes != SERVER_STARTING && nRes != SERVER_IDLE_KILL) {
+                    *(pid_t *) apr_array_push(pgConfigData->aDrainPids) =
+                        pProcScore->pid;
+                    break;
+                }
+            }
+        }
+    }
+
+    /* Forget those that have exited.  The MPM reaps its children, so they
+     * go as soon as they do, and the scoreboard is checked too so that a
+     * process ID reused since isn't taken for one of them */
+    pid_t *pPids = (pid_t *) pgConfigData->aDrainPids->elts;
+    int i, nNumOld = 0;
+    for (i = 0; i < pgConfigData->aDrainPids->nelts; i++) {
+        if (is_old_child(pGlobalScore, pPids[i]) &&
+            (kill(pPids[i], 0) == 0 || errno != ESRCH)) {
+            pPids[nNumOld++] = pPids[i];
+        }
+    }
+    pgConfigData->aDrainPids->nelts = nNumOld;
+
+    /* We're fully restarted if there are no previous generation
+     * processes around */
+    if (nNumOld == 0) {
+        apr_time_t tNow = apr_time_now();
+        ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
+                      "mod_autorotate: Now fully restarted (generation %d) "
+                      "after %" APR_INT64_T_FMT " s",
+                      pGlobalScore->running_generation,
+                      (apr_int64_t) apr_time_sec(tNow -
+                                                 pgConfigData->tDrainStart));
+        nIsRestarted = 1;
+        pgMetrics->nDrainUsec = tNow - pgConfigData->tDrainStart;
+
+        if (pgMetrics->tRestartRequested) {
+            trace_span_t sDrain;
+            trace_begin(&sDrain, "restart_drain");
+            sDrain.tStart = pgMetrics->tRestartRequested;
+            sDrain.nCpuStart = -1;
+            trace_end(p, &sDrain, apr_psprintf(p, "\"generation\":%d",
+                                               pGlobalScore->
+                                               running_generation));
+            pgMetrics->tRestartRequested = 0;
+        }
+        return 1;
+    }
+
+    /* If we still have old process then cary of checking */
+    ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
+                  "mod_autorotate: Waiting for full restart: %d x old",
+                  nNumOld);
+    return 0;
+}
+
+
+/*
+ * Add the identities of the files a process has open to hOpen, a set of
+ * file_ident_t.  Files are compared by device and inode, as the paths
+ * the process opened them by needn't be those we know them by.
+ */
+static apr_status_t add_open_files(apr_pool_t * p, pid_t nPid,
+                                   apr_hash_t * hOpen)
+{
+    const char *szFdDir = apr_psprintf(p, "/proc/%ld/fd/", (long) nPid);
+    apr_dir_t *pDir;
+    apr_status_t rc = apr_dir_open(&pDir, szFdDir, p);
+    if (rc != APR_SUCCESS) {
+        return rc;
+    }
+
+    apr_finfo_t fi;
+    while (apr_dir_read(&fi, APR_FINFO_NAME, pDir) == APR_SUCCESS) {
+        struct stat sStat;
+        if (fi.name[0] == '.' ||
+            stat(apr_pstrcat(p, szFdDir, fi.name, NULL), &sStat) != 0 ||
+            !S_ISREG(sStat.st_mode)) {
+            continue;
+        }
+
+        file_ident_t *pIdent = apr_pcalloc(p, sizeof(*pIdent));
+        pIdent->nDev = sStat.st_dev;
+        pIdent->nIno = sStat.st_ino;
+        apr_hash_set(hOpen, pIdent, sizeof(*pIdent), pIdent);
+    }
+    apr_dir_close(pDir);
+
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Whether the file at the given path is in hOpen, from add_open_files()
+ */
+static int is_open(apr_hash_t * hOpen, const char *szPath)
+{
+    struct stat sStat;
+    file_ident_t sIdent;
+
+    if (stat(szPath, &sStat) != 0) {
+        return 0;
+    }
+
+    memset(&sIdent, 0, sizeof(sIdent));
+    sIdent.nDev = sStat.st_dev;
+    sIdent.nIno = sStat.st_ino;
+    return apr_hash_get(hOpen, &sIdent, sizeof(sIdent)) != NULL;
+}
+
+
+/*
+ * Add the files a process and its children, and theirs, have open to
+ * hOpen.  Returns whether they could all be looked at; a process that has
+ * gone has nothing open.  Children are found from /proc/PID/task/TID/
+ * children, so only as far down as nDepth.
+ */
+static int add_process_files(apr_pool_t * p, pid_t nPid, int nDepth,
+                             apr_hash_t * hOpen)
+{
+    apr_status_t rc = add_open_files(p, nPid, hOpen);
+    if (rc != APR_SUCCESS) {
+        return APR_STATUS_IS_ENOENT(rc);
+    }
+    if (nDepth <= 0) {
+        return 1;
+    }
+
+    const char *szTaskDir = apr_psprintf(p, "/proc/%ld/task/", (long) nPid);
+    apr_dir_t *pDir;
+    apr_finfo_t fi;
+    int bKnown = 1;
+
+    if (apr_dir_open(&pDir, szTaskDir, p) != APR_SUCCESS) {
+        return 1;
+    }
+    while (apr_dir_read(&fi, APR_FINFO_NAME, pDir) == APR_SUCCESS) {
+        apr_file_t *pFile;
+        char ch;
+        long nChild = 0;
+
+        if (!apr_isdigit(fi.name[0]) ||
+            apr_file_open(&pFile, apr_pstrcat(p, szTaskDir, fi.name,
+                                              "/children", NULL),
+                          APR_FOPEN_READ | APR_FOPEN_BUFFERED,
+                          APR_OS_DEFAULT, p) != APR_SUCCESS) {
+            continue;
+        }
+
+        /* A line of process IDs separated by spaces */
+        for (;;) {
+            int bEnd = (apr_file_getc(&ch, pFile) != APR_SUCCESS);
+            if (!bEnd && apr_isdigit(ch)) {
+                nChild = nChild * 10 + (ch - '0');
+                continue;
+            }
+            if (nChild) {
+                bKnown &= add_process_files(p, (pid_t) nChild, nDepth - 1,
+                                            hOpen);
+                nChild = 0;
+            }
+            if (bEnd) {
+                break;
+            }
+        }
+        apr_file_close(pFile);
+    }
+    apr_dir_close(pDir);
+
+    return bKnown;
+}
+
+
+/*
+ * Add the files that the writer of the given external or sink log, and
+ * its children, have open to hOpen.  Returns 0 if they couldn't all be
+ * looked at, when its archives are to be taken as still open.
+ */
+static int writer_open_files(apr_pool_t * p, const char *szOrigName,
+                             apr_hash_t * hOpen)
+{
+    external_log_t *pExternal =
+        apr_hash_get(pgConfigData->hExternalLogs, szOrigName,
+                     APR_HASH_KEY_STRING);
+
+    if (pExternal) {
+        long nPid;
+        apr_status_t rc = read_pidfile(p, pExternal->szPidFile, &nPid);
+        if (rc != APR_SUCCESS) {
+            /* No pidfile, no writer */
+            return APR_STATUS_IS_ENOENT(rc);
+        }
+        return nPid <= 1 || add_process_files(p, (pid_t) nPid, 3, hOpen);
+    }
+
+    if (pgConfigData->sinkInfo.pProc) {
+        return add_process_files(p, pgConfigData->sinkInfo.pProc->pid, 0,
+                                 hOpen);
+    }
+    return 1;
+}
+
+
+/*
+ * Queue the held back archives whose writers have closed them since.
+ * Only the writers' own files are looked at, and no more often than
+ * HELD_CHECK_INTERVAL.  Archives still open after HELD_TIMEOUT are let go
+ * of uncompressed, so a writer that never reopens its log doesn't keep
+ * this going.
+ */
+static void release_held_jobs(apr_pool_t * p)
+{
+    compress_child_info_t *pInfo = &pgConfigData->compressInfo;
+    apr_array_header_t *aHeld = pgConfigData->aHeldJobs;
+
+    if (!aHeld || !pInfo->pPool) {
+        return;
+    }
+
+    apr_time_t tNow = pgClock();
+    if (tNow < pgConfigData->tNextHeldCheck) {
+        return;
+    }
+    pgConfigData->tNextHeldCheck = tNow + HELD_CHECK_INTERVAL;
+    int bGiveUp = (tNow - pgConfigData->tHeldSince >= HELD_TIMEOUT);
+
+    /* The files each log's writer has open, or NULL if they couldn't all
+     * be looked at */
+    apr_hash_t *hWriters = apr_hash_make(p);
+    compress_job_t *pJobs = (compress_job_t *) aHeld->elts;
+    int i, nKept = 0;
+    for (i = 0; i < aHeld->nelts; i++) {
+        apr_hash_t **phOpen = apr_hash_get(hWriters, pJobs[i].szOrigName,
+                                           APR_HASH_KEY_STRING);
+        if (!phOpen) {
+            phOpen = apr_palloc(p, sizeof(*phOpen));
+            *phOpen = apr_hash_make(p);
+            if (!writer_open_files(p, pJobs[i].szOrigName, *phOpen)) {
+                *phOpen = NULL;
+            }
+            apr_hash_set(hWriters, pJobs[i].szOrigName, APR_HASH_KEY_STRING,
+                         phOpen);
+        }
+
+        if (!*phOpen || is_open(*phOpen, pJobs[i].szLogPath)) {
+            if (bGiveUp) {
+                ap_log_perror(APLOG_MARK, APLOG_WARNING, OK, p,
+                              "mod_autorotate: Gave up waiting for the "
+                              "writer of %s to close it, leaving it "
+                              "uncompressed", pJobs[i].szLogPath);
+                continue;
+            }
+            pJobs[nKept++] = pJobs[i];
+            continue;
+        }
+
+        if (!pInfo->aCompressQueue) {
+            pInfo->aCompressQueue =
+                apr_array_make(pInfo->pPool, 5, sizeof(compress_job_t));
+        }
+        compress_job_t *pJob = apr_array_push(pInfo->aCompressQueue);
+        *pJob = pJobs[i];
+        pJob->szLogPath = apr_pstrdup(pInfo->pPool, pJobs[i].szLogPath);
+        pJob->szOrigName = apr_pstrdup(pInfo->pPool, pJobs[i].szOrigName);
+    }
+
+    if (nKept == 0) {
+        apr_pool_clear(pgConfigData->pHeldPool);
+        pgConfigData->aHeldJobs = NULL;
+    }
+    else {
+        aHeld->nelts = nKept;
+    }
+}
+
+
+/*
+ * Whether the given archive is held back from compression
+ */
+static int is_held(const char *szPath)
+{
+    apr_array_header_t *aHeld = pgConfigData->aHeldJobs;
+    int i;
+
+    for (i = 0; aHeld && i < aHeld->nelts; i++) {
+        if (!strcmp(((compress_job_t *) aHeld->elts)[i].szLogPath, szPath)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Whether the old generation has been draining for longer than
+ * AutorotateDrainTimeout.  The first time it has, the archives it still
+ * has open are dropped from the compress queue so the rest can go ahead.
+ */
+static int drain_timed_out(apr_pool_t * p)
+{
+    if (!pgConfigData->nDrainTimeout ||
+        apr_time_now() - pgConfigData->tDrainStart <
+        apr_time_from_sec(pgConfigData->nDrainTimeout)) {
+        return 0;
+    }
+
+    if (!pgConfigData->bRequeueAfterDrain) {
+        if (!drop_open_jobs(p, &pgConfigData->compressInfo)) {
+            return 0;
+        }
+
+        ap_log_perror(APLOG_MARK, APLOG_WARNING, OK, p,
+                      "mod_autorotate: Restart still draining after %d s, "
+                      "compressing the archives it has closed",
+                      pgConfigData->nDrainTimeout);
+        pgMetrics->nDrainTimeouts++;
+        pgConfigData->bRequeueAfterDrain = 1;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Drop the jobs whose logs an old generation process still has open from
+ * the compress queue, and consolidations, which read many archives.  Open
+ * files are found from /proc/<pid>/fd.  Returns 0, leaving the queue
+ * alone, if those of any process can't be read.
+ */
+static int drop_open_jobs(apr_pool_t * p, compress_child_info_t * pInfo)
+{
+    if (!pInfo->aCompressQueue || pInfo->szLogPath) {
+        return 1;
+    }
+
+    apr_hash_t *hOpen = apr_hash_make(p);
+    pid_t *pPids = (pid_t *) pgConfigData->aDrainPids->elts;
+    int i;
+    for (i = 0; i < pgConfigData->aDrainPids->nelts; i++) {
+        apr_status_t rc = add_open_files(p, pPids[i], hOpen);
+        if (rc != APR_SUCCESS) {
+            ap_log_perror(APLOG_MARK, APLOG_WARNING, rc, p,
+                          "mod_autorotate: can't see the files process %ld "
+                          "has open, waiting for it to exit",
+                          (long) pPids[i]);
+            return 0;
+        }
+    }
+
+    /* Keep the queue in order, it's run from the end */
+    compress_job_t *pJobs = (compress_job_t *) pInfo->aCompressQueue->elts;
+    int nKept = 0;
+    for (i = 0; i < pInfo->aCompressQueue->nelts; i++) {
+        if (!pJobs[i].bConsolidate &&
+            !is_open(hOpen, pJobs[i].szLogPath)) {
+            pJobs[nKept++] = pJobs[i];
+        }
+    }
+
+    ap_log_perror(APLOG_MARK, APLOG_INFO, OK, p,
+                  "mod_autorotate: %d archives closed by the old generation, "
+                  "%d left until it exits", nKept,
+                  pInfo->aCompressQueue->nelts - nKept);
+    pInfo->aCompressQueue->nelts = nKept;
+
+    return 1;
+}
+
+
+char *get_word(apr_pool_t * pool, int nWord, const char *szArgs)
+{
+    AP_DEBUG_ASSERT(pool != NULL);
+    AP_DEBUG_ASSERT(szArgs != NULL);
+
+    /* ap_getword_conf modifies the args to copy them first */
+    char *szCopy = apr_pstrdup(pool, szArgs);
+    char *szWord;
+    int nArg = 1;
+
+    /* Grab the nth argument */
+    while (*szCopy && nArg <= nWord) {
+        szWord = ap_getword_conf(pool, &szArgs);
+        nArg++;
+    }
+
+    return (*szWord ? szWord : NULL);
+}
+
+
+/* Find the log file argument for all supported configuration directives
+ */
+static void
+find_log_names(autorotate_config_t * pConfig, apr_pool_t * pool,
+               server_rec * s, apr_table_t * tLogFiles, ap_directive_t * node)
+{
+    ap_directive_t *dir;
+    char *szWord = NULL;
+
+    /* Cycle the directives at this level */
+    for (dir = node; dir; dir = dir->next) {
+
+        /* Look for a match with the directives we handle */
+        directive_map_list_t *pItem = pConfig->pDirectiveList;
+        while (pItem) {
 
             if (apr_strnatcasecmp
                 (pItem->sDirective.szDirective, dir->directive) == 0) {
 
-                /* Get nth word of the directive arguments */
-                szWord =
-                    get_word(pool, pItem->sDirective.nArgIndex, dir->args);
-                if (szWord) {
-                    if (*szWord == '|') {
-                        ap_log_error(APLOG_MARK, APLOG_DEBUG, OK, s,
-                                     "Ignoring piped log %s", szWord);
-                    }
-                    else {
-                        apr_table_setn(tLogFiles, szWord, "");
-                        ap_log_error(APLOG_MARK, APLOG_INFO, OK, s,
-                                     "mod_autorotate: Log file for directive [%s] found: [%s]",
-                                     dir->directive, szWord);
-                    }
-                }
-                else {
-                    ap_log_error(APLOG_MARK, APLOG_WARNING, OK, s,
-                                 "mod_autorotate: No filename found for directive %s",
-                                 dir->directive);
+                /* Get nth word of the directive arguments */
+                szWord =
+                    get_word(pool, pItem->sDirective.nArgIndex, dir->args);
+                if (szWord) {
+                    if (*szWord == '|') {
+                        ap_log_error(APLOG_MARK, APLOG_DEBUG, OK, s,
+                                     "Ignoring piped log %s", szWord);
+                    }
+                    else {
+                        apr_table_setn(tLogFiles, szWord, "");
+                        ap_log_error(APLOG_MARK, APLOG_INFO, OK, s,
+                                     "mod_autorotate: Log file for directive [%s] found: [%s]",
+                                     dir->directive, szWord);
+                    }
+                }
+                else {
+                    ap_log_error(APLOG_MARK, APLOG_WARNING, OK, s,
+                                 "mod_autorotate: No filename found for directive %s",
+                                 dir->directive);
+                }
+            }
+            else {
+                /*  for debugging
+                   ap_log_error(APLOG_MARK, APLOG_DEBUG, OK, s,
+                   "mod_autorotate: Config directive [%s] does not match list item [%s]",
+                   dir->directive, pItem->sDirective.szDirective );
+                 */
+            }
+
+            pItem = pItem->pNext;
+        }
+
+        /* Recurse into config tree */
+        if (dir->first_child != NULL) {
+            find_log_names(pConfig, pool, s, tLogFiles, dir->first_child);
+        }
+    }
+}
+
+
+/*
+ * Check the mtime of the log files to determine if any should have been
+ * rotated but weren't for some reason (such as the server being down, or
+ * the rotate paramers having been changed)
+ */
+static int
+check_logfile_dates(apr_pool_t * ptemp, server_rec * s,
+                    apr_array_header_t * aFiles)
+{
+    char szAscTimePeriod[APR_CTIME_LEN + 1];
+    char szAscTimeFile[APR_CTIME_LEN + 1];
+    apr_time_t tStart;
+    autorotate_config_t *pConfig;
+    int n;
+
+    /* The module configuration */
+    pConfig = ap_get_module_config(s->module_config, &autorotate_module);
+    AP_DEBUG_ASSERT(pConfig != NULL);
+
+    /*
+     * Start of the current period -+ offset
+     */
+    tStart = offset_period_start(0, pConfig->eInterval, pConfig->nOffset);
+    apr_ctime(szAscTimePeriod, tStart);
+
+    ap_log_perror(APLOG_MARK, APLOG_INFO, OK, ptemp,
+                  "mod_autorotate: Start of current period %s",
+                  szAscTimePeriod);
+
+#if defined(ENABLE_SIMULATION)
+    /* Logs are written in real time, so always look old */
+    if (pgClock == sim_clock) {
+        return 0;
+    }
+#endif
+
+    /*
+     * Check each log file mtime
+     */
+    char **pszLogFiles = (char **) pConfig->aLogFiles->elts;
+
+    int i;
+    int bNeedRotate = 0;
+    for (i = 0; i < pConfig->aLogFiles->nelts; i++) {
+        /* File might be relative to server root */
+        const char *pFilename =
+            ap_server_root_relative(ptemp, pszLogFiles[i]);
+
+        apr_finfo_t fs;
+        apr_status_t status;
+        if ((status = apr_stat(&fs, pFilename, APR_FINFO_MTIME, ptemp))
+            == OK) {
+            if (fs.mtime < tStart) {
+                apr_ctime(szAscTimeFile, fs.mtime);
+                ap_log_error(APLOG_MARK, APLOG_NOTICE, status, s,
+                             "mod_autorotate: Log file %s last written before start "
+                             "of this period (%s < %s).  Requesting immediate rotate.",
+                             pFilename, szAscTimeFile, szAscTimePeriod);
+
+                *(const char **) apr_array_push(aFiles) = pFilename;
+
+                bNeedRotate = 1;
+            }
+        }
+        else {
+            if (!APR_STATUS_IS_ENOENT(status)) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                             "mod_autorotate: could not get modifiied time of %s",
+                             pFilename);
+            }
+        }
+    }
+
+    /* The caller can choose to restart now if we've rotated */
+    return bNeedRotate;
+}
+
+
+/*
+ * Record the time we will next try a rotate - ie. the start of the
+ * next period.  The monitor hook will pick this up
+ * later and initiate the rotate
+ */
+void
+record_next_rotate_time(apr_pool_t * ptemp, autorotate_config_t * pConfig)
+{
+    char szAscTime[APR_CTIME_LEN + 1];
+
+    pConfig->tNextRotate = offset_period_start(1, pConfig->eInterval,
+                                               pConfig->nOffset);
+
+    pgMetrics->tNextRotate = pConfig->tNextRotate;
+
+    apr_ctime(szAscTime, pConfig->tNextRotate);
+    ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, ptemp,
+                  "mod_autorotate: Next rotation due at %s", szAscTime);
+}
+
+
+/*
+ * Handler for the 'open_logs' hook
+ *
+ * Runs when Apache opens its log files, in the caretaker process
+ * We run this last in the chain, so that all the other modules have had
+ * a chance to open their logs before we run.
+ *
+ * pconf: Configuration pool, cleared on restart
+ * plog:  Logging streams pool, cleared after config file read
+ * ptemp: Temp pool, exists during config phase only
+ */
+static int
+open_logs_func(apr_pool_t * pconf, apr_pool_t * plog,
+               apr_pool_t * ptemp, server_rec * s)
+{
+    int i;
+    autorotate_config_t *pConfig;
+
+    /* The module configuration */
+    pConfig = ap_get_module_config(s->module_config, &autorotate_module);
+    AP_DEBUG_ASSERT(pConfig != NULL);
+
+    /* Horrendous - but the monitor hook doesn't have any other way to get
+     * to the module config */
+    pgConfigData = pConfig;
+
+    /* Do nothing if we're not enabled */
+    if (!pConfig->bEnabled)
+        return DECLINED;
+
+    /* Metrics are kept for the life of the server, and shared with the
+     * children that serve server-status */
+    apr_shm_t *pShm = NULL;
+    apr_pool_userdata_get((void **) &pShm, "mod_autorotate_metrics",
+                          s->process->pool);
+    if (!pShm) {
+        apr_status_t rc = apr_shm_create(&pShm,
+                                         sizeof(autorotate_metrics_t),
+                                         NULL, s->process->pool);
+        if (rc == APR_SUCCESS) {
+            memcpy(apr_shm_baseaddr_get(pShm), pgMetrics,
+                   sizeof(autorotate_metrics_t));
+            apr_pool_userdata_set(pShm, "mod_autorotate_metrics",
+                                  apr_pool_cleanup_null, s->process->pool);
+        }
+        else {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, rc, s,
+                         "mod_autorotate: couldn't create shared memory, "
+                         "server-status will show no metrics");
+        }
+    }
+    if (pShm) {
+        pgMetrics = apr_shm_baseaddr_get(pShm);
+    }
+
+#if defined(ENABLE_SIMULATION)
+    /* The simulated clock carries on across restarts, from where it was
+     * first started */
+    if (pConfig->nSimSpeed) {
+        if (!pgMetrics->tSimBase) {
+            pgMetrics->tSimBase = apr_time_now();
+            pgMetrics->tSimEpoch = pConfig->tSimStart ?
+                pConfig->tSimStart : pgMetrics->tSimBase;
+        }
+        pgClock = sim_clock;
+        ap_log_error(APLOG_MARK, APLOG_WARNING, OK, s,
+                     "mod_autorotate: Simulating time at %d times real time",
+                     pConfig->nSimSpeed);
+    }
+#endif
+
+    /* Allocate a temporary table for the log file names */
+    apr_table_t *tLogFiles = apr_table_make(ptemp, 5);
+
+    /* Pull out the list of configured log files */
+    trace_span_t sSpan;
+    trace_begin(&sSpan, "find_log_names");
+    find_log_names(pConfig, ptemp, s, tLogFiles, ap_conftree);
+    trace_end(ptemp, &sSpan, apr_psprintf(ptemp, "\"files\":%d",
+                                          apr_table_elts(tLogFiles)->nelts));
+
+    /*
+     * Table will be de-duped, now copy values to the server config
+     */
+
+    /* A table is just an array of table entries */
+    const apr_array_header_t *arr = apr_table_elts(tLogFiles);
+    AP_DEBUG_ASSERT(arr != NULL);
+    if (arr) {
+        const apr_table_entry_t *elts = (const apr_table_entry_t *) arr->elts;
+        for (i = 0; i < arr->nelts; i++) {
+            /* Writes to the log sink's FIFOs end up in its own logs */
+            if (apr_table_get(pConfig->tSinkFifos,
+                              ap_server_root_relative(ptemp,
+                                                      elts[i].key))) {
+                continue;
+            }
+
+            *(const char **) apr_array_push(pConfig->aLogFiles) =
+                apr_pstrdup(pconf, elts[i].key);
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, OK, s,
+                         "Added log file %s", elts[i].key);
+        }
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_NOTICE, OK, s,
+                 "mod_autorotate: Operating on %d log files",
+                 pConfig->aLogFiles->nelts);
+
+    /* Containers must be coarser than the rotate period, and can only be
+     * made from archives that can be concatenated */
+    if (pConfig->bConsolidate) {
+        if (container_codec(pConfig->szCompressSuffix) == CONTAINER_NONE) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, OK, s,
+                         "mod_autorotate: AutorotateConsolidate needs an "
+                         "AutorotateCompressSuffix of .gz or .zst, "
+                         "consolidation disabled");
+            pConfig->bConsolidate = 0;
+        }
+        else if (period_rank(pConfig->eConsolidate) <=
+                 period_rank(pConfig->eInterval)) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, OK, s,
+                         "mod_autorotate: AutorotateConsolidate period must "
+                         "be longer than AutorotatePeriod, "
+                         "consolidation disabled");
+            pConfig->bConsolidate = 0;
+        }
+    }
+
+    /* Hourly archives are partitioned down to the day, as there are so
+     * many of them */
+    if (pConfig->ePartition == PARTITION_AUTO) {
+        pConfig->ePartition =
+            (period_rank(pConfig->eInterval) <= period_rank(HOURLY)) ?
+            PARTITION_DAY : PARTITION_MONTH;
+    }
+
+    /* Only zstd can be given a dictionary to compress with */
+    if (pConfig->compressInfo.bDictionary &&
+        container_codec(pConfig->szCompressSuffix) != CONTAINER_ZSTD) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, OK, s,
+                     "mod_autorotate: AutorotateDictionary needs an "
+                     "AutorotateCompressSuffix of .zst, dictionaries disabled");
+        pConfig->compressInfo.bDictionary = 0;
+    }
+
+    /* Levels above 9 are only understood by zstd; gzip and the like
+     * would fail every sample run with them */
+    apr_array_header_t *aLevels = pConfig->compressInfo.aLevels;
+    if (aLevels && container_codec(pConfig->szCompressSuffix) !=
+        CONTAINER_ZSTD) {
+        int *pnLevels = (int *) aLevels->elts;
+        int nKept = 0;
+        for (i = 0; i < aLevels->nelts; i++) {
+            if (pnLevels[i] <= 9) {
+                pnLevels[nKept++] = pnLevels[i];
+                continue;
+            }
+            ap_log_error(APLOG_MARK, APLOG_ERR, OK, s,
+                         "mod_autorotate: AutorotateCompressLevels %d needs "
+                         "an AutorotateCompressSuffix of .zst, level ignored",
+                         pnLevels[i]);
+        }
+        aLevels->nelts = nKept;
+    }
+
+#if defined(ENABLE_SIMULATION)
+    if (pConfig->szSimTreeDir) {
+        make_sim_tree(pconf, ptemp, pConfig);
+    }
+#endif
+
+    /* Prune old logs */
+    do_prune(ptemp);
+
+    /* Kick off an initial check of the log files, and rotate right now
+     * if we need to.  The server restarts after the first initialisation
+     * on its own as standard, so we don't need to do anything special
+     * to request a restart.
+     */
+    apr_array_header_t *aFiles = apr_array_make(ptemp, 5, sizeof(char *));
+    trace_begin(&sSpan, "check_logfile_dates");
+    int bDue = check_logfile_dates(ptemp, s, aFiles);
+    trace_end(ptemp, &sSpan, apr_psprintf(ptemp, "\"due\":%d",
+                                          aFiles->nelts));
+    if (bDue) {
+        do_rotate(ptemp, aFiles);
+    }
+
+    /* Record the date of the next required rotate */
+    record_next_rotate_time(pconf, pConfig);
+
+    /* Create a list of files that need to be compressed.
+     * Note that we don't kick off the compression here, because any
+     * process we create will get killed when startup phase 1 goes away.
+     * We leave it to the monitor function to kick off the compresions
+     * the first time it runs (which only happens when the server is
+     * really up and working fully)
+     */
+    create_compress_queue(pconf, ptemp, pConfig);
+
+    /* The log sink can't wait for the monitor, as the server blocks once
+     * a FIFO fills.  It's started now unless this is the first pass over
+     * the configuration, whose processes are killed when it goes away.
+     */
+    if (pConfig->sinkInfo.aStreams->nelts) {
+        void *pvStarted = NULL;
+        apr_pool_userdata_get(&pvStarted, "mod_autorotate_started",
+                              s->process->pool);
+
+        pConfig->sinkInfo.pPool = pconf;
+        if (pvStarted) {
+            run_log_sink(&pConfig->sinkInfo);
+        }
+        else {
+            apr_pool_userdata_set((const void *) 1, "mod_autorotate_started",
+                                  apr_pool_cleanup_null, s->process->pool);
+        }
+    }
+
+    return OK;
+}
+
+
+static int
+create_compress_queue(apr_pool_t * pconf, apr_pool_t * ptemp,
+                      autorotate_config_t * pConfig)
+{
+    compress_child_info_t *pInfo = &pConfig->compressInfo;
+
+    /* Decline to create a queue if compression is disabled */
+    if (pConfig->nCompressAfter == 0) {
+        ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, ptemp,
+                      "mod_autorotate: Log compression disabled");
+        return OK;
+    }
+
+    /* Create a sub-pool for the compress process which will be cleared when
+     * done with the compressions, unless we already have one from an
+     * earlier queue */
+    int rc = APR_SUCCESS;
+    if (!pInfo->pPool &&
+        (rc = apr_pool_create(&pInfo->pPool, pconf)) != APR_SUCCESS) {
+        pInfo->pPool = NULL;
+        ap_log_perror(APLOG_MARK, APLOG_DEBUG, rc, ptemp,
+                      "mod_autorotate: Error creating sub-pool");
+        pInfo->aCompressQueue = NULL;
+        return rc;
+    }
+
+    pInfo->aCompressQueue = apr_array_make(pInfo->pPool, 5,
+                                           sizeof(compress_job_t));
+
+    trace_span_t sSpan;
+    trace_begin(&sSpan, "create_compress_queue");
+
+    /* Jobs are copied into pInfo->pPool, so each log's scanning can be
+     * thrown away before the next */
+    apr_pool_t *pIter;
+    if ((rc = apr_pool_create(&pIter, ptemp)) != APR_SUCCESS) {
+        pInfo->aCompressQueue = NULL;
+        return rc;
+    }
+
+    /* Whatever was held back is looked at afresh */
+    if (pConfig->pHeldPool) {
+        apr_pool_clear(pConfig->pHeldPool);
+    }
+    else if (apr_pool_create(&pConfig->pHeldPool, pconf) != APR_SUCCESS) {
+        pConfig->pHeldPool = NULL;
+    }
+    pConfig->aHeldJobs = NULL;
+    pConfig->tNextHeldCheck = pgClock() + HELD_CHECK_INTERVAL;
+
+    /* Cycle through the log files */
+    int i;
+    char **pszLogFiles = (char **) pConfig->aLogFiles->elts;
+    for (i = 0; i < pConfig->aLogFiles->nelts; i++) {
+        /* File might be relative to server root */
+        const char *szOrigName =
+            ap_server_root_relative(pIter, pszLogFiles[i]);
+
+        /* Consolidation jobs are queued first, so that they run after
+         * the compressions of the archives they will contain */
+        if (pConfig->bConsolidate) {
+            queue_consolidation(pIter, pInfo, szOrigName);
+        }
+
+        /* go back one period at a time, decrementing the number to keep
+         * each time a log exists for that previous period.  After we get to
+         * zero, start deleting for subsequent periods */
+
+        queue_baton_t sBaton;
+        sBaton.nNumFound = 0;
+        sBaton.hOpen = NULL;
+        sBaton.bUnknown = 0;
+
+        /* Other writers are only signalled to reopen their logs, so may
+         * still be writing to the newest archive */
+        if (pConfig->pHeldPool &&
+            (apr_hash_get(pConfig->hExternalLogs, szOrigName,
+                          APR_HASH_KEY_STRING) ||
+             apr_table_get(pConfig->tSinkFiles, szOrigName))) {
+            sBaton.hOpen = apr_hash_make(pIter);
+            sBaton.bUnknown = !writer_open_files(pIter, szOrigName,
+                                                 sBaton.hOpen);
+        }
+
+        walk_archives(pIter, szOrigName, 0, queue_archive_cb, &sBaton);
+
+        apr_pool_clear(pIter);
+    }                           /* End for (log files */
+
+    apr_pool_destroy(pIter);
+
+    trace_end(ptemp, &sSpan, apr_psprintf(ptemp, "\"jobs\":%d",
+                                          pInfo->aCompressQueue->nelts));
+
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Archive callback for create_compress_queue().  pvBaton is the
+ * queue_baton_t of this log.  Archives still open are held back rather
+ * than queued.
+ */
+static void
+queue_archive_cb(apr_pool_t * p, const archive_info_t * pArchive,
+                 void *pvBaton)
+{
+    compress_child_info_t *pInfo = &pgConfigData->compressInfo;
+    queue_baton_t *pBaton = pvBaton;
+
+    if (pArchive->bCompressed) {
+        return;
+    }
+
+    pBaton->nNumFound++;
+
+    if (pBaton->nNumFound >= pgConfigData->nCompressAfter) {
+        apr_array_header_t *aJobs = pInfo->aCompressQueue;
+        apr_pool_t *pPool = pInfo->pPool;
+
+        if (pBaton->hOpen && (pBaton->bUnknown ||
+                              is_open(pBaton->hOpen, pArchive->szPath))) {
+            ap_log_perror(APLOG_MARK, APLOG_INFO, OK, p,
+                          "mod_autorotate: Not compressing %s until its "
+                          "writer closes it", pArchive->szPath);
+            pPool = pgConfigData->pHeldPool;
+            if (!pgConfigData->aHeldJobs) {
+                pgConfigData->aHeldJobs =
+                    apr_array_make(pPool, 1, sizeof(compress_job_t));
+                pgConfigData->tHeldSince = pgClock();
+            }
+            aJobs = pgConfigData->aHeldJobs;
+        }
+
+        compress_job_t *pJob = apr_array_push(aJobs);
+        pJob->szLogPath = apr_pstrdup(pPool, pArchive->szPath);
+        pJob->szOrigName = apr_pstrdup(pPool, pArchive->szOrigName);
+        pJob->tPeriodStart = pArchive->tPeriodStart;
+        pJob->tPeriodEnd = pArchive->tPeriodEnd;
+        pJob->bConsolidate = 0;
+    }
+}
+
+
+/*
+ * Queue consolidation of each recently finished container period of the
+ * given log that has archives but no container yet
+ */
+static void
+queue_consolidation(apr_pool_t * ptemp, compress_child_info_t * pInfo,
+                    const char *szOrigName)
+{
+    char szSuffix[256] = "";
+    int nPeriod = 0;
+    int nContainer;
+
+    for (nContainer = -1; nContainer >= -CONSOLIDATE_LOOKBACK; nContainer--) {
+        apr_time_t tContainerStart =
+            offset_period_start(nContainer, pgConfigData->eConsolidate,
+                                pgConfigData->nOffset);
+        apr_time_t tContainerEnd =
+            offset_period_start(nContainer + 1, pgConfigData->eConsolidate,
+                                pgConfigData->nOffset);
+
+        apr_finfo_t fs;
+        const char *szContainer = container_name(ptemp, szOrigName, szSuffix,
+                                                 tContainerStart);
+        int bExists = (apr_stat(&fs, szContainer, APR_FINFO_MIN, ptemp)
+                       == APR_SUCCESS);
+        int bMembers = 0;
+
+        /* Step over the rotate periods, looking for any archive in this
+         * container period */
+        for (;; nPeriod--) {
+            apr_time_t tStart = offset_period_start(nPeriod,
+                                                    pgConfigData->eInterval,
+                                                    pgConfigData->nOffset);
+            if (tStart < tContainerStart) {
+                break;
+            }
+            if (tStart >= tContainerEnd || bExists || bMembers) {
+                continue;
+            }
+
+            const char *szName = archive_name(ptemp, szOrigName, szSuffix,
+                                              tStart);
+            bMembers =
+                (apr_stat(&fs, szName, APR_FINFO_MIN, ptemp) == APR_SUCCESS)
+                || (apr_stat(&fs, apr_pstrcat(ptemp, szName,
+                                              pgConfigData->szCompressSuffix,
+                                              NULL),
+                             APR_FINFO_MIN, ptemp) == APR_SUCCESS);
+        }
+
+        if (!bExists && bMembers) {
+            compress_job_t *pJob = apr_array_push(pInfo->aCompressQueue);
+            pJob->szLogPath = apr_pstrdup(pInfo->pPool, szOrigName);
+            pJob->szOrigName = pJob->szLogPath;
+            pJob->tPeriodStart = tContainerStart;
+            pJob->tPeriodEnd = tContainerEnd;
+            pJob->bConsolidate = 1;
+        }
+    }
+}
+
+
+
+#if defined(ENABLE_SIMULATION)
+/*
+ * Make the synthetic tree for AutorotateSimulateTree, unless it's already
+ * there, and add its logs to those we work with.  Each log gets an empty
+ * archive for each past period, all compressed but the newest, laid out
+ * as configured, so that the prune, rotate and queue building phases can
+ * be traced against a known population.
+ */
+static void make_sim_tree(apr_pool_t * pconf, apr_pool_t * ptemp,
+                          autorotate_config_t * pConfig)
+{
+    char *szSuffix = apr_pcalloc(ptemp, 256);
+    apr_time_t tBegan = apr_time_now();
+    int nMade = 0;
+    int i, nPeriod;
+
+    apr_dir_make_recursive(pConfig->szSimTreeDir, APR_OS_DEFAULT, ptemp);
+
+    for (i = 0; i < pConfig->nSimTreeLogs; i++) {
+        const char *szLog = apr_psprintf(pconf, "%s/log%05d",
+                                         pConfig->szSimTreeDir, i);
+        *(const char **) apr_array_push(pConfig->aLogFiles) = szLog;
+
+        apr_finfo_t fs;
+        if (apr_stat(&fs, szLog, APR_FINFO_MIN, ptemp) == APR_SUCCESS) {
+            continue;
+        }
+
+        apr_pool_t *pIter;
+        apr_pool_create(&pIter, ptemp);
+        for (nPeriod = 0; nPeriod >= -pConfig->nSimTreePeriods; nPeriod--) {
+            const char *szName = szLog;
+            if (nPeriod < 0) {
+                apr_time_t tStart = offset_period_start(nPeriod,
+                                                        pConfig->eInterval,
+                                                        pConfig->nOffset);
+                szName = archive_name(pIter, szLog, szSuffix, tStart);
+                if (nPeriod < -1) {
+                    szName = apr_pstrcat(pIter, szName,
+                                         pConfig->szCompressSuffix, NULL);
+                }
+                make_archive_dir(pIter, szName);
+            }
+
+            apr_file_t *pFile;
+            if (apr_file_open(&pFile, szName,
+                              APR_FOPEN_WRITE | APR_FOPEN_CREATE,
+                              APR_OS_DEFAULT, pIter) == APR_SUCCESS) {
+                apr_file_close(pFile);
+                nMade++;
+            }
+        }
+        apr_pool_destroy(pIter);
+    }
+
+    ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, ptemp,
+                  "mod_autorotate: Simulated tree of %d logs in %s, made %d "
+                  "files in %" APR_INT64_T_FMT " ms", pConfig->nSimTreeLogs,
+                  pConfig->szSimTreeDir, nMade,
+                  (apr_int64_t) (apr_time_now() - tBegan) / 1000);
+}
+
+
+/*
+ * Simulated clock for AutorotateSimulate.  Runs nSimSpeed times faster
+ * than real time from when it was started, so that months of rotation,
+ * pruning and compression against a scratch directory take hours.
+ */
+static apr_time_t sim_clock(void)
+{
+    return pgMetrics->tSimEpoch +
+        (apr_time_now() - pgMetrics->tSimBase) * pgConfigData->nSimSpeed;
+}
+#endif
+
+
+/*
+ * Return the start of a given period, offset by a given number of
+ * seconds.  The offset can be negative, which complicates the calculation
+ * and forces us to work out how far through the current period we are before
+ * reliably being able to return the correct result
+ */
+static apr_time_t
+offset_period_start(int nCount, rotate_interval_t ePeriod,
+                    apr_int64_t nOffset)
+{
+    apr_time_t tStart;
+
+    /* If using a negative offset (eg. monthly minus 1 hour) */
+    if (nOffset < 0) {
+
+        /* Get the start of the next period and offset it */
+        tStart = period_start(1, ePeriod);
+        tStart += nOffset;
+
+        /* If we're already into the "next" period then offset the
+         * period count that's been asked for by one */
+        if (tStart < pgClock()) {
+            nCount++;
+        }
+    }
+
+    tStart = period_start(nCount, ePeriod);
+    tStart += nOffset;
+    return tStart;
+}
+
+
+/*
+ * Return the start of a given period.  nCount defines the number of periods
+ * ahead or before now.  For example :
+ *  n = 0,   e = DAILY    Midnight today
+ *  n = 1,   e = DAILY    Midnight tomorrow
+ *  n = 0,   e = MONTHLY  Midnight on 1st day of the current month
+ *  n = -1,  e = MONTHLY  Midnight on 1st day of the previous month
+ */
+static apr_time_t period_start(int nCount, rotate_interval_t ePeriod)
+{
+    apr_time_exp_t T;
+    apr_time_t tNow, tThen;
+
+    /* Representation of now, local time */
+    tNow = pgClock();
+    apr_time_exp_lt(&T, tNow);
+
+    /* If period is monthly or weekly, go to the start of the month or
+     * start of the week.
+     * In all cases move forward or back the given number of periods.
+     */
+    switch (ePeriod) {
+    case MONTHLY:
+        T.tm_mday = 1;          /* Start of this month */
+        T.tm_mon += nCount;     /* plus or minus a number of months */
+        T.tm_hour = 0;          /* Start at midnight */
+
+        /* Apache's mktime() replacement doesn't normalise
+         * out-of-range month fields across year boundaries,
+         * so let's just do that ourselves */
+        T.tm_year += T.tm_mon / 12;
+        T.tm_mon = T.tm_mon % 12;
+        if (T.tm_mon < 0) {     /* Deal with past months */
+            T.tm_mon += 12;
+            T.tm_year -= 1;
+        }
+
+        T.tm_min = 0;
+        break;
+    case WEEKLY:
+        T.tm_mday -= T.tm_wday; /* Start of this week */
+        T.tm_mday += (7 * nCount);      /* +/- number of weeks */
+        T.tm_hour = 0;          /* Start at midnight */
+        T.tm_min = 0;
+        break;
+    case DAILY:
+        T.tm_mday += nCount;    /* +/- number of days */
+        T.tm_hour = 0;          /* Start at midnight */
+        T.tm_min = 0;
+        break;
+    case HOURLY:
+        T.tm_hour += nCount;    /* +/- number of hours */
+        T.tm_min = 0;
+        break;
+#if defined(ENABLE_PERMINUTE)
+    case PERMINUTE:
+        T.tm_min += nCount;     /* +/- number of minutes */
+        break;
+#endif
+    }
+
+
+    /* Always start at the beginning of the minute */
+    T.tm_sec = T.tm_usec = 0;
+
+    apr_time_exp_gmt_get(&tThen, &T);
+    return tThen;
+}
+
+
+/*
+ * Callback used to notify us that a compress child died
+ * pvData is a pointer to the apr_proc_t
+ */
+static void compress_cb_func(int nReason, void *pvData, int nStatus)
+{
+    compress_child_info_t *pChildInfo = (compress_child_info_t *) pvData;
+
+    switch (nReason) {
+        /* Unregister the child if its finished */
+    case APR_OC_REASON_DEATH:
+    case APR_OC_REASON_RESTART:
+    case APR_OC_REASON_LOST:
+        apr_proc_other_child_unregister(pChildInfo);
+        break;
+
+        /* This is probably because we called the unregister above.. */
+    case APR_OC_REASON_UNREGISTER:
+        return;
+        break;
+    };
+
+
+    if (nStatus != 0) {
+        pChildInfo->nFailures++;
+        pgMetrics->nJobsFailed++;
+    }
+    else {
+        pgMetrics->nJobsDone++;
+    }
+
+    /* Log the success or failure */
+    ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, pChildInfo->pPool,
+                  "mod_autorotate: Compress process %d done: %s  %d left.",
+                  pChildInfo->pProc->pid,
+                  (nStatus == 0) ? "OK" : "FAILED",
+                  pChildInfo->aCompressQueue->nelts);
+
+    run_next_compress_child(pChildInfo);
+    return;
+}
+
+
+/*
+ * Start a child process and register with Apache so that we recieve
+ * notification when it dies.
+ *
+ * The child is a fork of this process which streams the log through the
+ * compress program, so that checksums of both sides can be taken without
+ * reading either file a second time.
+ */
+static apr_status_t run_next_compress_child(compress_child_info_t * pData)
+{
+    apr_proc_t *pProc;
+    apr_status_t rc = APR_SUCCESS;
+
+    AP_DEBUG_ASSERT(pData != NULL);
+
+    apr_pool_t *pPool = pData->pPool;
+
+    /* We're done if there are no items left on the queue.
+     * Delete the subpool and return
+     */
+    if (pData->aCompressQueue->nelts == 0) {
+        ap_log_perror(APLOG_MARK, APLOG_INFO, rc, pPool,
+                      "mod_autorotate: Done compressing");
+        apr_pool_clear(pPool);
+        pData->aCompressQueue = NULL;
+        pData->szLogPath = NULL;
+        return OK;
+    }
+
+    /* Otherwise plough on with the compressions */
+    compress_job_t *pJob = apr_array_pop(pData->aCompressQueue);
+    /* Store name of log being worked on right now */
+    pData->szLogPath = pJob->szLogPath;
+    AP_DEBUG_ASSERT(pData->szLogPath != NULL);
+
+    pProc = apr_pcalloc(pPool, sizeof(*pProc));
+    rc = apr_proc_fork(pProc, pPool);
+
+    if (rc == APR_INCHILD) {
+        /* We are a copy of the parent, so put back the default signal
+         * handling that the MPM replaced, and renice ourselves before the
+         * compress program inherits our priority
+         */
+        apr_signal(SIGTERM, SIG_DFL);
+        apr_signal(SIGHUP, SIG_DFL);
+        apr_signal(SIGINT, SIG_DFL);
+        apr_signal(AP_SIG_GRACEFUL, SIG_DFL);
+        apr_signal(SIGCHLD, SIG_DFL);
+        apr_signal(SIGPIPE, SIG_IGN);
+
+        if (setpriority(PRIO_PROCESS, 0, pData->nNiceLevel)) {
+            ap_log_perror(APLOG_MARK, APLOG_ERR, 0, pPool,
+                          "mod_autorotate: couldn't set child priority to %d",
+                          pData->nNiceLevel);
+        }
+
+        trace_span_t sSpan;
+        apr_uint64_t nBytesIn = pgMetrics->nBytesIn;
+        apr_uint64_t nBytesOut = pgMetrics->nBytesOut;
+        trace_begin(&sSpan, pJob->bConsolidate ? "consolidate" : "compress");
+
+        if (pJob->bConsolidate) {
+            rc = consolidate_archives(pPool, pData, pJob);
+        }
+        else {
+            rc = compress_stream(pPool, pData, pJob);
+        }
+
+        trace_end(pPool, &sSpan,
+                  apr_psprintf(pPool, "\"file\":%s,\"ok\":%d,"
+                               "\"bytes_in\":%" APR_UINT64_T_FMT
+                               ",\"bytes_out\":%" APR_UINT64_T_FMT,
+                               json_string(pPool, pJob->szLogPath),
+                               rc == APR_SUCCESS,
+                               pgMetrics->nBytesIn - nBytesIn,
+                               pgMetrics->nBytesOut - nBytesOut));
+
+        /* Skip the parent's atexit handlers and pool cleanups */
+        _exit(rc == APR_SUCCESS ? 0 : 1);
+    }
+
+    if (rc != APR_INPARENT) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, rc, pPool,
+                      "mod_autorotate: couldn't create compress process for %s",
+                      pData->szLogPath);
+        return rc;
+    }
+
+    /* Register the child with Apache so that we get notified
+     * when it dies
+     */
+    pData->pProc = pProc;
+    apr_proc_other_child_register(pProc, compress_cb_func,
+                                  pData, NULL, pPool);
+
+    /* Associate the child with the global pool so that Apache
+     * will kill it when the pool goes out of scope (eg. when the
+     * server is killed
+     */
+    apr_pool_note_subprocess(pPool, pProc, APR_KILL_AFTER_TIMEOUT);
+
+    if (pJob->bConsolidate) {
+        ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, pPool,
+                      "mod_autorotate: Started consolidate, PID %d, [%s]",
+                      pProc->pid, pData->szLogPath);
+    }
+    else {
+        ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, pPool,
+                      "mod_autorotate: Started compress, PID %d, [%s] [%s]",
+                      pProc->pid, pData->szCompressProgram,
+                      pData->szLogPath);
+    }
+
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Append a record for a newly compressed archive to the manifest in the
+ * archive's directory.  One tab separated line per archive:
+ *
+ *   archive  period-start  period-end  in-bytes  in-crc32c  out-bytes
+ *   out-crc32c  program  dictionary
+ *
+ * Period bounds are seconds since the epoch.  The dictionary is the file
+ * name of the one needed to decompress the archive, or "-" for none.  The file is only ever
+ * appended to, and each record goes out in a single write.
+ */
+static apr_status_t
+append_manifest(apr_pool_t * p, const char *szArchive,
+                const compress_job_t * pJob, const char *szProgram,
+                const char *szDictionary,
+                apr_off_t nInBytes, apr_uint32_t nInCrc,
+                apr_off_t nOutBytes, apr_uint32_t nOutCrc)
+{
+    const char *szBase = apr_filepath_name_get(szArchive);
+    const char *szManifest =
+        apr_pstrcat(p, log_dir_name(p, szArchive), MANIFEST_NAME, NULL);
+
+    const char *szRecord =
+        apr_psprintf(p,
+                     "%s\t%" APR_INT64_T_FMT "\t%" APR_INT64_T_FMT
+                     "\t%" APR_OFF_T_FMT "\t%08x\t%" APR_OFF_T_FMT
+                     "\t%08x\t%s\t%s\n",
+                     szBase,
+                     (apr_int64_t) apr_time_sec(pJob->tPeriodStart),
+                     (apr_int64_t) apr_time_sec(pJob->tPeriodEnd),
+                     nInBytes, nInCrc, nOutBytes, nOutCrc, szProgram,
+                     szDictionary ? apr_filepath_name_get(szDictionary) :
+                     "-");
+
+    apr_file_t *pFile;
+    apr_status_t rc = apr_file_open(&pFile, szManifest,
+                                    APR_FOPEN_WRITE | APR_FOPEN_CREATE |
+                                    APR_FOPEN_APPEND, APR_OS_DEFAULT, p);
+    if (rc == APR_SUCCESS) {
+        rc = apr_file_write_full(pFile, szRecord, strlen(szRecord), NULL);
+        apr_file_close(pFile);
+    }
+
+    if (rc != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                      "mod_autorotate: couldn't append to manifest %s",
+                      szManifest);
+    }
+
+    return rc;
+}
+
+
+/*
+ * Point the link to a log's current dictionary at the given version.  The
+ * link is replaced by a rename, so it's never missing.
+ */
+static void
+set_current_dictionary(apr_pool_t * p, const char *szOrigName, int nVersion)
+{
+    const char *szBase = apr_filepath_name_get(szOrigName);
+    const char *szLink = apr_pstrcat(p, archive_root(p, szOrigName), szBase,
+                                     DICTIONARY_LINK, NULL);
+    const char *szTemp = apr_pstrcat(p, szLink, ".tmp", NULL);
+
+    unlink(szTemp);
+    if (symlink(apr_psprintf(p, "%s%s%d", szBase, DICTIONARY_INFIX, nVersion),
+                szTemp) != 0 ||
+        apr_file_rename(szTemp, szLink, p) != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, errno, p,
+                      "mod_autorotate: couldn't link %s to version %d",
+                      szLink, nVersion);
+        unlink(szTemp);
+    }
+}
+
+
+/*
+ * Find the current dictionary of a log, returning its path, version and
+ * modification time, or NULL and version zero if it has none yet.  The
+ * current version is found from its link; only logs without one, such as
+ * those with no dictionary yet, need their directory searched.
+ */
+static const char *
+current_dictionary(apr_pool_t * p, const char *szOrigName, int *pnVersion,
+                   apr_time_t * ptMtime)
+{
+    const char *szDir = archive_root(p, szOrigName);
+    const char *szPrefix = apr_pstrcat(p, apr_filepath_name_get(szOrigName),
+                                       DICTIONARY_INFIX, NULL);
+    apr_size_t nPrefixLen = strlen(szPrefix);
+    const char *szNewest = NULL;
+    char szTarget[APR_PATH_MAX];
+    apr_dir_t *pDir;
+    apr_finfo_t fs;
+    char *szEnd;
+
+    *pnVersion = 0;
+    *ptMtime = 0;
+
+    ssize_t nLen = readlink(apr_pstrcat(p, szDir,
+                                        apr_filepath_name_get(szOrigName),
+                                        DICTIONARY_LINK, NULL),
+                            szTarget, sizeof(szTarget) - 1);
+    if (nLen > 0) {
+        szTarget[nLen] = '\0';
+        long nVersion = strtol(szTarget + nPrefixLen, &szEnd, 10);
+        szNewest = apr_pstrcat(p, szDir, szTarget, NULL);
+
+        if (!strncmp(szTarget, szPrefix, nPrefixLen) && !*szEnd &&
+            nVersion > 0 &&
+            apr_stat(&fs, szNewest, APR_FINFO_MTIME, p) == APR_SUCCESS) {
+            *pnVersion = nVersion;
+            *ptMtime = fs.mtime;
+            return szNewest;
+        }
+        szNewest = NULL;
+    }
+
+    if (apr_dir_open(&pDir, szDir, p) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    while (apr_dir_read(&fs, APR_FINFO_NAME | APR_FINFO_TYPE |
+                        APR_FINFO_MTIME, pDir) == APR_SUCCESS) {
+        if (fs.filetype != APR_REG ||
+            strncmp(fs.name, szPrefix, nPrefixLen)) {
+            continue;
+        }
+
+        long nVersion = strtol(fs.name + nPrefixLen, &szEnd, 10);
+        if (*szEnd || nVersion <= *pnVersion) {
+            continue;
+        }
+
+        *pnVersion = nVersion;
+        *ptMtime = fs.mtime;
+        szNewest = apr_pstrcat(p, szDir, fs.name, NULL);
+    }
+
+    apr_dir_close(pDir);
+
+    if (szNewest) {
+        set_current_dictionary(p, szOrigName, *pnVersion);
+    }
+    return szNewest;
+}
+
+
+/*
+ * Read the manifests under szDir, at most nDepth partitions down, and mark
+ * in pbUsed the dictionary versions of a log that archives still on disk
+ * were made with.  szPrefix is the log's dictionary name up to the
+ * version.  An archive counts as still on disk if it's there, or is a
+ * member of one of aArchives, or is older than tHorizon, before which
+ * archives weren't looked for.
+ */
+static void
+mark_used_dictionaries(apr_pool_t * p, const char *szDir, int nDepth,
+                       const char *szPrefix,
+                       const apr_array_header_t * aArchives,
+                       apr_time_t tHorizon, char *pbUsed, int nVersions)
+{
+    apr_size_t nPrefixLen = strlen(szPrefix);
+    const archive_info_t *pArchives =
+        (const archive_info_t *) aArchives->elts;
+    char szLine[APR_PATH_MAX * 2];
+    apr_file_t *pFile;
+    apr_dir_t *pDir;
+    apr_finfo_t fs;
+
+    if (apr_file_open(&pFile, apr_pstrcat(p, szDir, MANIFEST_NAME, NULL),
+                      APR_FOPEN_READ | APR_FOPEN_BUFFERED, APR_OS_DEFAULT,
+                      p) == APR_SUCCESS) {
+        while (apr_file_gets(szLine, sizeof(szLine), pFile) == APR_SUCCESS) {
+            char *aszFields[9];
+            char *szLast;
+            int nField;
+
+            aszFields[0] = apr_strtok(szLine, "\t\n", &szLast);
+            for (nField = 1; nField < 9 && aszFields[nField - 1]; nField++) {
+                aszFields[nField] = apr_strtok(NULL, "\t\n", &szLast);
+            }
+            if (nField < 9 || !aszFields[8] ||
+                strncmp(aszFields[8], szPrefix, nPrefixLen)) {
+                continue;
+            }
+
+            char *szEnd;
+            long nVersion = strtol(aszFields[8] + nPrefixLen, &szEnd, 10);
+            if (*szEnd || nVersion <= 0 || nVersion >= nVersions ||
+                pbUsed[nVersion]) {
+                continue;
+            }
+
+            apr_time_t tStart = apr_time_from_sec(apr_atoi64(aszFields[1]));
+            apr_time_t tEnd = apr_time_from_sec(apr_atoi64(aszFields[2]));
+            int i, bUsed = (tStart < tHorizon ||
+                            apr_stat(&fs, apr_pstrcat(p, szDir, aszFields[0],
+                                                      NULL),
+                                     APR_FINFO_TYPE, p) == APR_SUCCESS);
+            for (i = 0; !bUsed && i < aArchives->nelts; i++) {
+                bUsed = (pArchives[i].bContainer &&
+                         pArchives[i].tPeriodStart < tEnd &&
+                         tStart < pArchives[i].tPeriodEnd);
+            }
+            pbUsed[nVersion] = bUsed;
+        }
+        apr_file_close(pFile);
+    }
+
+    if (nDepth <= 0 || apr_dir_open(&pDir, szDir, p) != APR_SUCCESS) {
+        return;
+    }
+    while (apr_dir_read(&fs, APR_FINFO_NAME | APR_FINFO_TYPE, pDir)
+           == APR_SUCCESS) {
+        if (fs.filetype == APR_DIR && fs.name[0] != '.') {
+            mark_used_dictionaries(p, apr_pstrcat(p, szDir, fs.name, "/",
+                                                  NULL), nDepth - 1,
+                                   szPrefix, aArchives, tHorizon, pbUsed,
+                                   nVersions);
+        }
+    }
+    apr_dir_close(pDir);
+}
+
+
+/*
+ * Remove the dictionaries of a log that are older than the current
+ * version and that no archive still on disk needs to be decompressed,
+ * going by the manifests
+ */
+static void
+prune_dictionaries(apr_pool_t * p, const char *szOrigName, int nCurrent)
+{
+    const char *szDir = archive_root(p, szOrigName);
+    const char *szPrefix = apr_pstrcat(p, apr_filepath_name_get(szOrigName),
+                                       DICTIONARY_INFIX, NULL);
+    apr_size_t nPrefixLen = strlen(szPrefix);
+    char *pbUsed = apr_pcalloc(p, nCurrent + 1);
+    apr_dir_t *pDir;
+    apr_finfo_t fs;
+
+    apr_array_header_t *aArchives =
+        apr_array_make(p, 16, sizeof(archive_info_t));
+    walk_archives(p, szOrigName, 0, collect_archive_cb, aArchives);
+
+    /* The oldest period walk_archives() looked at */
+    apr_time_t tHorizon =
+        pgConfigData->bConsolidate ?
+        offset_period_start(-99, pgConfigData->eConsolidate,
+                            pgConfigData->nOffset) :
+        offset_period_start(-99, pgConfigData->eInterval,
+                            pgConfigData->nOffset);
+
+    mark_used_dictionaries(p, szDir, pgConfigData->szArchiveDir[0] ? 3 : 0,
+                           szPrefix, aArchives, tHorizon, pbUsed, nCurrent);
+    pbUsed[nCurrent] = 1;
+
+    if (apr_dir_open(&pDir, szDir, p) != APR_SUCCESS) {
+        return;
+    }
+
+    while (apr_dir_read(&fs, APR_FINFO_NAME | APR_FINFO_TYPE, pDir)
+           == APR_SUCCESS) {
+        char *szEnd;
+        long nVersion;
+
+        if (fs.filetype != APR_REG ||
+            strncmp(fs.name, szPrefix, nPrefixLen)) {
+            continue;
+        }
+        nVersion = strtol(fs.name + nPrefixLen, &szEnd, 10);
+        if (*szEnd || nVersion <= 0 || nVersion >= nCurrent ||
+            pbUsed[nVersion]) {
+            continue;
+        }
+
+        const char *szPath = apr_pstrcat(p, szDir, fs.name, NULL);
+        if (apr_file_remove(szPath, p) == APR_SUCCESS) {
+            ap_log_perror(APLOG_MARK, APLOG_INFO, OK, p,
+                          "mod_autorotate: Removed unused dictionary %s",
+                          szPath);
+        }
+    }
+
+    apr_dir_close(pDir);
+}
+
+
+/*
+ * Archive callback for train_dictionary().  Collects the paths of
+ * uncompressed archives to train from into the array in pvBaton, whose
+ * first entry is the log about to be compressed.
+ */
+static void
+sample_archive_cb(apr_pool_t * p, const archive_info_t * pArchive,
+                  void *pvBaton)
+{
+    apr_array_header_t *aSamples = pvBaton;
+    const char *szFirst = ((const char **) aSamples->elts)[0];
+
+    if (!pArchive->bCompressed && !pArchive->bContainer &&
+        strcmp(pArchive->szPath, szFirst) &&
+        aSamples->nelts < DICT_TRAIN_FILES) {
+        *(const char **) apr_array_push(aSamples) = pArchive->szPath;
+    }
+}
+
+
+/*
+ * Train a dictionary for a log from its rotated files still awaiting
+ * compression, which always includes the one about to be compressed.
+ * The compress program does the training.  Each training writes a new
+ * version, so the archives made with earlier versions can still be
+ * decompressed, and then removes the earlier versions no archive needs
+ * any more.
+ */
+static const char *
+train_dictionary(apr_pool_t * p, compress_child_info_t * pData,
+                 const compress_job_t * pJob, const char *szOrigName,
+                 int nVersion)
+{
+    apr_array_header_t *aSamples =
+        apr_array_make(p, DICT_TRAIN_FILES + 1, sizeof(const char *));
+    *(const char **) apr_array_push(aSamples) = pJob->szLogPath;
+    walk_archives(p, szOrigName, -1, sample_archive_cb, aSamples);
+
+    /* Never train over an existing version, should the link be behind */
+    const char *szDictionary;
+    apr_finfo_t fs;
+    for (;; nVersion++) {
+        szDictionary = apr_psprintf(p, "%s%s%s%d",
+                                    archive_root(p, szOrigName),
+                                    apr_filepath_name_get(szOrigName),
+                                    DICTIONARY_INFIX, nVersion);
+        if (apr_stat(&fs, szDictionary, APR_FINFO_TYPE, p) != APR_SUCCESS) {
+            break;
+        }
+    }
+    const char *szTemp = apr_pstrcat(p, szDictionary, ".tmp", NULL);
+
+    apr_array_header_t *aArgs =
+        apr_array_make(p, aSamples->nelts + 8, sizeof(const char *));
+    *(const char **) apr_array_push(aArgs) = pData->szCompressProgram;
+    *(const char **) apr_array_push(aArgs) = "--train";
+    *(const char **) apr_array_push(aArgs) = "-q";
+    *(const char **) apr_array_push(aArgs) =
+        apr_psprintf(p, "-B%d", DICT_SAMPLE_SZ);
+    *(const char **) apr_array_push(aArgs) =
+        apr_psprintf(p, "--maxdict=%d", DICT_MAX_SZ);
+    *(const char **) apr_array_push(aArgs) = "-o";
+    *(const char **) apr_array_push(aArgs) = szTemp;
+    apr_array_cat(aArgs, aSamples);
+    *(const char **) apr_array_push(aArgs) = NULL;
+
+    apr_procattr_t *procattr;
+    apr_proc_t sProc;
+    apr_status_t rc;
+    int nExit;
+    apr_exit_why_e eWhy;
+
+    if (((rc = apr_procattr_create(&procattr, p)) != APR_SUCCESS) ||
+        ((rc = apr_procattr_cmdtype_set(procattr, APR_PROGRAM))
+         != APR_SUCCESS) ||
+        ((rc = apr_procattr_error_check_set(procattr, 1)) != APR_SUCCESS) ||
+        ((rc = apr_proc_create(&sProc, pData->szCompressProgram,
+                               (const char *const *) aArgs->elts, NULL,
+                               procattr, p)) != APR_SUCCESS)) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                      "mod_autorotate: couldn't run %s to train a dictionary",
+                      pData->szCompressProgram);
+        return NULL;
+    }
+
+    apr_proc_wait(&sProc, &nExit, &eWhy, APR_WAIT);
+    if (eWhy != APR_PROC_EXIT || nExit != 0 ||
+        apr_file_rename(szTemp, szDictionary, p) != APR_SUCCESS) {
+        /* Usually too little to train from yet */
+        ap_log_perror(APLOG_MARK, APLOG_WARNING, OK, p,
+                      "mod_autorotate: couldn't train dictionary %s from %d "
+                      "files", szDictionary, aSamples->nelts);
+        apr_file_remove(szTemp, p);
+        return NULL;
+    }
+
+    ap_log_perror(APLOG_MARK, APLOG_INFO, OK, p,
+                  "mod_autorotate: Trained dictionary %s from %d files",
+                  szDictionary, aSamples->nelts);
+
+    set_current_dictionary(p, szOrigName, nVersion);
+    prune_dictionaries(p, szOrigName, nVersion);
+
+    return szDictionary;
+}
+
+
+/*
+ * The dictionary to compress a rotated log with: the current one for the
+ * log, retraining first if it's older than AutorotateDictionary
+ * allows.  Falls back to the older dictionary, or to none, if training
+ * fails.
+ */
+static const char *
+dictionary_for(apr_pool_t * p, compress_child_info_t * pData,
+               const compress_job_t * pJob)
+{
+    const char *szOrigName = pJob->szOrigName;
+    int nVersion;
+    apr_time_t tMtime;
+    const char *szDictionary = current_dictionary(p, szOrigName, &nVersion,
+                                                  &tMtime);
+
+    apr_time_t tStale = offset_period_start(-pData->nDictionaryRetrain,
+                                            pgConfigData->eInterval,
+                                            pgConfigData->nOffset);
+    if (!szDictionary || tMtime < tStale) {
+        const char *szTrained = train_dictionary(p, pData, pJob, szOrigName,
+                                                 nVersion + 1);
+        if (szTrained) {
+            szDictionary = szTrained;
+        }
+    }
+
+    return szDictionary;
+}
+
+
+/*
+ * Build the command line of the compress program, at the given level
+ * unless that's zero, and with the given dictionary unless that's NULL
+ */
+static const char *const *
+compress_argv(apr_pool_t * p, compress_child_info_t * pData,
+              const char *szDictionary, int nLevel)
+{
+    const char **argv = apr_pcalloc(p, 5 * sizeof(const char *));
+    int nArg = 0;
+
+    argv[nArg++] = pData->szCompressProgram;
+    if (nLevel) {
+        argv[nArg++] = apr_psprintf(p, "-%d", nLevel);
+    }
+    if (szDictionary) {
+        argv[nArg++] = "-D";
+        argv[nArg++] = szDictionary;
+    }
+
+    return argv;
+}
+
+
+/*
+ * Pipe up to nLimit bytes of pSrc, or all of it when nLimit is negative,
+ * through a filter program and write what comes out to pDst, or nowhere
+ * when that's NULL.  Both streams are checksummed on the way through, and
+ * the CPU time the program used is measured.
+ */
+static apr_status_t
+run_filter(apr_pool_t * p, const char *const *argv, apr_file_t * pSrc,
+           apr_off_t nLimit, apr_file_t * pDst, filter_stats_t * pStats)
+{
+    apr_procattr_t *procattr;
+    apr_proc_t sProc;
+    apr_status_t rc;
+
+    memset(pStats, 0, sizeof(*pStats));
+
+    /* Set up attributes of the process.  Our ends of the pipes are
+     * non-blocking so that we can feed and drain it at the same time */
+    if (((rc = apr_procattr_create(&procattr, p)) != APR_SUCCESS) ||
+        ((rc = apr_procattr_io_set(procattr,
+                                   APR_CHILD_BLOCK,
+                                   APR_CHILD_BLOCK,
+                                   APR_NO_PIPE)) != APR_SUCCESS) ||
+        ((rc = apr_procattr_dir_set(procattr, "/tmp")) != APR_SUCCESS) ||
+        ((rc = apr_procattr_cmdtype_set(procattr, APR_PROGRAM))
+         != APR_SUCCESS) ||
+        ((rc = apr_procattr_detach_set(procattr, 0)) != APR_SUCCESS) ||
+        ((rc = apr_procattr_addrspace_set(procattr, 0)) != APR_SUCCESS) ||
+        ((rc = apr_procattr_error_check_set(procattr, 1)) != APR_SUCCESS)) {
+
+        /* Something bad happened, tell the world. */
+        ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                      "mod_autorotate: couldn't set child process attributes: %s",
+                      argv[0]);
+        return rc;
+    }
+
+    /* Our reaped children's CPU time goes up by the program's alone, as
+     * it's the only child we have */
+    struct rusage sBefore, sAfter;
+    getrusage(RUSAGE_CHILDREN, &sBefore);
+
+    rc = apr_proc_create(&sProc, argv[0], argv, NULL, procattr, p);
+    if (rc != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                      "mod_autorotate: couldn't create child process: %s",
+                      argv[0]);
+        return rc;
+    }
+
+    char *pInBuf = apr_palloc(p, COMPRESS_BUF_SZ);
+    char *pOutBuf = apr_palloc(p, COMPRESS_BUF_SZ);
+    apr_size_t nInLen = 0, nInOff = 0;
+    int bInEof = 0, bOutEof = 0;
+    apr_file_t *pToChild = sProc.in;
+
+    while (!bOutEof) {
+        /* Top up the input buffer once the program has taken it all */
+        if (nInOff == nInLen && !bInEof) {
+            nInLen = COMPRESS_BUF_SZ;
+            if (nLimit >= 0 && nLimit - pStats->nInBytes < (apr_off_t) nInLen) {
+                nInLen = nLimit - pStats->nInBytes;
+            }
+            nInOff = 0;
+            rc = nInLen ? apr_file_read(pSrc, pInBuf, &nInLen) : APR_EOF;
+            if (APR_STATUS_IS_EOF(rc)) {
+                bInEof = 1;
+                nInLen = 0;
+                rc = APR_SUCCESS;
+            }
+            else if (rc != APR_SUCCESS) {
+                ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                              "mod_autorotate: reading input of %s", argv[0]);
+                break;
+            }
+            pStats->nInCrc = crc32c_update(pStats->nInCrc, pInBuf, nInLen);
+            pStats->nInBytes += nInLen;
+        }
+
+        /* Closing its input tells the program to flush and exit */
+        if (bInEof && nInOff == nInLen && pToChild) {
+            apr_file_close(pToChild);
+            pToChild = NULL;
+        }
+
+        apr_pollfd_t aFds[2];
+        apr_int32_t nFds = 0, nReady;
+        memset(aFds, 0, sizeof(aFds));
+        if (pToChild) {
+            aFds[nFds].p = p;
+            aFds[nFds].desc_type = APR_POLL_FILE;
+            aFds[nFds].reqevents = APR_POLLOUT;
+            aFds[nFds].desc.f = pToChild;
+            nFds++;
+        }
+        aFds[nFds].p = p;
+        aFds[nFds].desc_type = APR_POLL_FILE;
+        aFds[nFds].reqevents = APR_POLLIN;
+        aFds[nFds].desc.f = sProc.out;
+        nFds++;
+
+        rc = apr_poll(aFds, nFds, &nReady, -1);
+        if (APR_STATUS_IS_EINTR(rc)) {
+            continue;
+        }
+        if (rc != APR_SUCCESS) {
+            ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                          "mod_autorotate: polling compress program");
+            break;
+        }
+
+        int i;
+        for (i = 0; i < nFds; i++) {
+            if (!aFds[i].rtnevents) {
+                continue;
+            }
+
+            if (aFds[i].desc.f == pToChild) {
+                apr_size_t nWrite = nInLen - nInOff;
+                rc = apr_file_write(pToChild, pInBuf + nInOff, &nWrite);
+                if (rc != APR_SUCCESS && !APR_STATUS_IS_EAGAIN(rc)) {
+                    break;
                 }
+                nInOff += nWrite;
+                rc = APR_SUCCESS;
             }
             else {
-                /*  for debugging
-                   ap_log_error(APLOG_MARK, APLOG_DEBUG, OK, s,
-                   "mod_autorotate: Config directive [%s] does not match list item [%s]",
-                   dir->directive, pItem->sDirective.szDirective );
-                 */
+                apr_size_t nRead = COMPRESS_BUF_SZ;
+                rc = apr_file_read(sProc.out, pOutBuf, &nRead);
+                if (APR_STATUS_IS_EOF(rc)) {
+                    bOutEof = 1;
+                    rc = APR_SUCCESS;
+                    continue;
+                }
+                if (APR_STATUS_IS_EAGAIN(rc)) {
+                    rc = APR_SUCCESS;
+                    continue;
+                }
+                if (rc == APR_SUCCESS) {
+                    pStats->nOutCrc =
+                        crc32c_update(pStats->nOutCrc, pOutBuf, nRead);
+                    pStats->nOutBytes += nRead;
+                    if (pDst) {
+                        rc = apr_file_write_full(pDst, pOutBuf, nRead, NULL);
+                    }
+                }
+                if (rc != APR_SUCCESS) {
+                    break;
+                }
             }
-
-            pItem = pItem->pNext;
         }
 
-        /* Recurse into config tree */
-        if (dir->first_child != NULL) {
-            find_log_names(pConfig, pool, s, tLogFiles, dir->first_child);
+        if (rc != APR_SUCCESS) {
+            ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                          "mod_autorotate: streaming through %s", argv[0]);
+            break;
         }
     }
+
+    if (pToChild) {
+        apr_file_close(pToChild);
+    }
+    apr_file_close(sProc.out);
+
+    int nExit;
+    apr_exit_why_e eWhy;
+    apr_proc_wait(&sProc, &nExit, &eWhy, APR_WAIT);
+
+    getrusage(RUSAGE_CHILDREN, &sAfter);
+    pStats->nCpuUsec = rusage_cpu_usec(&sAfter) - rusage_cpu_usec(&sBefore);
+
+    if (rc == APR_SUCCESS && (eWhy != APR_PROC_EXIT || nExit != 0)) {
+        rc = APR_EGENERAL;
+    }
+
+    return rc;
 }
 
 
 /*
- * Check the mtime of the log files to determine if any should have been
- * rotated but weren't for some reason (such as the server being down, or
- * the rotate paramers having been changed)
+ * Pick the compress level for a log from AutorotateCompressLevels.  The
+ * start of the log is compressed at each level, and the level giving the
+ * smallest output within the AutorotateCompressBudget of CPU time per GB
+ * wins.  If none is cheap enough, the cheapest is used.  Returns zero,
+ * for the program's default level, when there's nothing to choose from.
  */
 static int
-check_logfile_dates(apr_pool_t * ptemp, server_rec * s,
-                    apr_array_header_t * aFiles)
+choose_compress_level(apr_pool_t * p, compress_child_info_t * pData,
+                      const compress_job_t * pJob, apr_file_t * pSrc,
+                      const char *szDictionary)
 {
-    char szAscTimePeriod[APR_CTIME_LEN + 1];
-    char szAscTimeFile[APR_CTIME_LEN + 1];
-    apr_time_t tStart;
-    autorotate_config_t *pConfig;
-    int n;
-
-    /* The module configuration */
-    pConfig = ap_get_module_config(s->module_config, &autorotate_module);
-    AP_DEBUG_ASSERT(pConfig != NULL);
-
-    /*
-     * Start of the current period -+ offset
-     */
-    tStart = offset_period_start(0, pConfig->eInterval, pConfig->nOffset);
-    apr_ctime(szAscTimePeriod, tStart);
+    if (!pData->aLevels || pData->aLevels->nelts < 2) {
+        return pData->aLevels && pData->aLevels->nelts ?
+            ((int *) pData->aLevels->elts)[0] : 0;
+    }
 
-    ap_log_perror(APLOG_MARK, APLOG_INFO, OK, ptemp,
-                  "mod_autorotate: Start of current period %s",
-                  szAscTimePeriod);
+    int *pLevels = (int *) pData->aLevels->elts;
+    int nBest = 0, nCheapest = 0;
+    apr_off_t nBestOut = 0;
+    apr_int64_t nCheapestCpu = 0;
+    const char *szTrials = "";
+    int i;
 
-    /*
-     * Check each log file mtime
-     */
-    char **pszLogFiles = (char **) pConfig->aLogFiles->elts;
+    for (i = 0; i < pData->aLevels->nelts; i++) {
+        apr_off_t nOffset = 0;
+        filter_stats_t sStats;
 
-    int i;
-    int bNeedRotate = 0;
-    for (i = 0; i < pConfig->aLogFiles->nelts; i++) {
-        /* File might be relative to server root */
-        const char *pFilename =
-            ap_server_root_relative(ptemp, pszLogFiles[i]);
+        apr_file_seek(pSrc, APR_SET, &nOffset);
+        if (run_filter(p, compress_argv(p, pData, szDictionary, pLevels[i]),
+                       pSrc, COMPRESS_SAMPLE_SZ, NULL, &sStats)
+            != APR_SUCCESS || sStats.nInBytes == 0) {
+            continue;
+        }
 
-        apr_finfo_t fs;
-        apr_status_t status;
-        if ((status = apr_stat(&fs, pFilename, APR_FINFO_MTIME, ptemp))
-            == OK) {
-            if (fs.mtime < tStart) {
-                apr_ctime(szAscTimeFile, fs.mtime);
-                ap_log_error(APLOG_MARK, APLOG_NOTICE, status, s,
-                             "mod_autorotate: Log file %s last written before start "
-                             "of this period (%s < %s).  Requesting immediate rotate.",
-                             pFilename, szAscTimeFile, szAscTimePeriod);
+        /* CPU seconds the whole of a GB would take at this rate */
+        apr_int64_t nCpuPerGb = sStats.nCpuUsec * (1024 * 1024 * 1024 /
+                                                   APR_USEC_PER_SEC) /
+            sStats.nInBytes;
 
-                *(const char **) apr_array_push(aFiles) = pFilename;
+        szTrials = apr_psprintf(p, "%s -%d:%" APR_OFF_T_FMT "%%/%"
+                                APR_INT64_T_FMT "s", szTrials, pLevels[i],
+                                sStats.nOutBytes * 100 / sStats.nInBytes,
+                                nCpuPerGb);
 
-                bNeedRotate = 1;
-            }
+        if (!nCheapest || nCpuPerGb < nCheapestCpu) {
+            nCheapest = pLevels[i];
+            nCheapestCpu = nCpuPerGb;
         }
-        else {
-            if (!APR_STATUS_IS_ENOENT(status)) {
-                ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
-                             "mod_autorotate: could not get modifiied time of %s",
-                             pFilename);
-            }
+        if (nCpuPerGb <= pData->nCompressBudget &&
+            (!nBest || sStats.nOutBytes < nBestOut)) {
+            nBest = pLevels[i];
+            nBestOut = sStats.nOutBytes;
         }
     }
 
-    /* The caller can choose to restart now if we've rotated */
-    return bNeedRotate;
+    apr_off_t nOffset = 0;
+    apr_file_seek(pSrc, APR_SET, &nOffset);
+
+    if (!nBest) {
+        nBest = nCheapest;
+    }
+
+    ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
+                  "mod_autorotate: Compressing %s at level %d, sampled "
+                  "(ratio/CPU per GB):%s", pJob->szLogPath, nBest, szTrials);
+
+    return nBest;
 }
 
 
 /*
- * Record the time we will next try a rotate - ie. the start of the
- * next period.  The monitor hook will pick this up
- * later and initiate the rotate
+ * Compress a single log by piping it through the compress program and
+ * writing the program's output to the archive.  Runs in the forked
+ * compress child.  Both streams are checksummed on the way through and
+ * recorded in the manifest.  The uncompressed log is removed on success,
+ * as the compress program itself would have done.
  */
-void
-record_next_rotate_time(apr_pool_t * ptemp, autorotate_config_t * pConfig)
+static apr_status_t
+compress_stream(apr_pool_t * p, compress_child_info_t * pData,
+                const compress_job_t * pJob)
 {
-    char szAscTime[APR_CTIME_LEN + 1];
+    apr_file_t *pSrc, *pDst;
+    apr_status_t rc;
 
-    pConfig->tNextRotate = offset_period_start(1, pConfig->eInterval,
-                                               pConfig->nOffset);
+    const char *szArchive = apr_pstrcat(p, pJob->szLogPath,
+                                        pData->szCompressSuffix, NULL);
+    const char *szDictionary = NULL;
 
-    apr_ctime(szAscTime, pConfig->tNextRotate);
-    ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, ptemp,
-                  "mod_autorotate: Next rotation due at %s", szAscTime);
+    if (pData->bDictionary) {
+        szDictionary = dictionary_for(p, pData, pJob);
+    }
+
+    if ((rc = apr_file_open(&pSrc, pJob->szLogPath,
+                            APR_FOPEN_READ | APR_FOPEN_BINARY,
+                            APR_OS_DEFAULT, p)) != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                      "mod_autorotate: couldn't open %s", pJob->szLogPath);
+        return rc;
+    }
+
+    int nLevel = choose_compress_level(p, pData, pJob, pSrc, szDictionary);
+    const char *const *argv = compress_argv(p, pData, szDictionary, nLevel);
+
+    /* The source still exists, so anything already at the destination is
+     * left over from an interrupted compress and can be overwritten */
+    if ((rc = apr_file_open(&pDst, szArchive,
+                            APR_FOPEN_WRITE | APR_FOPEN_CREATE |
+                            APR_FOPEN_TRUNCATE | APR_FOPEN_BINARY,
+                            APR_OS_DEFAULT, p)) != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                      "mod_autorotate: couldn't create %s", szArchive);
+        return rc;
+    }
+
+    filter_stats_t sStats;
+    apr_time_t tBegan = apr_time_now();
+    rc = run_filter(p, argv, pSrc, -1, pDst, &sStats);
+    apr_file_close(pSrc);
+
+    apr_status_t rcClose = apr_file_close(pDst);
+    if (rc == APR_SUCCESS) {
+        rc = rcClose;
+    }
+
+    if (rc != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                      "mod_autorotate: compressing %s failed, keeping it",
+                      pJob->szLogPath);
+        apr_file_remove(szArchive, p);
+        return rc;
+    }
+
+    pgMetrics->nLastJobUsec = apr_time_now() - tBegan;
+    pgMetrics->nLastJobCpuUsec = sStats.nCpuUsec;
+    pgMetrics->nCompressUsec += pgMetrics->nLastJobUsec;
+    pgMetrics->nCompressCpuUsec += sStats.nCpuUsec;
+    pgMetrics->nBytesIn += sStats.nInBytes;
+    pgMetrics->nBytesOut += sStats.nOutBytes;
+
+    if (pData->bManifest) {
+        const char *szProgram = nLevel ?
+            apr_psprintf(p, "%s -%d", pData->szCompressProgram, nLevel) :
+            pData->szCompressProgram;
+        append_manifest(p, szArchive, pJob, szProgram, szDictionary,
+                        sStats.nInBytes, sStats.nInCrc,
+                        sStats.nOutBytes, sStats.nOutCrc);
+    }
+
+    return apr_file_remove(pJob->szLogPath, p);
 }
 
 
 /*
- * Handler for the 'open_logs' hook
+ * Write a buffer to a container, adding it to the running checksum and
+ * byte count of the container
+ */
+static apr_status_t
+write_counted(apr_file_t * pFile, const void *pvBuf, apr_size_t nLen,
+              apr_uint32_t * pnCrc, apr_off_t * pnBytes)
+{
+    *pnCrc = crc32c_update(*pnCrc, pvBuf, nLen);
+    *pnBytes += nLen;
+    return apr_file_write_full(pFile, pvBuf, nLen, NULL);
+}
+
+
+/*
+ * Write the index that heads a container.  It is wrapped so that
+ * decompressing the container skips it: as the comment of an empty gzip
+ * member, or as a zstd skippable frame.
+ */
+static apr_status_t
+write_container_index(apr_file_t * pFile, container_codec_t eCodec,
+                      const char *szIndex, apr_uint32_t * pnCrc,
+                      apr_off_t * pnBytes)
+{
+    apr_size_t nLen = strlen(szIndex);
+    apr_status_t rc;
+
+    if (eCodec == CONTAINER_GZIP) {
+        /* Magic, deflate, FCOMMENT, no mtime, no extra flags, Unix */
+        static const unsigned char aHeader[] =
+            { 0x1f, 0x8b, 0x08, 0x10, 0, 0, 0, 0, 0, 0x03 };
+        /* Empty final deflate block, then CRC-32 and size of nothing */
+        static const unsigned char aTrailer[] =
+            { 0x03, 0x00, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+        if ((rc = write_counted(pFile, aHeader, sizeof(aHeader), pnCrc,
+                                pnBytes)) != APR_SUCCESS ||
+            (rc = write_counted(pFile, szIndex, nLen + 1, pnCrc,
+                                pnBytes)) != APR_SUCCESS) {
+            return rc;
+        }
+        return write_counted(pFile, aTrailer, sizeof(aTrailer), pnCrc,
+                             pnBytes);
+    }
+
+    /* Skippable frame magic and little endian frame size */
+    unsigned char aHeader[8] = { 0x50, 0x2a, 0x4d, 0x18 };
+    aHeader[4] = nLen & 0xff;
+    aHeader[5] = (nLen >> 8) & 0xff;
+    aHeader[6] = (nLen >> 16) & 0xff;
+    aHeader[7] = (nLen >> 24) & 0xff;
+
+    if ((rc = write_counted(pFile, aHeader, sizeof(aHeader), pnCrc,
+                            pnBytes)) != APR_SUCCESS) {
+        return rc;
+    }
+    return write_counted(pFile, szIndex, nLen, pnCrc, pnBytes);
+}
+
+
+/*
+ * Merge the compressed archives of a finished container period into one
+ * container, then remove them.  Runs in the forked compress child.
  *
- * Runs when Apache opens its log files, in the caretaker process
- * We run this last in the chain, so that all the other modules have had
- * a chance to open their logs before we run.
+ * The container starts with an index, one line per member after the
+ * first line:
  *
- * pconf: Configuration pool, cleared on restart
- * plog:  Logging streams pool, cleared after config file read
- * ptemp: Temp pool, exists during config phase only
+ *   archive  offset  length  period-start  period-end
+ *
+ * Offsets count from the end of the index, so each member can be read
+ * and decompressed on its own.  Members are copied as they are, so the
+ * container as a whole decompresses to the logs in order.
  */
-static int
-open_logs_func(apr_pool_t * pconf, apr_pool_t * plog,
-               apr_pool_t * ptemp, server_rec * s)
+static apr_status_t
+consolidate_archives(apr_pool_t * p, compress_child_info_t * pData,
+                     const compress_job_t * pJob)
 {
+    const char *szOrigName = pJob->szLogPath;
+    container_codec_t eCodec = container_codec(pData->szCompressSuffix);
+    char *szSuffix = apr_pcalloc(p, 256);
+    apr_status_t rc;
+
+    const char *szContainer = container_name(p, szOrigName, szSuffix,
+                                             pJob->tPeriodStart);
+
+    /* Find the archives, oldest first.  Give up for now if any are still
+     * to be compressed */
+    apr_array_header_t *aMembers =
+        apr_array_make(p, 32, sizeof(archive_info_t));
+    apr_time_t tStart;
+    apr_time_t tEnd = pJob->tPeriodEnd;
+    int nPeriod;
+    for (nPeriod = 0;; nPeriod--) {
+        tStart = offset_period_start(nPeriod, pgConfigData->eInterval,
+                                     pgConfigData->nOffset);
+        if (tStart < pJob->tPeriodStart) {
+            break;
+        }
+        if (tStart >= pJob->tPeriodEnd) {
+            continue;
+        }
+
+        const char *szName = archive_name(p, szOrigName, szSuffix, tStart);
+        apr_finfo_t fs;
+
+        if (apr_stat(&fs, szName, APR_FINFO_MIN, p) == APR_SUCCESS) {
+            ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, p,
+                          "mod_autorotate: Not consolidating %s yet, %s "
+                          "is still uncompressed", szContainer, szName);
+            return APR_SUCCESS;
+        }
+
+        szName = apr_pstrcat(p, szName, pData->szCompressSuffix, NULL);
+        if (apr_stat(&fs, szName, APR_FINFO_SIZE, p) == APR_SUCCESS) {
+            archive_info_t *pMember = apr_array_push(aMembers);
+            pMember->szPath = szName;
+            pMember->nSize = fs.size;
+            pMember->tPeriodStart = tStart;
+            pMember->tPeriodEnd = tEnd;
+            pMember->bCompressed = 1;
+            pMember->bContainer = 0;
+            pMember->nPeriods = 1;
+            pMember->szOrigName = szOrigName;
+        }
+
+        tEnd = tStart;
+    }
+
+    if (aMembers->nelts == 0) {
+        return APR_SUCCESS;
+    }
+
+    /* Build the index */
+    archive_info_t *pMembers = (archive_info_t *) aMembers->elts;
+    const char *szIndex = CONTAINER_INDEX_MAGIC;
+    apr_off_t nOffset = 0;
     int i;
-    autorotate_config_t *pConfig;
+    for (i = aMembers->nelts - 1; i >= 0; i--) {
+        szIndex = apr_psprintf(p, "%s%s\t%" APR_OFF_T_FMT "\t%"
+                               APR_OFF_T_FMT "\t%" APR_INT64_T_FMT "\t%"
+                               APR_INT64_T_FMT "\n", szIndex,
+                               apr_filepath_name_get(pMembers[i].szPath),
+                               nOffset, pMembers[i].nSize,
+                               (apr_int64_t)
+                               apr_time_sec(pMembers[i].tPeriodStart),
+                               (apr_int64_t)
+                               apr_time_sec(pMembers[i].tPeriodEnd));
+        nOffset += pMembers[i].nSize;
+    }
 
-    /* The module configuration */
-    pConfig = ap_get_module_config(s->module_config, &autorotate_module);
-    AP_DEBUG_ASSERT(pConfig != NULL);
+    /* Write to a temporary name so a half written container is never
+     * mistaken for a finished one */
+    const char *szTemp = apr_pstrcat(p, szContainer, ".tmp", NULL);
+    apr_file_t *pDst;
+    if ((rc = make_archive_dir(p, szTemp)) != APR_SUCCESS ||
+        (rc = apr_file_open(&pDst, szTemp,
+                            APR_FOPEN_WRITE | APR_FOPEN_CREATE |
+                            APR_FOPEN_TRUNCATE | APR_FOPEN_BINARY,
+                            APR_OS_DEFAULT, p)) != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                      "mod_autorotate: couldn't create %s", szTemp);
+        return rc;
+    }
 
-    /* Horrendous - but the monitor hook doesn't have any other way to get
-     * to the module config */
-    pgConfigData = pConfig;
+    char *pBuf = apr_palloc(p, COMPRESS_BUF_SZ);
+    apr_off_t nInBytes = 0, nOutBytes = 0;
+    apr_uint32_t nInCrc = 0, nOutCrc = 0;
 
-    /* Do nothing if we're not enabled */
-    if (!pConfig->bEnabled)
-        return DECLINED;
+    rc = write_container_index(pDst, eCodec, szIndex, &nOutCrc, &nOutBytes);
 
-    /* Allocate a temporary table for the log file names */
-    apr_table_t *tLogFiles = apr_table_make(ptemp, 5);
+    for (i = aMembers->nelts - 1; i >= 0 && rc == APR_SUCCESS; i--) {
+        apr_file_t *pSrc;
+        if ((rc = apr_file_open(&pSrc, pMembers[i].szPath,
+                                APR_FOPEN_READ | APR_FOPEN_BINARY,
+                                APR_OS_DEFAULT, p)) != APR_SUCCESS) {
+            break;
+        }
 
-    /* Pull out the list of configured log files */
-    find_log_names(pConfig, ptemp, s, tLogFiles, ap_conftree);
+        apr_off_t nCopied = 0;
+        for (;;) {
+            apr_size_t nRead = COMPRESS_BUF_SZ;
+            rc = apr_file_read(pSrc, pBuf, &nRead);
+            if (APR_STATUS_IS_EOF(rc)) {
+                rc = APR_SUCCESS;
+                break;
+            }
+            if (rc != APR_SUCCESS) {
+                break;
+            }
 
-    /*
-     * Table will be de-duped, now copy values to the server config
-     */
+            nInCrc = crc32c_update(nInCrc, pBuf, nRead);
+            nInBytes += nRead;
+            nCopied += nRead;
+            if ((rc = write_counted(pDst, pBuf, nRead, &nOutCrc,
+                                    &nOutBytes)) != APR_SUCCESS) {
+                break;
+            }
+        }
+        apr_file_close(pSrc);
 
-    /* A table is just an array of table entries */
-    const apr_array_header_t *arr = apr_table_elts(tLogFiles);
-    AP_DEBUG_ASSERT(arr != NULL);
-    if (arr) {
-        const apr_table_entry_t *elts = (const apr_table_entry_t *) arr->elts;
-        for (i = 0; i < arr->nelts; i++) {
-            *(const char **) apr_array_push(pConfig->aLogFiles) =
-                apr_pstrdup(pconf, elts[i].key);
-            ap_log_error(APLOG_MARK, APLOG_DEBUG, OK, s,
-                         "Added log file %s", elts[i].key);
+        /* The index would be wrong if the member changed under us */
+        if (rc == APR_SUCCESS && nCopied != pMembers[i].nSize) {
+            rc = APR_EGENERAL;
         }
     }
 
-    ap_log_error(APLOG_MARK, APLOG_NOTICE, OK, s,
-                 "mod_autorotate: Operating on %d log files",
-                 pConfig->aLogFiles->nelts);
+    apr_status_t rcClose = apr_file_close(pDst);
+    if (rc == APR_SUCCESS) {
+        rc = rcClose;
+    }
+    if (rc == APR_SUCCESS) {
+        rc = apr_file_rename(szTemp, szContainer, p);
+    }
 
-    /* Prune old logs */
-    do_prune(ptemp);
+    if (rc != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                      "mod_autorotate: consolidating %s failed",
+                      szContainer);
+        apr_file_remove(szTemp, p);
+        return rc;
+    }
 
-    /* Kick off an initial check of the log files, and rotate right now
-     * if we need to.  The server restarts after the first initialisation
-     * on its own as standard, so we don't need to do anything special
-     * to request a restart.
-     */
-    apr_array_header_t *aFiles = apr_array_make(ptemp, 5, sizeof(char *));
-    if (check_logfile_dates(ptemp, s, aFiles)) {
-        do_rotate(ptemp, aFiles);
+    if (pData->bManifest) {
+        append_manifest(p, szContainer, pJob, "consolidate", NULL,
+                        nInBytes, nInCrc, nOutBytes, nOutCrc);
     }
 
-    /* Record the date of the next required rotate */
-    record_next_rotate_time(pconf, pConfig);
+    /* The members are safely in the container now */
+    for (i = 0; i < aMembers->nelts; i++) {
+        apr_file_remove(pMembers[i].szPath, p);
+    }
 
-    /* Create a list of files that need to be compressed.
-     * Note that we don't kick off the compression here, because any
-     * process we create will get killed when startup phase 1 goes away.
-     * We leave it to the monitor function to kick off the compresions
-     * the first time it runs (which only happens when the server is
-     * really up and working fully)
-     */
-    create_compress_queue(pconf, ptemp, pConfig);
+    ap_log_perror(APLOG_MARK, APLOG_INFO, OK, p,
+                  "mod_autorotate: Consolidated %d archives into %s",
+                  aMembers->nelts, szContainer);
 
-    return OK;
+    return APR_SUCCESS;
 }
 
 
-static int
-create_compress_queue(apr_pool_t * pconf, apr_pool_t * ptemp,
-                      autorotate_config_t * pConfig)
+/*
+ * Update a CRC-32C (Castagnoli) checksum with the given buffer.  Start
+ * with a checksum of zero.
+ */
+static apr_uint32_t
+crc32c_update(apr_uint32_t nCrc, const void *pvBuf, apr_size_t nLen)
 {
-    compress_child_info_t *pInfo = &pConfig->compressInfo;
+    static apr_uint32_t aTable[256];
+    static int bTableReady = 0;
+    const unsigned char *pBuf = pvBuf;
+
+    if (!bTableReady) {
+        apr_uint32_t n, k, c;
+        for (n = 0; n < 256; n++) {
+            c = n;
+            for (k = 0; k < 8; k++) {
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : (c >> 1);
+            }
+            aTable[n] = c;
+        }
+        bTableReady = 1;
+    }
 
-    /* Decline to create a queue if compression is disabled */
-    if (pConfig->nCompressAfter == 0) {
-        ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, ptemp,
-                      "mod_autorotate: Log compression disabled");
-        return OK;
+    nCrc = ~nCrc;
+    while (nLen--) {
+        nCrc = aTable[(nCrc ^ *pBuf++) & 0xff] ^ (nCrc >> 8);
+    }
+
+    return ~nCrc;
+}
+
+
+/* ---------  Log sink  ------------------------------------------------------*/
+
+/* Set by signal handlers in the sink process */
+static volatile sig_atomic_t bSinkReopen = 0;
+static volatile sig_atomic_t bSinkStop = 0;
+
+/* A log being written by the sink process */
+typedef struct
+{
+    const sink_stream_t *pStream;
+    apr_file_t *pFifo;
+    apr_file_t *pLog;
+    char *pBuf;
+    apr_size_t nLen;
+} sink_state_t;
+
+
+static void sink_signal_func(int nSignal)
+{
+    if (nSignal == SIGHUP) {
+        bSinkReopen = 1;
+    }
+    else {
+        bSinkStop = 1;
+    }
+}
+
+
+/*
+ * Write the first nLen buffered bytes of a log, followed by pExtra, in a
+ * single writev() and keep whatever is left over in the buffer
+ */
+static void
+sink_write(apr_pool_t * p, sink_state_t * pState, apr_size_t nLen,
+           const char *pExtra, apr_size_t nExtra)
+{
+    struct iovec aVec[2];
+    apr_size_t nVec = 0;
+
+    if (nLen) {
+        aVec[nVec].iov_base = pState->pBuf;
+        aVec[nVec++].iov_len = nLen;
+    }
+    if (nExtra) {
+        aVec[nVec].iov_base = (char *) pExtra;
+        aVec[nVec++].iov_len = nExtra;
+    }
+    if (nVec == 0) {
+        return;
     }
 
-    /* Create a sub-pool for the compress process which will be cleared when
-     * done with the compressions... */
-    int rc;
-    if ((rc = apr_pool_create(&pInfo->pPool, pconf)) != APR_SUCCESS) {
-        ap_log_perror(APLOG_MARK, APLOG_DEBUG, rc, ptemp,
-                      "mod_autorotate: Error creating sub-pool");
-        pInfo->aCompressQueue = NULL;
-        return rc;
+    apr_status_t rc = apr_file_writev_full(pState->pLog, aVec, nVec, NULL);
+    if (rc != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                      "mod_autorotate: log sink writing %s",
+                      pState->pStream->szLogPath);
     }
 
-    pInfo->aCompressQueue = apr_array_make(pInfo->pPool, 5, sizeof(char *));
-
-    char *szSuffix = apr_pcalloc(ptemp, 256);
-
-    /* Cycle through the log files */
-    int i;
-    char **pszLogFiles = (char **) pConfig->aLogFiles->elts;
-    for (i = 0; i < pConfig->aLogFiles->nelts; i++) {
-        /* File might be relative to server root */
-        const char *szOrigName =
-            ap_server_root_relative(ptemp, pszLogFiles[i]);
-        const char *szNewName = NULL;
+    pState->nLen -= nLen;
+    memmove(pState->pBuf, pState->pBuf + nLen, pState->nLen);
+}
 
-        /* go back one period at a time, decrementing the number to keep
-         * each time a log exists for that previous period.  After we get to
-         * zero, start deleting for subsequent periods */
 
-        int nCurrentPeriod = 0;
-        int nNumFound = 0;
-        for (nCurrentPeriod = 0; nCurrentPeriod > -100; nCurrentPeriod--) {
-            apr_time_t tStart = offset_period_start(nCurrentPeriod,
-                                                    pConfig->eInterval,
-                                                    pConfig->nOffset);
-
-            apr_time_exp_t tExp;
-            apr_time_exp_lt(&tExp, tStart);
-
-            apr_size_t nSuffixLen;
-            apr_strftime(szSuffix, &nSuffixLen, 255,
-                         pgConfigData->szFormat, &tExp);
-
-            szNewName = apr_psprintf(ptemp, "%s.%s", szOrigName, szSuffix);
-
-            /* Check if a log exists for this previous period */
-            apr_finfo_t fs;
-            apr_status_t nStatus = apr_stat(&fs, szNewName, APR_FINFO_MTIME,
-                                            ptemp);
-            if (nStatus == OK) {        /* File exists */
-                nNumFound++;
-
-                if (nNumFound >= pConfig->nCompressAfter) {
-                    *(const char **) apr_array_push(pInfo->aCompressQueue) =
-                        apr_pstrdup(pInfo->pPool, szNewName);
-                }
-            }
+/*
+ * Read whatever is waiting in a log's FIFO into its buffer, writing out
+ * the buffer together with the new data when it won't fit
+ */
+static void sink_drain(apr_pool_t * p, sink_state_t * pState, char *pChunk)
+{
+    for (;;) {
+        apr_size_t nRead = SINK_BUF_SZ;
+        if (apr_file_read(pState->pFifo, pChunk, &nRead) != APR_SUCCESS ||
+            nRead == 0) {
+            return;
+        }
 
-        }                       /* End for (period) */
+        if (pState->nLen + nRead <= SINK_BUF_SZ) {
+            memcpy(pState->pBuf + pState->nLen, pChunk, nRead);
+            pState->nLen += nRead;
+        }
+        else {
+            sink_write(p, pState, pState->nLen, pChunk, nRead);
+        }
+    }
+}
 
-    }                           /* End for (log files */
 
+/*
+ * Move a log on to a new file after do_rotate() has renamed it.  Complete
+ * lines go to the old file, so none is split between the two.
+ */
+static void sink_reopen(apr_pool_t * p, sink_state_t * pState)
+{
+    apr_size_t nLen = pState->nLen;
+    while (nLen && pState->pBuf[nLen - 1] != '\n') {
+        nLen--;
+    }
 
-    return APR_SUCCESS;
+    sink_write(p, pState, nLen, NULL, 0);
+    apr_file_close(pState->pLog);
+
+    apr_status_t rc = apr_file_open(&pState->pLog, pState->pStream->szLogPath,
+                                    APR_FOPEN_WRITE | APR_FOPEN_CREATE |
+                                    APR_FOPEN_APPEND | APR_FOPEN_BINARY,
+                                    APR_OS_DEFAULT, p);
+    if (rc != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                      "mod_autorotate: log sink couldn't reopen %s",
+                      pState->pStream->szLogPath);
+        _exit(1);
+    }
 }
 
 
-
 /*
- * Return the start of a given period, offset by a given number of
- * seconds.  The offset can be negative, which complicates the calculation
- * and forces us to work out how far through the current period we are before
- * reliably being able to return the correct result
+ * Main loop of the sink process.  Reads every piped log's FIFO, buffers
+ * the data and appends it to the log file at least every
+ * SINK_FLUSH_INTERVAL.  SIGHUP reopens the logs after a rotation, SIGTERM
+ * writes out everything still waiting and exits.
  */
-static apr_time_t
-offset_period_start(int nCount, rotate_interval_t ePeriod,
-                    apr_int64_t nOffset)
+static void sink_main(apr_pool_t * p, apr_array_header_t * aStreams)
 {
-    apr_time_t tStart;
+    sink_stream_t *pStreams = (sink_stream_t *) aStreams->elts;
+    sink_state_t *pStates = apr_pcalloc(p, aStreams->nelts *
+                                        sizeof(sink_state_t));
+    apr_pollfd_t *pFds = apr_pcalloc(p, aStreams->nelts *
+                                     sizeof(apr_pollfd_t));
+    char *pChunk = apr_palloc(p, SINK_BUF_SZ);
+    int i;
 
-    /* If using a negative offset (eg. monthly minus 1 hour) */
-    if (nOffset < 0) {
+    for (i = 0; i < aStreams->nelts; i++) {
+        sink_state_t *pState = &pStates[i];
+        apr_os_file_t nFd = pStreams[i].nFifo;
 
-        /* Get the start of the next period and offset it */
-        tStart = period_start(1, ePeriod);
-        tStart += nOffset;
+        pState->pStream = &pStreams[i];
+        pState->pBuf = apr_palloc(p, SINK_BUF_SZ);
+        pState->nLen = 0;
 
-        /* If we're already into the "next" period then offset the
-         * period count that's been asked for by one */
-        if (tStart < apr_time_now()) {
-            nCount++;
+        apr_os_pipe_put(&pState->pFifo, &nFd, p);
+        apr_file_pipe_timeout_set(pState->pFifo, 0);
+
+        apr_status_t rc = apr_file_open(&pState->pLog, pStreams[i].szLogPath,
+                                        APR_FOPEN_WRITE | APR_FOPEN_CREATE |
+                                        APR_FOPEN_APPEND | APR_FOPEN_BINARY,
+                                        APR_OS_DEFAULT, p);
+        if (rc != APR_SUCCESS) {
+            ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                          "mod_autorotate: log sink couldn't open %s",
+                          pStreams[i].szLogPath);
+            _exit(1);
         }
+
+        pFds[i].p = p;
+        pFds[i].desc_type = APR_POLL_FILE;
+        pFds[i].reqevents = APR_POLLIN;
+        pFds[i].desc.f = pState->pFifo;
     }
 
-    tStart = period_start(nCount, ePeriod);
-    tStart += nOffset;
-    return tStart;
+    apr_time_t tFlush = apr_time_now() + SINK_FLUSH_INTERVAL;
+    for (;;) {
+        apr_int32_t nReady = 0;
+        apr_status_t rc = apr_poll(pFds, aStreams->nelts, &nReady,
+                                   SINK_FLUSH_INTERVAL);
+        if (rc != APR_SUCCESS && !APR_STATUS_IS_EINTR(rc) &&
+            !APR_STATUS_IS_TIMEUP(rc)) {
+            ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                          "mod_autorotate: log sink polling");
+            _exit(1);
+        }
+
+        for (i = 0; i < aStreams->nelts; i++) {
+            if (bSinkStop || (rc == APR_SUCCESS && pFds[i].rtnevents)) {
+                sink_drain(p, &pStates[i], pChunk);
+            }
+        }
+
+        if (bSinkReopen) {
+            bSinkReopen = 0;
+            for (i = 0; i < aStreams->nelts; i++) {
+                sink_reopen(p, &pStates[i]);
+            }
+        }
+
+        apr_time_t tNow = apr_time_now();
+        if (bSinkStop || tNow >= tFlush) {
+            for (i = 0; i < aStreams->nelts; i++) {
+                sink_write(p, &pStates[i], pStates[i].nLen, NULL, 0);
+            }
+            tFlush = tNow + SINK_FLUSH_INTERVAL;
+        }
+
+        if (bSinkStop) {
+            _exit(0);
+        }
+    }
 }
 
 
 /*
- * Return the start of a given period.  nCount defines the number of periods
- * ahead or before now.  For example :
- *  n = 0,   e = DAILY    Midnight today
- *  n = 1,   e = DAILY    Midnight tomorrow
- *  n = 0,   e = MONTHLY  Midnight on 1st day of the current month
- *  n = -1,  e = MONTHLY  Midnight on 1st day of the previous month
+ * Fork the log sink and register with Apache so that we recieve
+ * notification when it dies.  It goes when its pool is cleared, ie. at
+ * restart, after writing out what it has.
  */
-static apr_time_t period_start(int nCount, rotate_interval_t ePeriod)
+static apr_status_t run_log_sink(sink_info_t * pSink)
 {
-    apr_time_exp_t T;
-    apr_time_t tNow, tThen;
+    apr_pool_t *pPool = pSink->pPool;
+    apr_proc_t *pProc = apr_pcalloc(pPool, sizeof(*pProc));
 
-    /* Representation of now, local time */
-    tNow = apr_time_now();
-    apr_time_exp_lt(&T, tNow);
+    apr_status_t rc = apr_proc_fork(pProc, pPool);
 
-    /* If period is monthly or weekly, go to the start of the month or
-     * start of the week.
-     * In all cases move forward or back the given number of periods.
-     */
-    switch (ePeriod) {
-    case MONTHLY:
-        T.tm_mday = 1;          /* Start of this month */
-        T.tm_mon += nCount;     /* plus or minus a number of months */
-        T.tm_hour = 0;          /* Start at midnight */
+    if (rc == APR_INCHILD) {
+        apr_signal(SIGINT, SIG_DFL);
+        apr_signal(AP_SIG_GRACEFUL, SIG_DFL);
+        apr_signal(SIGCHLD, SIG_DFL);
+        apr_signal(SIGPIPE, SIG_IGN);
+        apr_signal(SIGHUP, sink_signal_func);
+        apr_signal(SIGTERM, sink_signal_func);
 
-        /* Apache's mktime() replacement doesn't normalise
-         * out-of-range month fields across year boundaries,
-         * so let's just do that ourselves */
-        T.tm_year += T.tm_mon / 12;
-        T.tm_mon = T.tm_mon % 12;
-        if (T.tm_mon < 0) {     /* Deal with past months */
-            T.tm_mon += 12;
-            T.tm_year -= 1;
-        }
+        sink_main(pPool, pSink->aStreams);
+        _exit(0);
+    }
 
-        T.tm_min = 0;
-        break;
-    case WEEKLY:
-        T.tm_mday -= T.tm_wday; /* Start of this week */
-        T.tm_mday += (7 * nCount);      /* +/- number of weeks */
-        T.tm_hour = 0;          /* Start at midnight */
-        T.tm_min = 0;
-        break;
-    case DAILY:
-        T.tm_mday += nCount;    /* +/- number of days */
-        T.tm_hour = 0;          /* Start at midnight */
-        T.tm_min = 0;
-        break;
-    case HOURLY:
-        T.tm_hour += nCount;    /* +/- number of hours */
-        T.tm_min = 0;
-        break;
-#if defined(ENABLE_PERMINUTE)
-    case PERMINUTE:
-        T.tm_min += nCount;     /* +/- number of minutes */
-        break;
-#endif
+    if (rc != APR_INPARENT) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, rc, pPool,
+                      "mod_autorotate: couldn't create log sink process");
+        return rc;
     }
 
+    pSink->pProc = pProc;
+    apr_proc_other_child_register(pProc, sink_cb_func, pSink, NULL, pPool);
+    apr_pool_note_subprocess(pPool, pProc, APR_KILL_AFTER_TIMEOUT);
 
-    /* Always start at the beginning of the minute */
-    T.tm_sec = T.tm_usec = 0;
+    ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, pPool,
+                  "mod_autorotate: Started log sink, PID %d, for %d logs",
+                  pProc->pid, pSink->aStreams->nelts);
 
-    apr_time_exp_gmt_get(&tThen, &T);
-    return tThen;
+    return APR_SUCCESS;
 }
 
 
 /*
- * Callback used to notify us that a compress child died
- * pvData is a pointer to the apr_proc_t
+ * Callback used to notify us that the log sink died.  The monitor starts
+ * another.
  */
-static void compress_cb_func(int nReason, void *pvData, int nStatus)
+static void sink_cb_func(int nReason, void *pvData, int nStatus)
 {
-    compress_child_info_t *pChildInfo = (compress_child_info_t *) pvData;
+    sink_info_t *pSink = (sink_info_t *) pvData;
 
     switch (nReason) {
-        /* Unregister the child if its finished */
     case APR_OC_REASON_DEATH:
     case APR_OC_REASON_RESTART:
     case APR_OC_REASON_LOST:
-        apr_proc_other_child_unregister(pChildInfo);
+        apr_proc_other_child_unregister(pSink);
         break;
 
-        /* This is probably because we called the unregister above.. */
     case APR_OC_REASON_UNREGISTER:
         return;
-        break;
     };
 
+    ap_log_perror(APLOG_MARK, APLOG_ERR, OK, pSink->pPool,
+                  "mod_autorotate: Log sink %d exited with status %d",
+                  pSink->pProc->pid, nStatus);
 
-    /* Log the success or failure */
-    ap_log_perror(APLOG_MARK, APLOG_NOTICE, OK, pChildInfo->pPool,
-                  "mod_autorotate: Compress process %d done: %s  %d left.",
-                  pChildInfo->pProc->pid,
-                  (nStatus == 0) ? "OK" : "FAILED",
-                  pChildInfo->aCompressQueue->nelts);
-
-    run_next_compress_child(pChildInfo);
-    return;
+    pSink->pProc = NULL;
 }
 
 
+/* ---------  Tracing  -------------------------------------------------------*/
+
 /*
- * Start a child process and register with Apache so that we recieve
- * notification when it dies.
+ * Start timing a phase of work for the trace
  */
-static apr_status_t run_next_compress_child(compress_child_info_t * pData)
+static void trace_begin(trace_span_t * pSpan, const char *szName)
 {
-    const char *const *env;
-    apr_procattr_t *procattr;
-    apr_proc_t *pProc;
-    apr_status_t rc = APR_SUCCESS;
+    pSpan->szName = szName;
+    pSpan->tStart = apr_time_now();
+    pSpan->nCpuStart = -1;
+    pSpan->nFaultsStart = 0;
+#if defined(ENABLE_SIMULATION)
+    pSpan->nProbesStart = ngSimProbes;
+#endif
 
-    AP_DEBUG_ASSERT(pData != NULL);
+    /* Only worth the system call when tracing */
+    if (pgConfigData && pgConfigData->szTraceFile) {
+        struct rusage sUsage;
+        getrusage(RUSAGE_SELF, &sUsage);
+        pSpan->nCpuStart = rusage_cpu_usec(&sUsage);
+        pSpan->nFaultsStart = sUsage.ru_minflt;
+    }
+}
 
-    apr_pool_t *pPool = pData->pPool;
 
-    /* We're done if there are no items left on the queue.
-     * Delete the subpool and return
-     */
-    if (pData->aCompressQueue->nelts == 0) {
-        ap_log_perror(APLOG_MARK, APLOG_INFO, rc, pPool,
-                      "mod_autorotate: Done compressing");
-        apr_pool_clear(pPool);
-        pData->aCompressQueue = NULL;
-        pData->szLogPath = NULL;
-        return OK;
+/*
+ * User and system time from getrusage() in microseconds
+ */
+static apr_int64_t rusage_cpu_usec(const struct rusage *pUsage)
+{
+    return (apr_int64_t) (pUsage->ru_utime.tv_sec + pUsage->ru_stime.tv_sec)
+        * APR_USEC_PER_SEC + pUsage->ru_utime.tv_usec +
+        pUsage->ru_stime.tv_usec;
+}
+
+
+/*
+ * Write a finished phase of work to the AutorotateTraceFile, if there is
+ * one, with szArgs as the members of its args object.  The file is a
+ * Chrome trace event array, one complete ("X") event per line, which
+ * chrome://tracing and Perfetto load as is.  The array is never closed,
+ * as both allow for that, so events can simply be appended by the parent
+ * and the compress child alike.  It's moved aside to <file>.1 when it
+ * reaches TRACE_MAX_SZ.
+ */
+static void trace_end(apr_pool_t * p, trace_span_t * pSpan,
+                      const char *szArgs)
+{
+    if (!pgConfigData || !pgConfigData->szTraceFile) {
+        return;
     }
 
-    /* Otherwise plough on with the compressions */
-    char **pszEntries = apr_array_pop(pData->aCompressQueue);
-    /* Store name of log being worked on right now */
-    pData->szLogPath = *pszEntries;
-    AP_DEBUG_ASSERT(pData->szLogPath != NULL);
+    const char *szTraceFile = pgConfigData->szTraceFile;
+    apr_time_t tNow = apr_time_now();
+    apr_finfo_t fs;
 
-    const char *argv[] = { pData->szCompressProgram, pData->szLogPath, NULL };
+    if (apr_stat(&fs, szTraceFile, APR_FINFO_SIZE, p) == APR_SUCCESS &&
+        fs.size >= TRACE_MAX_SZ) {
+        apr_file_rename(szTraceFile,
+                        apr_pstrcat(p, szTraceFile, ".1", NULL), p);
+    }
 
-    /* Set up attributes of the process */
-    if (((rc = apr_procattr_create(&procattr, pPool)) != APR_SUCCESS) ||
-        ((rc = apr_procattr_io_set(procattr,
-                                   APR_FULL_BLOCK,
-                                   APR_NO_PIPE,
-                                   APR_NO_PIPE)) != APR_SUCCESS) ||
-        ((rc = apr_procattr_dir_set(procattr, "/tmp")) != APR_SUCCESS) ||
-        ((rc = apr_procattr_cmdtype_set(procattr, APR_PROGRAM))
-         != APR_SUCCESS) ||
-        ((rc = apr_procattr_detach_set(procattr, 0)) != APR_SUCCESS) ||
-        ((rc = apr_procattr_addrspace_set(procattr, 0)) != APR_SUCCESS) ||
-        ((rc = apr_procattr_error_check_set(procattr, 1)) != APR_SUCCESS)) {
+    apr_file_t *pFile;
+    apr_status_t rc = apr_file_open(&pFile, szTraceFile,
+                                    APR_FOPEN_WRITE | APR_FOPEN_CREATE |
+                                    APR_FOPEN_APPEND, APR_OS_DEFAULT, p);
+    if (rc != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, rc, p,
+                      "mod_autorotate: couldn't open trace file %s",
+                      szTraceFile);
+        return;
+    }
 
-        /* Something bad happened, tell the world. */
-        ap_log_perror(APLOG_MARK, APLOG_ERR, rc, pPool,
-                      "mod_autorotate: couldn't set child process attributes: %s",
-                      pData->szCompressProgram);
+    /* A new file starts the array */
+    apr_off_t nOffset = 0;
+    apr_file_seek(pFile, APR_END, &nOffset);
+
+    /* What the phase cost besides time, ahead of its own args */
+    const char *szCost = "";
+    if (pSpan->nCpuStart >= 0) {
+        struct rusage sUsage;
+        getrusage(RUSAGE_SELF, &sUsage);
+        szCost = apr_psprintf(p, "\"cpu_us\":%" APR_INT64_T_FMT
+                              ",\"minflt\":%ld,\"maxrss_kb\":%ld",
+                              rusage_cpu_usec(&sUsage) - pSpan->nCpuStart,
+                              sUsage.ru_minflt - pSpan->nFaultsStart,
+                              sUsage.ru_maxrss);
+#if defined(ENABLE_SIMULATION)
+        szCost = apr_psprintf(p, "%s,\"probes\":%" APR_UINT64_T_FMT,
+                              szCost, ngSimProbes - pSpan->nProbesStart);
+#endif
+        if (szArgs && *szArgs) {
+            szCost = apr_pstrcat(p, szCost, ",", NULL);
+        }
     }
-    else {
 
-        pProc = apr_pcalloc(pPool, sizeof(*pProc));
-        rc = apr_proc_create(pProc, pData->szCompressProgram,
-                             argv, NULL, procattr, pPool);
+    int nPid = getpid();
+    const char *szEvent =
+        apr_psprintf(p, "%s{\"name\":\"%s\",\"cat\":\"autorotate\","
+                     "\"ph\":\"X\",\"ts\":%" APR_INT64_T_FMT ",\"dur\":%"
+                     APR_INT64_T_FMT ",\"pid\":%d,\"tid\":%d,"
+                     "\"args\":{%s%s}},\n", nOffset ? "" : "[\n",
+                     pSpan->szName, (apr_int64_t) pSpan->tStart,
+                     (apr_int64_t) (tNow - pSpan->tStart), nPid, nPid,
+                     szCost, szArgs ? szArgs : "");
+
+    apr_file_write_full(pFile, szEvent, strlen(szEvent), NULL);
+    apr_file_close(pFile);
+}
+
 
-        if (rc != APR_SUCCESS) {
-            ap_log_perror(APLOG_MARK, APLOG_ERR, rc, pPool,
-                          "mod_autorotate: couldn't create child process: %s",
-                          pData->szCompressProgram);
+/*
+ * Quote a string for JSON
+ */
+static const char *json_string(apr_pool_t * p, const char *szValue)
+{
+    char *szOut = apr_palloc(p, strlen(szValue) * 6 + 3);
+    char *pOut = szOut;
+
+    *pOut++ = '"';
+    for (; *szValue; szValue++) {
+        unsigned char c = *szValue;
+        if (c == '"' || c == '\\') {
+            *pOut++ = '\\';
+            *pOut++ = c;
+        }
+        else if (c < 0x20) {
+            pOut += apr_snprintf(pOut, 7, "\\u%04x", c);
         }
         else {
+            *pOut++ = c;
+        }
+    }
+    *pOut++ = '"';
+    *pOut = '\0';
 
-            /* Renice the process */
-            if (setpriority(PRIO_PROCESS, pProc->pid, pData->nNiceLevel)) {
-                ap_log_perror(APLOG_MARK, APLOG_ERR, 0, pPool,
-                              "mod_autorotate: couldn't set child priority to %d",
-                              pData->nNiceLevel);
-            }
+    return szOut;
+}
 
-            /* Register the child with Apache so that we get notified
-             * when it dies
-             */
-            pData->pProc = pProc;
-            apr_proc_other_child_register(pProc, compress_cb_func,
-                                          pData, pProc->in, pPool);
 
-            /* Associate the child with the global pool so that Apache
-             * will kill it when the pool goes out of scope (eg. when the
-             * server is killed
-             */
-            apr_pool_note_subprocess(pPool, pProc, APR_KILL_AFTER_TIMEOUT);
+/* ---------  Server status  -------------------------------------------------*/
 
-            ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, pPool,
-                          "mod_autorotate: Started compress, PID %d, [%s] [%s]",
-                          pProc->pid, pData->szCompressProgram,
-                          pData->szLogPath);
-        }
+/*
+ * Handler for mod_status's 'status_hook'.  Shows the metrics as a table,
+ * or as "Key: value" lines for ?auto.
+ */
+static int status_func(request_rec * r, int nFlags)
+{
+    if (!pgConfigData || !pgConfigData->bEnabled) {
+        return OK;
+    }
 
+    const autorotate_metrics_t *pM = pgMetrics;
+
+    /* Compressed size as a percentage of the original, and the rate logs
+     * have been compressed at */
+    apr_uint64_t nRatio = pM->nBytesIn ?
+        pM->nBytesOut * 100 / pM->nBytesIn : 0;
+    apr_uint64_t nKBPerSec = pM->nCompressUsec ?
+        pM->nBytesIn * APR_USEC_PER_SEC / 1024 / pM->nCompressUsec : 0;
+
+    if (nFlags & AP_STATUS_SHORT) {
+        ap_rprintf(r, "AutorotateLastRotate: %" APR_INT64_T_FMT "\n"
+                   "AutorotateNextRotate: %" APR_INT64_T_FMT "\n"
+                   "AutorotateRotateUsec: %" APR_INT64_T_FMT "\n"
+                   "AutorotateRotations: %" APR_UINT64_T_FMT "\n"
+                   "AutorotateFilesRotated: %" APR_UINT64_T_FMT "\n"
+                   "AutorotateFilesPruned: %" APR_UINT64_T_FMT "\n"
+                   "AutorotateQueueDepth: %u\n"
+                   "AutorotateJobsDone: %" APR_UINT64_T_FMT "\n"
+                   "AutorotateJobsFailed: %" APR_UINT64_T_FMT "\n"
+                   "AutorotateBytesIn: %" APR_UINT64_T_FMT "\n"
+                   "AutorotateBytesOut: %" APR_UINT64_T_FMT "\n"
+                   "AutorotateRatioPct: %" APR_UINT64_T_FMT "\n"
+                   "AutorotateKBPerSec: %" APR_UINT64_T_FMT "\n"
+                   "AutorotateCompressUsec: %" APR_INT64_T_FMT "\n"
+                   "AutorotateCompressCpuUsec: %" APR_INT64_T_FMT "\n"
+                   "AutorotateLastJobUsec: %" APR_INT64_T_FMT "\n"
+                   "AutorotateLastJobCpuUsec: %" APR_INT64_T_FMT "\n"
+                   "AutorotateDrainUsec: %" APR_INT64_T_FMT "\n"
+                   "AutorotateDrainTimeouts: %" APR_UINT64_T_FMT "\n",
+                   (apr_int64_t) apr_time_sec(pM->tLastRotate),
+                   (apr_int64_t) apr_time_sec(pM->tNextRotate),
+                   pM->nRotateUsec, pM->nRotations, pM->nFilesRotated,
+                   pM->nFilesPruned, pM->nQueueDepth, pM->nJobsDone,
+                   pM->nJobsFailed, pM->nBytesIn, pM->nBytesOut, nRatio,
+                   nKBPerSec, pM->nCompressUsec, pM->nCompressCpuUsec,
+                   pM->nLastJobUsec, pM->nLastJobCpuUsec, pM->nDrainUsec,
+                   pM->nDrainTimeouts);
+        return OK;
     }
 
-    return rc;
+    char szLast[APR_CTIME_LEN + 1] = "never";
+    char szNext[APR_CTIME_LEN + 1] = "";
+    if (pM->tLastRotate) {
+        apr_ctime(szLast, pM->tLastRotate);
+    }
+    apr_ctime(szNext, pM->tNextRotate);
+
+    ap_rputs("<hr />\n<h1>mod_autorotate</h1>\n<table border=\"0\">\n", r);
+    ap_rprintf(r, "<tr><th align=\"left\">Last rotation</th>"
+               "<td>%s, took %" APR_INT64_T_FMT " ms</td></tr>\n",
+               szLast, pM->nRotateUsec / 1000);
+    ap_rprintf(r, "<tr><th align=\"left\">Next rotation</th>"
+               "<td>%s</td></tr>\n", szNext);
+    ap_rprintf(r, "<tr><th align=\"left\">Rotations</th>"
+               "<td>%" APR_UINT64_T_FMT ", %" APR_UINT64_T_FMT
+               " files rotated, %" APR_UINT64_T_FMT " pruned</td></tr>\n",
+               pM->nRotations, pM->nFilesRotated, pM->nFilesPruned);
+    ap_rprintf(r, "<tr><th align=\"left\">Compress queue</th>"
+               "<td>%u jobs, %" APR_UINT64_T_FMT " done, %" APR_UINT64_T_FMT
+               " failed</td></tr>\n", pM->nQueueDepth, pM->nJobsDone,
+               pM->nJobsFailed);
+    ap_rprintf(r, "<tr><th align=\"left\">Compressed</th>"
+               "<td>%" APR_UINT64_T_FMT " KB to %" APR_UINT64_T_FMT
+               " KB (%" APR_UINT64_T_FMT "%%) at %" APR_UINT64_T_FMT
+               " KB/s</td></tr>\n", pM->nBytesIn / 1024,
+               pM->nBytesOut / 1024, nRatio, nKBPerSec);
+    ap_rprintf(r, "<tr><th align=\"left\">Compress time</th>"
+               "<td>%" APR_INT64_T_FMT " s wall, %" APR_INT64_T_FMT
+               " s CPU; last job %" APR_INT64_T_FMT " ms wall, %"
+               APR_INT64_T_FMT " ms CPU</td></tr>\n",
+               pM->nCompressUsec / APR_USEC_PER_SEC,
+               pM->nCompressCpuUsec / APR_USEC_PER_SEC,
+               pM->nLastJobUsec / 1000, pM->nLastJobCpuUsec / 1000);
+    ap_rprintf(r, "<tr><th align=\"left\">Restart drain</th>"
+               "<td>last took %" APR_INT64_T_FMT " s, %" APR_UINT64_T_FMT
+               " timed out</td></tr>\n", pM->nDrainUsec / APR_USEC_PER_SEC,
+               pM->nDrainTimeouts);
+    ap_rputs("</table>\n", r);
+
+    return OK;
 }
 
 
@@ -1655,6 +6273,8 @@ static void register_hooks(apr_pool_t * p)
 {
     ap_hook_monitor(monitor_func, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_open_logs(open_logs_func, NULL, NULL, APR_HOOK_FIRST);
+    APR_OPTIONAL_HOOK(ap, status_hook, status_func, NULL, NULL,
+                      APR_HOOK_MIDDLE);
 }
 
 
@@ -1686,7 +6306,8 @@ static const command_rec autorotate_cmds[] = {
     AP_INIT_TAKE1("AutorotateCompressProgram",
                   cmd_rotate_compress, NULL,
                   RSRC_CONF,
-                  "Location of compress binary (default: /usr/bin/gzip)"),
+                  "Location of compress binary, run as a filter from stdin to "
+                  "stdout (default: /usr/bin/gzip)"),
 
     AP_INIT_TAKE1("AutorotateCompressSuffix",
                   cmd_rotate_compresssuffix, NULL,
@@ -1709,12 +6330,105 @@ static const command_rec autorotate_cmds[] = {
                   RSRC_CONF,
                   "Number of log files to keep or 0 to never delete.  (default: 0)"),
 
+    AP_INIT_TAKE1("AutorotateKeepBytes",
+                  cmd_rotate_keepbytes, NULL,
+                  RSRC_CONF,
+                  "Maximum size of archived logs to keep in each log directory, "
+                  "eg. 200G, or 0 for no limit.  (default: 0)"),
+
+    AP_INIT_TAKE1("AutorotateKeepFree",
+                  cmd_rotate_keepfree, NULL,
+                  RSRC_CONF,
+                  "Percentage of free space to keep on each log filesystem, "
+                  "or 0 for no limit.  (default: 0)"),
+
     AP_INIT_TAKE1("AutorotateCompressAfter",
                   cmd_rotate_compressafter, NULL,
                   RSRC_CONF,
                   "Compress after this number of rotates or 0 to never compress. "
                   " (default: 1)"),
 
+    AP_INIT_FLAG("AutorotateManifest",
+                 cmd_rotate_manifest, NULL,
+                 RSRC_CONF,
+                 "Record sizes and CRC-32C checksums of each compressed log in "
+                 "an autorotate.manifest file in its directory (default: On)"),
+
+    AP_INIT_TAKE1("AutorotateConsolidate",
+                  cmd_rotate_consolidate, NULL,
+                  RSRC_CONF,
+                  "Merge the compressed logs of each finished period (daily, "
+                  "weekly, monthly) into a single indexed container, or Off "
+                  "(default: Off)"),
+
+    AP_INIT_ITERATE("AutorotateCompressLevels",
+                    cmd_rotate_compresslevels, NULL,
+                    RSRC_CONF,
+                    "Levels of the compress program to choose between for each log, "
+                    "by compressing a sample of the log at each"),
+
+    AP_INIT_TAKE1("AutorotateCompressBudget",
+                  cmd_rotate_compressbudget, NULL,
+                  RSRC_CONF,
+                  "CPU seconds per GB of log that the level chosen from "
+                  "AutorotateCompressLevels may take"),
+
+    AP_INIT_TAKE12("AutorotateDictionary",
+                   cmd_rotate_dictionary, NULL,
+                   RSRC_CONF,
+                   "On or Off, and optionally how many rotate periods to use each "
+                   "dictionary for.  Compress with a zstd dictionary trained for "
+                   "each log"),
+
+    AP_INIT_TAKE2("AutorotatePipedLog",
+                  cmd_rotate_pipedlog, NULL,
+                  RSRC_CONF,
+                  "Serve a FIFO from the built-in log sink, which writes it to the given "
+                  "log file and rotates it without a restart.  Point a log directive at "
+                  "the FIFO in place of a piped log program"),
+
+#if defined(ENABLE_SIMULATION)
+    AP_INIT_TAKE12("AutorotateSimulate",
+                   cmd_rotate_simulate, NULL,
+                   RSRC_CONF,
+                   "Run the clock this many times faster than real time, optionally "
+                   "from the given time in seconds since the epoch.  For testing"),
+#endif
+
+#if defined(ENABLE_SIMULATION)
+    AP_INIT_TAKE3("AutorotateSimulateTree",
+                  cmd_rotate_simulatetree, NULL,
+                  RSRC_CONF,
+                  "Make a scratch directory of this many logs with archives for this "
+                  "many past periods, and rotate them.  For benchmarking"),
+#endif
+
+    AP_INIT_TAKE1("AutorotateDrainTimeout",
+                  cmd_rotate_draintimeout, NULL,
+                  RSRC_CONF,
+                  "Seconds to wait for the old generation to exit after a restart "
+                  "before compressing the archives it has closed, 0 to wait for ever"),
+
+    AP_INIT_TAKE1("AutorotateTraceFile",
+                  cmd_rotate_tracefile, NULL,
+                  RSRC_CONF,
+                  "Write a Chrome trace of each rotation, prune and compression "
+                  "phase to this file"),
+
+    AP_INIT_TAKE12("AutorotateArchiveDir",
+                   cmd_rotate_archivedir, NULL,
+                   RSRC_CONF,
+                   "Directory to keep archives in, partitioned by date, and optionally "
+                   "how deep: Year, Month or Day.  Relative to each log's directory "
+                   "unless absolute, when each log's directory is mirrored under it, "
+                   "and must be on the same filesystem as the logs"),
+
+    AP_INIT_TAKE23("AutorotateExternalLog",
+                   cmd_rotate_externallog, NULL,
+                   RSRC_CONF,
+                   "Rotate the log of another service on the same schedule, then send "
+                   "the process in the given pidfile USR1, USR2 or HUP to reopen it"),
+
     AP_INIT_TAKE12("AutorotateAddLogDirective",
                    cmd_add_log_directive, NULL,
                    RSRC_CONF,
@@ -1723,12 +6437,15 @@ static const command_rec autorotate_cmds[] = {
                    "directive."),
 
 
-    AP_INIT_TAKE1("AutorotateAddLogFile",
-                  cmd_add_log_file, NULL,
-                  RSRC_CONF,
-                  "Include a specific log file in the rotation scheme.  This is intended for use "
-                  "where modules creates log files that aren't defined by Apache directives "
-                  "such as Siteminder logs"),
+    AP_INIT_TAKE12("AutorotateAddLogFile",
+                   cmd_add_log_file, NULL,
+                   RSRC_CONF,
+                   "Include a specific log file in the rotation scheme.  This is intended for use "
+                   "where modules creates log files that aren't defined by Apache directives "
+                   "such as Siteminder logs.  An optional second argument of Truncate "
+                   "rotates the file by copying it and freeing the copied part in place, "
+                   "for writers that don't reopen their logs on restart "
+                   "(default: Rename)"),
 
 
     {NULL}
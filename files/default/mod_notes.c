@@ -17,6 +17,91 @@
 **      SetOutputFilter NOTE_FILTER
 **    </Location>
 **
+**  or for every request to a virtual host:
+**
+**    <VirtualHost *:80>
+**      NoteCapture On
+**    </VirtualHost>
+**
+**  Which headers are captured, and what happens to them, is set with
+**  NoteRule.  A name ending in '*' is a prefix, matched without regard
+**  to case like all header names, and the actions are any of:
+**
+**    note    copy the header to r->notes
+**    env     copy the header to r->subprocess_env
+**    strip   remove the header from the response
+**    rename  send the header on with the prefix removed
+**
+**    NoteRule NOTE-* note strip
+**    NoteRule X-Runtime env
+**
+**  Without any NoteRule a server copies and strips NOTE* headers.
+**
+**  The rules can be applied to the trailers of chunked responses from
+**  proxied backends too, so an app streaming its response can send its
+**  timings after the body rather than buffering it to put them in the
+**  headers.  Notes from trailers are captured as mod_proxy_http reads
+**  them, before the request is logged.  httpd 2.2 doesn't pass trailers
+**  on to the client, so only the note and env actions matter for them.
+**  This hooks into mod_proxy, so mod_notes has to be built with
+**  -DNOTES_TRAILERS and loaded after mod_proxy:
+**
+**    $ apxs -c -i -DNOTES_TRAILERS mod_notes.c
+**    NoteTrailers On
+**
+**  Other modules can read and set notes by slot rather than by name
+**  through the optional functions in mod_notes.h.
+**
+**  Numeric notes can be collected into histograms for each virtual host,
+**  optionally scaled first, eg. seconds to milliseconds, and read from
+**  a handler as text, or JSON with ?json:
+**
+**    NoteHistogram NOTE-App-Time
+**    NoteHistogram NOTE-DB-Time 1000
+**    <Location /note-histograms>
+**      SetHandler note-histograms
+**    </Location>
+**
+**  Notes can also be sent, with the server, status and duration of each
+**  request, to a local UNIX datagram socket.  Records are batched in each
+**  child and sent when the batch reaches the given bytes or is the given
+**  milliseconds old.  A record that doesn't
+**  fit, or a batch the socket won't take at once, is dropped and counted
+**  rather than holding up a request.  notes_collect.c is a small
+**  collector that prints what it gets.
+**
+**    NoteExport /var/run/notes.sock 8192 1000
+**    NoteExportNotes NOTE-App-Time NOTE-DB-Time
+**
+**  Requests where a note is over a threshold are kept, with their notes
+**  and timings, in a ring of the last so many in shared memory that a
+**  handler shows, newest first:
+**
+**    NoteSlowRequest NOTE-App-Time 500
+**    NoteSlowRing 128
+**    <Location /note-slow>
+**      SetHandler note-slow
+**    </Location>
+**
+**  An access log in LTSV, with the field names of our nginx logs and every
+**  note of the request after them, can be written for each server.  Each
+**  child buffers lines, up to the given bytes, and writes them when the
+**  buffer is full or once the oldest line is the given milliseconds old,
+**  whether or not more requests come.  For mod_autorotate to rotate it, add
+**  "AutorotateAddLogDirective NoteLog 1".
+**
+**    NoteLog logs/access_ltsv.log 65536 1000
+**
+**  Built with -DNOTES_BENCHMARK, a note-benchmark handler times requests
+**  through NOTE_FILTER against synthetic headers, to guard reworks of
+**  the filter.  notes_bench.sh compares a running server with the
+**  filter off and on.
+**
+**    $ apxs -c -i -DNOTES_BENCHMARK mod_notes.c
+**    <Location /note-benchmark>
+**      SetHandler note-benchmark
+**    </Location>
+**
 **  Then after restarting Apache via
 **
 **    $ apachectl restart
@@ -28,44 +113,1699 @@
 #include "http_protocol.h"
 #include "ap_config.h"
 #include "http_log.h"
+#include "http_request.h"
+#include "apr_hash.h"
+#include "apr_lib.h"
+#include "apr_optional.h"
+#include "apr_strings.h"
+#include "apr_shm.h"
+#include "apr_atomic.h"
+#include "ap_mpm.h"
 
-static apr_status_t note_output_filter(ap_filter_t *f, apr_bucket_brigade *in_bb) {
-    static const char *note = "NOTE";
-    static const int  note_length = 4;
+#if APR_HAS_THREADS
+#include "apr_thread_mutex.h"
+#include "apr_thread_proc.h"
+#endif
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+
+#if defined(NOTES_TRAILERS)
+#include "mod_proxy.h"
+#endif
+
+/* The optional functions of mod_notes.h, declared here as well so this
+ * file builds on its own with apxs.  Keep the two in step. */
+APR_DECLARE_OPTIONAL_FN(int, notes_slot, (const char *name));
+APR_DECLARE_OPTIONAL_FN(const char *, notes_get_slot, (request_rec *r, int slot));
+APR_DECLARE_OPTIONAL_FN(void, notes_set_slot, (request_rec *r, int slot, const char *value));
+
+module AP_MODULE_DECLARE_DATA notes_module;
+
+#define NOTE_TO_NOTES   0x01
+#define NOTE_TO_ENV     0x02
+#define NOTE_STRIP      0x04
+#define NOTE_RENAME     0x08
+
+/* Characters allowed in a header name, once case is folded */
+#define NOTE_TRIE_WIDTH 51
+
+/* Longest note name that can have a slot */
+#define NOTE_NAME_MAX   256
+
+typedef struct {
+    const char *name;       /* header name, or prefix without the '*' */
+    int length;
+    int actions;            /* NOTE_* flags */
+    int slot;               /* of an exact name copied to notes, or -1 */
+} note_rule;
+
+/* Rules are compiled into a trie on the case-folded name, so a header is
+ * matched in one walk of its name however many rules there are */
+typedef struct note_trie {
+    struct note_trie *child[NOTE_TRIE_WIDTH];
+    note_rule *exact;       /* rule for a name ending here */
+    note_rule *prefix;      /* rule for names continuing past here */
+} note_trie;
+
+typedef struct {
+    int capture;            /* insert NOTE_FILTER into every request, -1 unset */
+    int trailers;           /* apply the rules to response trailers, -1 unset */
+    note_trie *rules;
+    int rules_set;          /* NoteRule given, replacing the default */
+    int index;              /* of this server in the histograms */
+    int ltsv_log;           /* NoteLog of this server plus one, or 0 */
+} notes_server_conf;
+
+/* Histogram buckets are log-linear, eight to each power of two, which
+ * keeps values within 12.5% up to 2^32 */
+#define NOTE_HIST_SUB       8
+#define NOTE_HIST_BUCKETS   240
+
+/* Most shards of the histograms.  Each child adds to the one its pid
+ * picks with atomic increments, so neither children nor threads wait on
+ * a lock, and the handler adds the shards up. */
+#define NOTE_HIST_SHARDS    32
+
+typedef struct {
+    const char *name;
+    int slot;
+    double scale;           /* applied to the value before it's counted */
+} note_hist_def;
+
+/* Counts in shared memory, [shard][server][histogram][bucket] */
+typedef struct {
+    apr_uint32_t *counts;
+    int shards;
+    int servers;
+    int hists;
+} note_hist_shm;
+
+static apr_array_header_t *hist_defs = NULL;
+static note_hist_shm hist_shm;
+static int hist_shard = 0;
+
+/* Export frames are a header followed by records, all integers in
+ * network byte order:
+ *
+ *   frame:  "NOTE" | u8 version | u8 records | u16 reserved | u32 pid |
+ *           u32 dropped
+ *   record: u16 length of record | u16 status | u64 duration in usec |
+ *           u8 length | server | u8 notes | notes
+ *   note:   u8 length | name | u16 length | value
+ *
+ * pid is the child's and dropped counts the records it has lost so far. */
+#define NOTE_EXPORT_VERSION     3
+#define NOTE_EXPORT_HEADER      16
+#define NOTE_EXPORT_MAX         65507
+
+typedef struct {
+    const char *name;
+    int slot;
+} note_export_def;
+
+typedef struct {
+    int fd;
+    struct sockaddr_un addr;
+    char *buf;
+    apr_size_t len;
+    int records;
+    apr_time_t first;       /* when the oldest record in buf was added */
+    apr_uint32_t pid;
+    apr_uint32_t dropped;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} note_export_buf;
+
+/* Requests over a NoteSlowRequest threshold are kept in a ring in shared
+ * memory.  Writers claim an entry by atomically advancing next, and mark
+ * it odd while they fill it in, so the handler can skip entries that are
+ * being written without either side taking a lock. */
+#define NOTE_SLOW_TEXT  2048
+
+typedef struct {
+    const char *name;
+    int slot;
+    double threshold;
+} note_slow_def;
+
+typedef struct {
+    volatile apr_uint32_t seq;  /* odd while being written */
+    apr_time_t time;
+    apr_interval_time_t duration;
+    apr_off_t bytes;
+    int status;
+    char text[NOTE_SLOW_TEXT];  /* rule, server, request and notes as LTSV */
+} note_slow_entry;
+
+typedef struct {
+    volatile apr_uint32_t next;
+    apr_uint32_t size;
+    note_slow_entry entries[1];
+} note_slow_ring;
+
+static apr_array_header_t *slow_defs = NULL;
+static int slow_size = 64;
+static note_slow_ring *slow_ring = NULL;
+
+/* NoteLog files, opened by the parent, each with a buffer in every child */
+#define NOTE_LTSV_LINE  16384
+
+typedef struct {
+    const char *path;
+    apr_size_t size;
+    apr_interval_time_t latency;
+    int fd;
+    char *buf;
+    apr_size_t len;
+    apr_time_t first;       /* when the oldest line in buf was added */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} note_ltsv_log;
+
+static apr_array_header_t *ltsv_logs = NULL;
+
+#if APR_HAS_THREADS
+/* Each child has a thread that writes out buffers once they're as old as
+ * their latency allows, so an idle child doesn't sit on them.  Lines wait
+ * at most the latency and this long. */
+#define NOTE_FLUSH_TICK apr_time_from_msec(100)
+
+static apr_thread_t *flusher = NULL;
+static volatile int flusher_stop = 0;
+#endif
+
+static ap_filter_rec_t *note_filter_rec = NULL;
+#if defined(NOTES_TRAILERS)
+static ap_filter_rec_t *note_trailers_rec = NULL;
+#endif
+
+static const char *export_path = NULL;
+static apr_size_t export_batch = 8192;
+static apr_interval_time_t export_latency = APR_USEC_PER_SEC;
+static apr_array_header_t *export_defs = NULL;
+static note_export_buf export_buf = { -1 };
+
+/* Registered note names, case-folded name -> int slot, and by slot.
+ * Made afresh by each read of the configuration, and frozen at the end
+ * of it so every request's values array is big enough for all slots. */
+static apr_hash_t *note_slots = NULL;
+static apr_array_header_t *note_names = NULL;
+static int note_slots_frozen = 0;
+
+/* Fold name into buf, returning its length or -1 if it's too long */
+static int note_fold(char *buf, const char *name) {
+    int i;
+    for (i = 0; name[i]; i++) {
+        if (i == NOTE_NAME_MAX) {
+            return -1;
+        }
+        buf[i] = apr_tolower(name[i]);
+    }
+    buf[i] = '\0';
+    return i;
+}
+
+static int notes_slot(const char *name) {
+    char buf[NOTE_NAME_MAX + 1];
+    int length;
+    int *slot;
+    apr_pool_t *p;
+
+    if (note_slots == NULL || (length = note_fold(buf, name)) < 0) {
+        return -1;
+    }
+    slot = apr_hash_get(note_slots, buf, length);
+    if (slot != NULL) {
+        return *slot;
+    }
+    if (note_slots_frozen) {
+        return -1;
+    }
+    p = apr_hash_pool_get(note_slots);
+    slot = apr_palloc(p, sizeof(int));
+    *slot = note_names->nelts;
+    *(const char **)apr_array_push(note_names) = apr_pstrdup(p, name);
+    apr_hash_set(note_slots, apr_pstrndup(p, buf, length), length, slot);
+    return *slot;
+}
+
+/* This request's values by slot, made on first use if create is set */
+static const char **note_values(request_rec *r, int create) {
+    const char **values = ap_get_module_config(r->request_config, &notes_module);
+    if (values == NULL && create && note_names->nelts > 0) {
+        values = apr_pcalloc(r->pool, note_names->nelts * sizeof(char *));
+        ap_set_module_config(r->request_config, &notes_module, values);
+    }
+    return values;
+}
+
+/* Internal redirects and subrequests get a request_config of their own,
+ * so the requests they came from are looked through too */
+static const char *notes_get_slot(request_rec *r, int slot) {
+    if (note_names == NULL || slot < 0 || slot >= note_names->nelts) {
+        return NULL;
+    }
+    for (; r != NULL; r = r->prev ? r->prev : r->main) {
+        const char **values = note_values(r, 0);
+        if (values != NULL && values[slot] != NULL) {
+            return values[slot];
+        }
+    }
+    return NULL;
+}
+
+/* A note by slot, or by name if it was set some other way */
+static const char *note_value(request_rec *r, int slot, const char *name) {
+    const char *val = notes_get_slot(r, slot);
+    return val ? val : apr_table_get(r->notes, name);
+}
+
+static void notes_set_slot(request_rec *r, int slot, const char *value) {
+    if (note_names == NULL || slot < 0 || slot >= note_names->nelts) {
+        return;
+    }
+    note_values(r, 1)[slot] = value;
+    apr_table_set(r->notes, ((const char **)note_names->elts)[slot], value);
+}
+
+/* Index of a header name character in a trie node, or -1 if it can't
+ * appear in one */
+static int note_trie_index(unsigned char c) {
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a';
+    }
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if (c >= '0' && c <= '9') {
+        return 26 + c - '0';
+    }
+    switch (c) {
+    case '!':  return 36;
+    case '#':  return 37;
+    case '$':  return 38;
+    case '%':  return 39;
+    case '&':  return 40;
+    case '\'': return 41;
+    case '*':  return 42;
+    case '+':  return 43;
+    case '-':  return 44;
+    case '.':  return 45;
+    case '^':  return 46;
+    case '_':  return 47;
+    case '`':  return 48;
+    case '|':  return 49;
+    case '~':  return 50;
+    }
+    return -1;
+}
+
+/* Find or add the rule for name, a prefix if it ends in '*' */
+static note_rule *note_trie_add(apr_pool_t *p, note_trie *trie, const char *name) {
+    const char *c;
+    int length = strlen(name);
+    int is_prefix = (length > 0 && name[length - 1] == '*');
+    note_rule **slot;
+
+    if (is_prefix) {
+        length--;
+    }
+    if (length == 0) {
+        return NULL;
+    }
+    for (c = name; c < name + length; c++) {
+        int i = note_trie_index(*c);
+        if (i < 0) {
+            return NULL;
+        }
+        if (trie->child[i] == NULL) {
+            trie->child[i] = apr_pcalloc(p, sizeof(note_trie));
+        }
+        trie = trie->child[i];
+    }
+    slot = is_prefix ? &trie->prefix : &trie->exact;
+    if (*slot == NULL) {
+        *slot = apr_pcalloc(p, sizeof(note_rule));
+        (*slot)->name = apr_pstrndup(p, name, length);
+        (*slot)->length = length;
+        (*slot)->slot = -1;
+    }
+    return *slot;
+}
+
+/* The rule for a header: an exact name, else the longest prefix that
+ * leaves something of the name over */
+static const note_rule *note_trie_match(const note_trie *trie, const char *key) {
+    const note_rule *best = NULL;
+    const unsigned char *c;
+
+    for (c = (const unsigned char *)key; *c; c++) {
+        int i;
+        if (trie->prefix != NULL) {
+            best = trie->prefix;
+        }
+        if ((i = note_trie_index(*c)) < 0 || (trie = trie->child[i]) == NULL) {
+            return best;
+        }
+    }
+    return trie->exact ? trie->exact : best;
+}
+
+/* Apply the rules to a table of response headers or trailers, returning
+ * the table to send on.  The headers that stay are kept in one pass, and
+ * the kept table is only made once the first header to strip or rename
+ * turns up, so responses without any are left alone. */
+static apr_table_t *note_apply_rules(request_rec *r, const note_trie *rules,
+                                     apr_table_t *table) {
     const char *c = NULL;
     int i;
-    request_rec *r = f->r;
-    const apr_array_header_t *arr = apr_table_elts(r->headers_out);
+    const apr_array_header_t *arr = apr_table_elts(table);
     apr_table_entry_t *elts = (apr_table_entry_t *)arr->elts;
+    apr_table_t *kept = NULL;
+
     for (i = 0; i < arr->nelts; i++) {
+        const note_rule *rule;
         c = elts[i].key;
-        if (c != NULL && strlen(c) > note_length) {
-            if (strncmp(note, c, note_length) == 0) {
-                apr_table_set(r->notes, c, elts[i].val);
-                //apr_table_unset(r->headers_out, c);
+        if (c == NULL) {
+            continue;
+        }
+        rule = note_trie_match(rules, c);
+        if (rule == NULL) {
+            if (kept != NULL) {
+                apr_table_addn(kept, c, elts[i].val);
             }
-        }      
-    }
-    // fix me
-    int is_end = 1;
-    do {
-      is_end = 1;
-      for (i = 0; i < arr->nelts; i++) {
-          c = elts[i].key;
-          if (c != NULL && strlen(c) > note_length) {
-              if (strncmp(note, c, note_length) == 0) {
-                  apr_table_unset(r->headers_out, c);
-                  is_end = 0;
-              }
-          }
-      }
-    } while(!is_end);
+            continue;
+        }
+        if (rule->actions & NOTE_TO_NOTES) {
+            int slot = (rule->slot >= 0 || note_names->nelts == 0)
+                ? rule->slot : notes_slot(c);
+            apr_table_set(r->notes, c, elts[i].val);
+            if (slot >= 0) {
+                note_values(r, 1)[slot] = elts[i].val;
+            }
+        }
+        if (rule->actions & NOTE_TO_ENV) {
+            apr_table_set(r->subprocess_env, c, elts[i].val);
+        }
+        if (rule->actions & (NOTE_STRIP | NOTE_RENAME)) {
+            if (kept == NULL) {
+                int j;
+                kept = apr_table_make(r->pool, arr->nelts);
+                for (j = 0; j < i; j++) {
+                    if (elts[j].key != NULL) {
+                        apr_table_addn(kept, elts[j].key, elts[j].val);
+                    }
+                }
+            }
+            if (rule->actions & NOTE_RENAME) {
+                apr_table_addn(kept, c + rule->length, elts[i].val);
+            }
+        }
+        else if (kept != NULL) {
+            apr_table_addn(kept, c, elts[i].val);
+        }
+    }
+    return (kept != NULL) ? kept : table;
+}
+
+static apr_status_t note_output_filter(ap_filter_t *f, apr_bucket_brigade *in_bb) {
+    request_rec *r = f->r;
+    notes_server_conf *conf =
+        ap_get_module_config(r->server->module_config, &notes_module);
+
+    r->headers_out = note_apply_rules(r, conf->rules, r->headers_out);
+
+    /* The headers are final by the first brigade, so there's nothing to
+     * do for the rest of a streamed response */
+    ap_remove_output_filter(f);
     return ap_pass_brigade(f->next, in_bb);
 }
 
+#if defined(NOTES_TRAILERS)
+typedef struct {
+    request_rec *r;         /* the client's request */
+    apr_table_t *headers;   /* the backend's headers, before any trailers */
+} note_trailers_ctx;
+
+/* mod_proxy_http reads a backend's response through HTTP_IN on a request
+ * of its own, which puts the trailers of a chunked body into its
+ * headers_in, after a copy of the response headers, by the time EOS
+ * comes up.  This filter sits above HTTP_IN and, at EOS, applies the
+ * rules of the client's request to what was added, merged values
+ * included.  The status line and headers are read with AP_MODE_GETLINE
+ * before headers_in is filled in, so the copy to compare with is taken
+ * on the first read of the body. */
+static apr_status_t note_trailers_filter(ap_filter_t *f, apr_bucket_brigade *bb,
+                                         ap_input_mode_t mode,
+                                         apr_read_type_e block,
+                                         apr_off_t readbytes) {
+    note_trailers_ctx *ctx = f->ctx;
+    apr_status_t rv;
+    const apr_array_header_t *arr;
+    apr_table_entry_t *elts;
+    apr_table_t *trailers;
+    notes_server_conf *conf;
+    int i;
+
+    if (ctx->headers == NULL) {
+        if (mode != AP_MODE_READBYTES) {
+            return ap_get_brigade(f->next, bb, mode, block, readbytes);
+        }
+        ctx->headers = apr_table_copy(f->r->pool, f->r->headers_in);
+    }
+    rv = ap_get_brigade(f->next, bb, mode, block, readbytes);
+    if (rv != APR_SUCCESS || APR_BRIGADE_EMPTY(bb)
+        || !APR_BUCKET_IS_EOS(APR_BRIGADE_LAST(bb))) {
+        return rv;
+    }
+
+    arr = apr_table_elts(f->r->headers_in);
+    elts = (apr_table_entry_t *)arr->elts;
+    trailers = apr_table_make(f->r->pool, 4);
+    for (i = 0; i < arr->nelts; i++) {
+        const char *old;
+        apr_size_t len;
+        if (elts[i].key == NULL) {
+            continue;
+        }
+        old = apr_table_get(ctx->headers, elts[i].key);
+        if (old == NULL) {
+            apr_table_addn(trailers, elts[i].key, elts[i].val);
+            continue;
+        }
+        len = strlen(old);
+        if (!strncmp(elts[i].val, old, len) && !strncmp(elts[i].val + len, ", ", 2)) {
+            apr_table_addn(trailers, elts[i].key, elts[i].val + len + 2);
+        }
+    }
+    conf = ap_get_module_config(ctx->r->server->module_config, &notes_module);
+    note_apply_rules(ctx->r, conf->rules, trailers);
+    ap_remove_input_filter(f);
+    return rv;
+}
+
+/* Add the trailers filter to mod_proxy's request for a backend's response */
+static int note_proxy_create_req(request_rec *r, request_rec *pr) {
+    notes_server_conf *conf =
+        ap_get_module_config(r->server->module_config, &notes_module);
+    note_trailers_ctx *ctx;
+
+    if (conf->trailers != 1) {
+        return OK;
+    }
+    ctx = apr_pcalloc(r->pool, sizeof(*ctx));
+    ctx->r = r;
+    ap_add_input_filter_handle(note_trailers_rec, ctx, pr, pr->connection);
+    return OK;
+}
+#endif
+
+static void note_insert_filter(request_rec *r) {
+    notes_server_conf *conf =
+        ap_get_module_config(r->server->module_config, &notes_module);
+    if (conf->capture == 1) {
+        ap_add_output_filter_handle(note_filter_rec, NULL, r, r->connection);
+    }
+}
+
+static void *create_notes_server_config(apr_pool_t *p, server_rec *s) {
+    notes_server_conf *conf = apr_pcalloc(p, sizeof(*conf));
+    conf->capture = -1;
+    conf->trailers = -1;
+    conf->rules = apr_pcalloc(p, sizeof(note_trie));
+    note_trie_add(p, conf->rules, "NOTE*")->actions = NOTE_TO_NOTES | NOTE_STRIP;
+    return conf;
+}
+
+static void *merge_notes_server_config(apr_pool_t *p, void *basev, void *addv) {
+    notes_server_conf *base = basev;
+    notes_server_conf *add = addv;
+    notes_server_conf *conf = apr_pcalloc(p, sizeof(*conf));
+    conf->capture = (add->capture != -1) ? add->capture : base->capture;
+    conf->trailers = (add->trailers != -1) ? add->trailers : base->trailers;
+    conf->rules = add->rules_set ? add->rules : base->rules;
+    conf->rules_set = add->rules_set || base->rules_set;
+    conf->ltsv_log = add->ltsv_log ? add->ltsv_log : base->ltsv_log;
+    return conf;
+}
+
+static const char *set_note_capture(cmd_parms *cmd, void *dummy, int flag) {
+    notes_server_conf *conf =
+        ap_get_module_config(cmd->server->module_config, &notes_module);
+    conf->capture = flag;
+    return NULL;
+}
+
+static const char *set_note_trailers(cmd_parms *cmd, void *dummy, int flag) {
+#if defined(NOTES_TRAILERS)
+    notes_server_conf *conf =
+        ap_get_module_config(cmd->server->module_config, &notes_module);
+    conf->trailers = flag;
+    return NULL;
+#else
+    return "NoteTrailers needs mod_notes built with -DNOTES_TRAILERS";
+#endif
+}
+
+static const char *add_note_rule(cmd_parms *cmd, void *dummy,
+                                 const char *name, const char *action) {
+    notes_server_conf *conf =
+        ap_get_module_config(cmd->server->module_config, &notes_module);
+    note_rule *rule;
+    int flag;
+
+    if (!strcasecmp(action, "note")) {
+        flag = NOTE_TO_NOTES;
+    }
+    else if (!strcasecmp(action, "env")) {
+        flag = NOTE_TO_ENV;
+    }
+    else if (!strcasecmp(action, "strip")) {
+        flag = NOTE_STRIP;
+    }
+    else if (!strcasecmp(action, "rename")) {
+        flag = NOTE_RENAME;
+    }
+    else {
+        return apr_pstrcat(cmd->pool, "NoteRule: unknown action ", action, NULL);
+    }
+
+    /* The first rule of a server replaces the default */
+    if (!conf->rules_set) {
+        conf->rules = apr_pcalloc(cmd->pool, sizeof(note_trie));
+        conf->rules_set = 1;
+    }
+    rule = note_trie_add(cmd->pool, conf->rules, name);
+    if (rule == NULL) {
+        return apr_pstrcat(cmd->pool, "NoteRule: invalid header name ", name, NULL);
+    }
+    if (flag == NOTE_RENAME && name[strlen(name) - 1] != '*') {
+        return "NoteRule: only a prefix can be renamed";
+    }
+    rule->actions |= flag;
+    if (flag == NOTE_TO_NOTES && rule->length == (int)strlen(name)) {
+        rule->slot = notes_slot(name);
+    }
+    if ((rule->actions & NOTE_STRIP) && (rule->actions & NOTE_RENAME)) {
+        return "NoteRule: a header can't be both stripped and renamed";
+    }
+    return NULL;
+}
+
+static const char *add_note_histogram(cmd_parms *cmd, void *dummy,
+                                      const char *name, const char *scale) {
+    note_hist_def *def;
+
+    if (cmd->server->is_virtual) {
+        return "NoteHistogram only supported in the main server";
+    }
+    def = apr_array_push(hist_defs);
+    def->name = name;
+    def->slot = notes_slot(name);
+    def->scale = scale ? strtod(scale, NULL) : 1.0;
+    if (def->scale <= 0) {
+        return "NoteHistogram: scale must be positive";
+    }
+    return NULL;
+}
+
+static const char *set_note_export(cmd_parms *cmd, void *dummy,
+                                   const char *path, const char *batch,
+                                   const char *latency) {
+    if (cmd->server->is_virtual) {
+        return "NoteExport only supported in the main server";
+    }
+    if (strlen(path) >= sizeof(export_buf.addr.sun_path)) {
+        return "NoteExport: socket path too long";
+    }
+    export_path = path;
+    if (batch) {
+        export_batch = atoi(batch);
+        if (export_batch < 512 || export_batch > NOTE_EXPORT_MAX) {
+            return "NoteExport: batch must be 512 to 65507 bytes";
+        }
+    }
+    if (latency) {
+        export_latency = apr_time_from_msec(atoi(latency));
+    }
+    return NULL;
+}
+
+static const char *add_note_export(cmd_parms *cmd, void *dummy,
+                                   const char *name) {
+    note_export_def *def;
+
+    if (cmd->server->is_virtual) {
+        return "NoteExportNotes only supported in the main server";
+    }
+    if (strlen(name) > 255) {
+        return "NoteExportNotes: name too long";
+    }
+    def = apr_array_push(export_defs);
+    def->name = name;
+    def->slot = notes_slot(name);
+    return NULL;
+}
+
+static const char *add_note_slow(cmd_parms *cmd, void *dummy,
+                                 const char *name, const char *threshold) {
+    note_slow_def *def;
+
+    if (cmd->server->is_virtual) {
+        return "NoteSlowRequest only supported in the main server";
+    }
+    def = apr_array_push(slow_defs);
+    def->name = name;
+    def->slot = notes_slot(name);
+    def->threshold = strtod(threshold, NULL);
+    return NULL;
+}
+
+static const char *set_note_slow_ring(cmd_parms *cmd, void *dummy,
+                                      const char *size) {
+    if (cmd->server->is_virtual) {
+        return "NoteSlowRing only supported in the main server";
+    }
+    slow_size = atoi(size);
+    if (slow_size < 1 || slow_size > 65536) {
+        return "NoteSlowRing must be 1 to 65536 entries";
+    }
+    return NULL;
+}
+
+static const char *set_note_log(cmd_parms *cmd, void *dummy, const char *path,
+                                const char *size, const char *latency) {
+    notes_server_conf *conf =
+        ap_get_module_config(cmd->server->module_config, &notes_module);
+    note_ltsv_log *logs = (note_ltsv_log *)ltsv_logs->elts;
+    note_ltsv_log *log = NULL;
+    int i;
+
+    path = ap_server_root_relative(cmd->pool, path);
+    if (path == NULL) {
+        return "NoteLog: invalid file path";
+    }
+    for (i = 0; i < ltsv_logs->nelts; i++) {
+        if (!strcmp(logs[i].path, path)) {
+            log = &logs[i];
+            break;
+        }
+    }
+    if (log == NULL) {
+        log = apr_array_push(ltsv_logs);
+        memset(log, 0, sizeof(*log));
+        log->path = path;
+        log->size = 65536;
+        log->latency = APR_USEC_PER_SEC;
+        log->fd = -1;
+    }
+    if (size) {
+        log->size = atoi(size);
+        if (log->size < NOTE_LTSV_LINE) {
+            return "NoteLog: buffer must be at least 16384 bytes";
+        }
+    }
+    if (latency) {
+        log->latency = apr_time_from_msec(atoi(latency));
+    }
+    conf->ltsv_log = log - (note_ltsv_log *)ltsv_logs->elts + 1;
+    return NULL;
+}
+
+static const command_rec notes_cmds[] = {
+    AP_INIT_FLAG("NoteCapture", set_note_capture, NULL, RSRC_CONF,
+                 "Capture NOTE headers of every response in this server"),
+    AP_INIT_FLAG("NoteTrailers", set_note_trailers, NULL, RSRC_CONF,
+                 "Apply NoteRule to the trailers of proxied responses as well"),
+    AP_INIT_ITERATE2("NoteRule", add_note_rule, NULL, RSRC_CONF,
+                     "A header name, or a prefix ending in '*', followed by "
+                     "actions: note, env, strip or rename"),
+    AP_INIT_TAKE12("NoteHistogram", add_note_histogram, NULL, RSRC_CONF,
+                   "A numeric note to keep histograms of for each server, and "
+                   "optionally what to multiply its values by"),
+    AP_INIT_TAKE123("NoteExport", set_note_export, NULL, RSRC_CONF,
+                    "UNIX datagram socket to send notes to, and optionally the "
+                    "bytes to batch and most milliseconds to hold a batch"),
+    AP_INIT_ITERATE("NoteExportNotes", add_note_export, NULL, RSRC_CONF,
+                    "Notes to send to the NoteExport socket"),
+    AP_INIT_TAKE2("NoteSlowRequest", add_note_slow, NULL, RSRC_CONF,
+                  "A numeric note, and the value over which requests are kept "
+                  "in the slow request ring"),
+    AP_INIT_TAKE1("NoteSlowRing", set_note_slow_ring, NULL, RSRC_CONF,
+                  "How many slow requests to keep"),
+    AP_INIT_TAKE123("NoteLog", set_note_log, NULL, RSRC_CONF,
+                    "File to write an LTSV access log with notes to, and "
+                    "optionally the bytes to buffer and most milliseconds to "
+                    "hold a line"),
+    {NULL}
+};
+
+
+static int notes_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp) {
+    note_slots = apr_hash_make(pconf);
+    note_names = apr_array_make(pconf, 16, sizeof(const char *));
+    note_slots_frozen = 0;
+    hist_defs = apr_array_make(pconf, 4, sizeof(note_hist_def));
+    memset(&hist_shm, 0, sizeof(hist_shm));
+    export_path = NULL;
+    export_batch = 8192;
+    export_latency = APR_USEC_PER_SEC;
+    export_defs = apr_array_make(pconf, 4, sizeof(note_export_def));
+    slow_defs = apr_array_make(pconf, 4, sizeof(note_slow_def));
+    slow_size = 64;
+    slow_ring = NULL;
+    ltsv_logs = apr_array_make(pconf, 2, sizeof(note_ltsv_log));
+    return OK;
+}
+
+static int notes_open_logs(apr_pool_t *pconf, apr_pool_t *plog,
+                           apr_pool_t *ptemp, server_rec *s) {
+    note_ltsv_log *logs = (note_ltsv_log *)ltsv_logs->elts;
+    int i;
+
+    for (i = 0; i < ltsv_logs->nelts; i++) {
+        apr_file_t *file;
+        apr_os_file_t fd;
+        apr_status_t rv = apr_file_open(&file, logs[i].path,
+                                        APR_WRITE | APR_APPEND | APR_CREATE,
+                                        APR_OS_DEFAULT, pconf);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                         "mod_notes: could not open NoteLog %s", logs[i].path);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+        apr_os_file_get(&fd, file);
+        logs[i].fd = fd;
+    }
+    return OK;
+}
+
+/* Shared memory of the given size kept in the process pool under key, so
+ * what's in it lasts through graceful restarts.  It's made afresh, and
+ * zeroed, only the first time or when the size changes.  NULL if it
+ * couldn't be made. */
+static void *notes_shm(server_rec *s, const char *key, apr_size_t size) {
+    apr_pool_t *p = s->process->pool;
+    apr_shm_t *shm = NULL;
+    apr_status_t rv;
+
+    apr_pool_userdata_get((void **)&shm, key, p);
+    if (shm != NULL && apr_shm_size_get(shm) == size) {
+        return apr_shm_baseaddr_get(shm);
+    }
+    if (shm != NULL) {
+        apr_pool_userdata_set(NULL, key, apr_pool_cleanup_null, p);
+        apr_shm_destroy(shm);
+    }
+    rv = apr_shm_create(&shm, size, NULL, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "mod_notes: couldn't create shared memory for %s", key);
+        return NULL;
+    }
+    memset(apr_shm_baseaddr_get(shm), 0, size);
+    apr_pool_userdata_set(shm, key, apr_pool_cleanup_null, p);
+    return apr_shm_baseaddr_get(shm);
+}
+
+static int notes_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+                             apr_pool_t *ptemp, server_rec *s) {
+    server_rec *vs;
+    int daemons = 0;
+
+    note_slots_frozen = 1;
+
+    hist_shm.servers = 0;
+    for (vs = s; vs; vs = vs->next) {
+        notes_server_conf *conf =
+            ap_get_module_config(vs->module_config, &notes_module);
+        conf->index = hist_shm.servers++;
+    }
+
+    /* The ring keeps its requests through restarts too */
+    if (slow_defs->nelts > 0) {
+        slow_ring = notes_shm(s, "mod_notes_slow_requests", sizeof(note_slow_ring)
+                              + (slow_size - 1) * sizeof(note_slow_entry));
+        if (slow_ring != NULL) {
+            slow_ring->size = slow_size;
+        }
+    }
+
+    hist_shm.hists = hist_defs->nelts;
+    if (hist_shm.hists == 0) {
+        return OK;
+    }
+    ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &daemons);
+    hist_shm.shards = (daemons > 0 && daemons < NOTE_HIST_SHARDS)
+        ? daemons : NOTE_HIST_SHARDS;
+
+    /* Counts carry on through restarts, as each rotation makes one, unless
+     * the servers or histograms change in number */
+    hist_shm.counts = notes_shm(s, "mod_notes_histograms",
+                                (apr_size_t)hist_shm.shards * hist_shm.servers
+                                * hist_shm.hists * NOTE_HIST_BUCKETS
+                                * sizeof(apr_uint32_t));
+    if (hist_shm.counts == NULL) {
+        hist_shm.hists = 0;
+    }
+    return OK;
+}
+
+static void note_export_flush(void);
+
+static apr_status_t note_export_cleanup(void *data) {
+    note_export_flush();
+    close(export_buf.fd);
+    export_buf.fd = -1;
+    return APR_SUCCESS;
+}
+
+static void note_ltsv_flush(note_ltsv_log *log, const char *line, apr_size_t len);
+
+static apr_status_t note_ltsv_cleanup(void *data) {
+    note_ltsv_log *logs = (note_ltsv_log *)ltsv_logs->elts;
+    int i;
+    for (i = 0; i < ltsv_logs->nelts; i++) {
+        note_ltsv_flush(&logs[i], NULL, 0);
+    }
+    return APR_SUCCESS;
+}
+
+#if APR_HAS_THREADS
+/* Write out the buffers, and send the export batch, that are as old as
+ * their latency allows */
+static void notes_flush_due(apr_time_t now) {
+    note_ltsv_log *logs = (note_ltsv_log *)ltsv_logs->elts;
+    int i;
+
+    for (i = 0; i < ltsv_logs->nelts; i++) {
+        apr_thread_mutex_lock(logs[i].mutex);
+        if (logs[i].len > 0 && now - logs[i].first >= logs[i].latency) {
+            note_ltsv_flush(&logs[i], NULL, 0);
+        }
+        apr_thread_mutex_unlock(logs[i].mutex);
+    }
+    if (export_buf.mutex) {
+        apr_thread_mutex_lock(export_buf.mutex);
+        if (export_buf.records > 0 && now - export_buf.first >= export_latency) {
+            note_export_flush();
+        }
+        apr_thread_mutex_unlock(export_buf.mutex);
+    }
+}
+
+static void * APR_THREAD_FUNC note_flusher(apr_thread_t *thd, void *data) {
+    while (!flusher_stop) {
+        apr_sleep(NOTE_FLUSH_TICK);
+        notes_flush_due(apr_time_now());
+    }
+    return NULL;
+}
+
+/* Stop the flusher before the buffers are written out for the last time */
+static apr_status_t note_flusher_cleanup(void *data) {
+    apr_status_t rv;
+    flusher_stop = 1;
+    apr_thread_join(&rv, flusher);
+    flusher = NULL;
+    return APR_SUCCESS;
+}
+#endif
+
+/* Start the flusher, if anything is buffered.  Its cleanup is registered
+ * after those of the buffers, so it's stopped before they run.  The
+ * thread's memory comes from the process pool, which outlives p. */
+static void notes_start_flusher(apr_pool_t *p, server_rec *s) {
+#if APR_HAS_THREADS
+    apr_status_t rv;
+
+    if (ltsv_logs->nelts == 0 && export_buf.fd < 0) {
+        return;
+    }
+    flusher_stop = 0;
+    rv = apr_thread_create(&flusher, NULL, note_flusher, NULL, s->process->pool);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "mod_notes: couldn't start the buffer flusher, buffers "
+                     "are only written out by requests");
+        flusher = NULL;
+        return;
+    }
+    apr_pool_cleanup_register(p, NULL, note_flusher_cleanup, apr_pool_cleanup_null);
+#endif
+}
+
+/* Open this child's socket and buffer for the export */
+static void notes_export_init(apr_pool_t *p, server_rec *s) {
+    export_buf.fd = -1;
+    if (export_path == NULL) {
+        return;
+    }
+    export_buf.fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (export_buf.fd < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, errno, s,
+                     "mod_notes: couldn't create export socket");
+        return;
+    }
+    fcntl(export_buf.fd, F_SETFL, O_NONBLOCK);
+    memset(&export_buf.addr, 0, sizeof(export_buf.addr));
+    export_buf.addr.sun_family = AF_UNIX;
+    strcpy(export_buf.addr.sun_path, export_path);
+    export_buf.buf = apr_palloc(p, export_batch);
+    export_buf.len = NOTE_EXPORT_HEADER;
+    export_buf.records = 0;
+    export_buf.pid = getpid();
+    export_buf.dropped = 0;
+#if APR_HAS_THREADS
+    apr_thread_mutex_create(&export_buf.mutex, APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+    apr_pool_cleanup_register(p, NULL, note_export_cleanup, apr_pool_cleanup_null);
+}
+
+static void notes_child_init(apr_pool_t *p, server_rec *s) {
+    note_ltsv_log *logs = (note_ltsv_log *)ltsv_logs->elts;
+    int i;
+
+    if (hist_shm.shards > 0) {
+        hist_shard = getpid() % hist_shm.shards;
+    }
+
+    for (i = 0; i < ltsv_logs->nelts; i++) {
+        logs[i].buf = apr_palloc(p, logs[i].size);
+        logs[i].len = 0;
+#if APR_HAS_THREADS
+        apr_thread_mutex_create(&logs[i].mutex, APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+    }
+    if (ltsv_logs->nelts > 0) {
+        apr_pool_cleanup_register(p, NULL, note_ltsv_cleanup, apr_pool_cleanup_null);
+    }
+
+    notes_export_init(p, s);
+    notes_start_flusher(p, s);
+}
+
+static char *note_put16(char *c, apr_size_t v) {
+    *c++ = (v >> 8) & 0xff;
+    *c++ = v & 0xff;
+    return c;
+}
+
+static char *note_put32(char *c, apr_uint32_t v) {
+    c = note_put16(c, v >> 16);
+    return note_put16(c, v & 0xffff);
+}
+
+static char *note_put64(char *c, apr_uint64_t v) {
+    c = note_put32(c, (apr_uint32_t)(v >> 32));
+    return note_put32(c, (apr_uint32_t)(v & 0xffffffff));
+}
+
+/* How much of a note's value is exported */
+static apr_size_t note_export_len(const char *val) {
+    apr_size_t len = strlen(val);
+    return (len > 1024) ? 1024 : len;
+}
+
+/* Send the batch, or count it as dropped if the socket won't take it now.
+ * Called with the mutex held. */
+static void note_export_flush(void) {
+    char *c = export_buf.buf;
+
+    if (export_buf.records == 0) {
+        return;
+    }
+    memcpy(c, "NOTE", 4);
+    c[4] = NOTE_EXPORT_VERSION;
+    c[5] = export_buf.records;
+    note_put16(c + 6, 0);
+    note_put32(c + 8, export_buf.pid);
+    note_put32(c + 12, export_buf.dropped);
+    if (sendto(export_buf.fd, export_buf.buf, export_buf.len, MSG_DONTWAIT,
+               (struct sockaddr *)&export_buf.addr, sizeof(export_buf.addr)) < 0) {
+        export_buf.dropped += export_buf.records;
+    }
+    export_buf.len = NOTE_EXPORT_HEADER;
+    export_buf.records = 0;
+}
+
+/* The record is sized first and then written straight into the batch,
+ * so no request needs room for the largest one on its stack */
+static void note_export_log(request_rec *r) {
+    const char *host = r->server->server_hostname ? r->server->server_hostname : "";
+    apr_size_t host_len = strlen(host);
+    note_export_def *defs = (note_export_def *)export_defs->elts;
+    const char **vals = apr_palloc(r->pool, export_defs->nelts * sizeof(char *));
+    apr_time_t now = apr_time_now();
+    apr_size_t len;
+    int i, last, n = 0;
+    char *c;
+
+    if (host_len > 255) {
+        host_len = 255;
+    }
+    len = 2 + 2 + 8 + 1 + host_len + 1;
+    for (last = 0; last < export_defs->nelts; last++) {
+        const char *val = note_value(r, defs[last].slot, defs[last].name);
+        apr_size_t add;
+        vals[last] = val;
+        if (val == NULL) {
+            continue;
+        }
+        add = 3 + strlen(defs[last].name) + note_export_len(val);
+        if (n == 255 || len + add > NOTE_EXPORT_MAX) {
+            break;
+        }
+        len += add;
+        n++;
+    }
+
+#if APR_HAS_THREADS
+    if (export_buf.mutex) {
+        apr_thread_mutex_lock(export_buf.mutex);
+    }
+#endif
+    if (len > export_batch - NOTE_EXPORT_HEADER) {
+        export_buf.dropped++;
+    }
+    else {
+        if (export_buf.len + len > export_batch || export_buf.records == 255) {
+            note_export_flush();
+        }
+        if (export_buf.records == 0) {
+            export_buf.first = now;
+        }
+        c = export_buf.buf + export_buf.len;
+        c = note_put16(c, len);
+        c = note_put16(c, r->status);
+        c = note_put64(c, (apr_uint64_t)(now - r->request_time));
+        *c++ = host_len;
+        memcpy(c, host, host_len);
+        c += host_len;
+        *c++ = n;
+        for (i = 0; i < last; i++) {
+            apr_size_t name_len, val_len;
+            if (vals[i] == NULL) {
+                continue;
+            }
+            name_len = strlen(defs[i].name);
+            val_len = note_export_len(vals[i]);
+            *c++ = name_len;
+            memcpy(c, defs[i].name, name_len);
+            c += name_len;
+            c = note_put16(c, val_len);
+            memcpy(c, vals[i], val_len);
+            c += val_len;
+        }
+        export_buf.len += len;
+        export_buf.records++;
+        if (now - export_buf.first >= export_latency) {
+            note_export_flush();
+        }
+    }
+#if APR_HAS_THREADS
+    if (export_buf.mutex) {
+        apr_thread_mutex_unlock(export_buf.mutex);
+    }
+#endif
+}
+
+/* Bucket of a value: exact below 8, then 8 to each power of two */
+static int note_hist_bucket(apr_uint32_t v) {
+    int e = 0;
+    if (v < NOTE_HIST_SUB) {
+        return v;
+    }
+    while ((v >> e) >= 2 * NOTE_HIST_SUB) {
+        e++;
+    }
+    return (e + 1) * NOTE_HIST_SUB + (int)((v >> e) - NOTE_HIST_SUB);
+}
+
+/* Highest value counted in a bucket */
+static apr_uint64_t note_hist_upper(int bucket) {
+    int e;
+    if (bucket < NOTE_HIST_SUB) {
+        return bucket;
+    }
+    e = bucket / NOTE_HIST_SUB - 1;
+    return ((apr_uint64_t)(NOTE_HIST_SUB + bucket % NOTE_HIST_SUB + 1) << e) - 1;
+}
+
+static apr_uint32_t *note_hist_counts(int shard, int server, int hist) {
+    return hist_shm.counts + (((apr_size_t)shard * hist_shm.servers + server)
+                              * hist_shm.hists + hist) * NOTE_HIST_BUCKETS;
+}
+
+static void note_hist_add(request_rec *r) {
+    notes_server_conf *conf =
+        ap_get_module_config(r->server->module_config, &notes_module);
+    note_hist_def *defs = (note_hist_def *)hist_defs->elts;
+    int i;
+
+    for (i = 0; i < hist_shm.hists; i++) {
+        const char *val = note_value(r, defs[i].slot, defs[i].name);
+        double v;
+        char *end;
+        if (val == NULL) {
+            continue;
+        }
+        v = strtod(val, &end) * defs[i].scale;
+        if (end == val || v < 0) {
+            continue;
+        }
+        v = (v >= 4294967295.0) ? 4294967295.0 : v + 0.5;
+        apr_atomic_inc32(note_hist_counts(hist_shard, conf->index, i)
+                         + note_hist_bucket((apr_uint32_t)v));
+    }
+}
+
+/* Value below which the given fraction of a merged histogram lies */
+static apr_uint64_t note_hist_quantile(const apr_uint64_t *merged,
+                                       apr_uint64_t total, double q) {
+    apr_uint64_t seen = 0;
+    apr_uint64_t want = (apr_uint64_t)(total * q + 0.5);
+    int b;
+    if (want == 0) {
+        want = 1;
+    }
+    for (b = 0; b < NOTE_HIST_BUCKETS; b++) {
+        seen += merged[b];
+        if (seen >= want) {
+            return note_hist_upper(b);
+        }
+    }
+    return 0;
+}
+
+/* A string as a quoted JSON string */
+static const char *note_json_string(apr_pool_t *p, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    char *out = apr_palloc(p, strlen(s) * 6 + 3);
+    char *c = out;
+    *c++ = '"';
+    for (; *s; s++) {
+        unsigned char ch = *s;
+        if (ch == '"' || ch == '\\') {
+            *c++ = '\\';
+            *c++ = ch;
+        }
+        else if (ch < 0x20) {
+            memcpy(c, "\\u00", 4);
+            c[4] = hex[ch >> 4];
+            c[5] = hex[ch & 15];
+            c += 6;
+        }
+        else {
+            *c++ = ch;
+        }
+    }
+    *c++ = '"';
+    *c = '\0';
+    return out;
+}
+
+static int note_hist_handler(request_rec *r) {
+    apr_uint64_t merged[NOTE_HIST_BUCKETS];
+    note_hist_def *defs = (note_hist_def *)hist_defs->elts;
+    int json = (r->args && !strcmp(r->args, "json"));
+    int first = 1;
+    server_rec *vs;
+
+    if (r->handler == NULL || strcmp(r->handler, "note-histograms")) {
+        return DECLINED;
+    }
+    if (r->method_number != M_GET) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+    ap_set_content_type(r, json ? "application/json" : "text/plain");
+    if (r->header_only) {
+        return OK;
+    }
+
+    ap_rputs(json ? "[" : "# server note count p50 p90 p99 max\n", r);
+    for (vs = ap_server_conf; vs; vs = vs->next) {
+        notes_server_conf *conf =
+            ap_get_module_config(vs->module_config, &notes_module);
+        const char *host = vs->server_hostname ? vs->server_hostname : "-";
+        int i;
+        for (i = 0; i < hist_shm.hists; i++) {
+            apr_uint64_t total = 0;
+            int b, shard, max = 0;
+            memset(merged, 0, sizeof(merged));
+            for (shard = 0; shard < hist_shm.shards; shard++) {
+                apr_uint32_t *c = note_hist_counts(shard, conf->index, i);
+                for (b = 0; b < NOTE_HIST_BUCKETS; b++) {
+                    merged[b] += apr_atomic_read32(c + b);
+                }
+            }
+            for (b = 0; b < NOTE_HIST_BUCKETS; b++) {
+                total += merged[b];
+                if (merged[b]) {
+                    max = b;
+                }
+            }
+            if (total == 0) {
+                continue;
+            }
+            const char *server = apr_psprintf(r->pool, "%s:%u", host, vs->port);
+            ap_rprintf(r, json ? "%s{\"server\":%s,\"note\":%s,"
+                       "\"count\":%" APR_UINT64_T_FMT ",\"p50\":%" APR_UINT64_T_FMT
+                       ",\"p90\":%" APR_UINT64_T_FMT ",\"p99\":%" APR_UINT64_T_FMT
+                       ",\"max\":%" APR_UINT64_T_FMT "}"
+                       : "%s%s %s %" APR_UINT64_T_FMT " %" APR_UINT64_T_FMT
+                       " %" APR_UINT64_T_FMT " %" APR_UINT64_T_FMT
+                       " %" APR_UINT64_T_FMT "\n",
+                       json ? (first ? "\n" : ",\n") : "",
+                       json ? note_json_string(r->pool, server) : server,
+                       json ? note_json_string(r->pool, defs[i].name)
+                       : defs[i].name,
+                       total, note_hist_quantile(merged, total, 0.50),
+                       note_hist_quantile(merged, total, 0.90),
+                       note_hist_quantile(merged, total, 0.99),
+                       note_hist_upper(max));
+            first = 0;
+        }
+    }
+    if (json) {
+        ap_rputs("\n]\n", r);
+    }
+    return OK;
+}
+
+typedef struct {
+    char *start;
+    char *c;
+    char *end;
+} note_slow_text;
+
+static void note_slow_append(note_slow_text *t, const char *key, const char *val) {
+    if (t->c < t->end) {
+        t->c += apr_snprintf(t->c, t->end - t->c, "%s%s:%s",
+                             t->c > t->start ? "\t" : "", key, val);
+    }
+}
+
+static int note_slow_append_note(void *data, const char *key, const char *val) {
+    note_slow_append(data, key, val);
+    return 1;
+}
+
+static void note_slow_log(request_rec *r, apr_time_t now) {
+    note_slow_def *defs = (note_slow_def *)slow_defs->elts;
+    note_slow_entry *e;
+    note_slow_text t;
+    apr_uint32_t n;
+    int i;
+
+    for (i = 0; i < slow_defs->nelts; i++) {
+        const char *val = note_value(r, defs[i].slot, defs[i].name);
+        if (val != NULL && strtod(val, NULL) > defs[i].threshold) {
+            break;
+        }
+    }
+    if (i == slow_defs->nelts) {
+        return;
+    }
+
+    n = apr_atomic_inc32(&slow_ring->next);
+    e = &slow_ring->entries[n % slow_ring->size];
+    apr_atomic_xchg32(&e->seq, 2 * n + 1);
+    e->time = r->request_time;
+    e->duration = now - r->request_time;
+    e->bytes = r->bytes_sent;
+    e->status = r->status;
+    t.start = t.c = e->text;
+    t.end = e->text + sizeof(e->text);
+    note_slow_append(&t, "rule", defs[i].name);
+    note_slow_append(&t, "server", r->server->server_hostname
+                     ? r->server->server_hostname : "-");
+    note_slow_append(&t, "method", r->method);
+    note_slow_append(&t, "uri", r->unparsed_uri ? r->unparsed_uri : r->uri);
+    apr_table_do(note_slow_append_note, &t, r->notes, NULL);
+    apr_atomic_xchg32(&e->seq, 2 * n + 2);
+}
+
+static int note_slow_handler(request_rec *r) {
+    note_slow_entry e;
+    apr_uint32_t next, n;
+
+    if (r->handler == NULL || strcmp(r->handler, "note-slow")) {
+        return DECLINED;
+    }
+    if (r->method_number != M_GET) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+    ap_set_content_type(r, "text/plain");
+    if (r->header_only || slow_ring == NULL) {
+        return OK;
+    }
+
+    next = apr_atomic_read32(&slow_ring->next);
+    for (n = next; n != next - slow_ring->size && n != 0; n--) {
+        note_slow_entry *src = &slow_ring->entries[(n - 1) % slow_ring->size];
+        char date[APR_RFC822_DATE_LEN];
+        apr_uint32_t seq = apr_atomic_read32(&src->seq);
+
+        /* Skip entries being written, or overwritten while copying */
+        if (seq != 2 * (n - 1) + 2) {
+            continue;
+        }
+        memcpy(&e, src, sizeof(e));
+        if (apr_atomic_read32(&src->seq) != seq) {
+            continue;
+        }
+        e.text[sizeof(e.text) - 1] = '\0';
+        apr_rfc822_date(date, e.time);
+        ap_rprintf(r, "time:%s\tstatus:%d\ttime_us:%" APR_TIME_T_FMT
+                   "\tsize:%" APR_OFF_T_FMT "\t%s\n", date, e.status,
+                   e.duration, e.bytes, e.text);
+    }
+    return OK;
+}
+
+/* Write what's buffered and then line, if any, with writev(), going on
+ * after short writes and interruptions until it's all written */
+static void note_ltsv_flush(note_ltsv_log *log, const char *line, apr_size_t len) {
+    struct iovec iov[2];
+    struct iovec *v = iov;
+    int n = 0;
+
+    if (log->len > 0) {
+        iov[n].iov_base = log->buf;
+        iov[n++].iov_len = log->len;
+    }
+    if (len > 0) {
+        iov[n].iov_base = (char *)line;
+        iov[n++].iov_len = len;
+    }
+    while (n > 0 && log->fd >= 0) {
+        ssize_t written = writev(log->fd, v, n);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ap_log_error(APLOG_MARK, APLOG_ERR, errno, NULL,
+                         "mod_notes: couldn't write NoteLog %s", log->path);
+            break;
+        }
+        while (n > 0 && (apr_size_t)written >= v->iov_len) {
+            written -= v->iov_len;
+            v++;
+            n--;
+        }
+        if (n > 0) {
+            v->iov_base = (char *)v->iov_base + written;
+            v->iov_len -= written;
+        }
+    }
+    log->len = 0;
+}
+
+typedef struct {
+    char *c;
+    char *end;
+} note_ltsv_line;
+
+/* Append a label or value, escaping what would break the line as nginx
+ * does, and in a label the ':' that ends it too */
+static void note_ltsv_escape(note_ltsv_line *l, const char *s, int label) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (; *s && l->c < l->end - 4; s++) {
+        unsigned char ch = *s;
+        if (ch < 0x20 || ch == 0x7f || ch == '\\' || (label && ch == ':')) {
+            *l->c++ = '\\';
+            *l->c++ = 'x';
+            *l->c++ = hex[ch >> 4];
+            *l->c++ = hex[ch & 0xf];
+        }
+        else {
+            *l->c++ = ch;
+        }
+    }
+}
+
+/* Append a field */
+static void note_ltsv_add(note_ltsv_line *l, const char *key, const char *val) {
+    if (val == NULL || *val == '\0') {
+        val = "-";
+    }
+    note_ltsv_escape(l, key, 1);
+    if (l->c < l->end) {
+        *l->c++ = ':';
+    }
+    note_ltsv_escape(l, val, 0);
+    if (l->c < l->end) {
+        *l->c++ = '\t';
+    }
+}
+
+static int note_ltsv_add_note(void *data, const char *key, const char *val) {
+    note_ltsv_add(data, key, val);
+    return 1;
+}
+
+static void note_ltsv_log_request(request_rec *r, note_ltsv_log *log, apr_time_t now) {
+    char line[NOTE_LTSV_LINE];
+    char buf[64];
+    note_ltsv_line l;
+    apr_time_exp_t t;
+    apr_interval_time_t took = now - r->request_time;
+    apr_size_t len;
+
+    l.c = line;
+    l.end = line + sizeof(line) - 1;
+
+    apr_time_exp_lt(&t, r->request_time);
+    apr_snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d%c%02d:%02d",
+                 t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour,
+                 t.tm_min, t.tm_sec, t.tm_gmtoff < 0 ? '-' : '+',
+                 abs(t.tm_gmtoff) / 3600, abs(t.tm_gmtoff) % 3600 / 60);
+    note_ltsv_add(&l, "ts", buf);
+    note_ltsv_add(&l, "host", r->hostname ? r->hostname : r->server->server_hostname);
+    note_ltsv_add(&l, "ip", r->connection->remote_ip);
+    note_ltsv_add(&l, "method", r->method);
+    note_ltsv_add(&l, "path", r->unparsed_uri);
+    apr_snprintf(buf, sizeof(buf), "%d", r->status);
+    note_ltsv_add(&l, "status", buf);
+    note_ltsv_add(&l, "size_req", NULL);
+    note_ltsv_add(&l, "size_res", NULL);
+    apr_snprintf(buf, sizeof(buf), "%" APR_OFF_T_FMT, r->bytes_sent);
+    note_ltsv_add(&l, "size_body", buf);
+    apr_snprintf(buf, sizeof(buf), "%" APR_TIME_T_FMT ".%03" APR_TIME_T_FMT,
+                 apr_time_sec(took), apr_time_msec(took) % 1000);
+    note_ltsv_add(&l, "time_req", buf);
+    note_ltsv_add(&l, "time_app", NULL);
+    note_ltsv_add(&l, "referer", apr_table_get(r->headers_in, "Referer"));
+    note_ltsv_add(&l, "ua", apr_table_get(r->headers_in, "User-Agent"));
+    apr_table_do(note_ltsv_add_note, &l, r->notes, NULL);
+
+    /* The last field's tab ends the line, unless the line was cut short
+     * before it, when the byte kept spare past l.end does */
+    if (l.c[-1] == '\t') {
+        l.c[-1] = '\n';
+    }
+    else {
+        *l.c++ = '\n';
+    }
+    len = l.c - line;
+
+#if APR_HAS_THREADS
+    if (log->mutex) {
+        apr_thread_mutex_lock(log->mutex);
+    }
+#endif
+    if (log->len + len > log->size) {
+        note_ltsv_flush(log, line, len);
+    }
+    else {
+        if (log->len == 0) {
+            log->first = now;
+        }
+        memcpy(log->buf + log->len, line, len);
+        log->len += len;
+        if (now - log->first >= log->latency) {
+            note_ltsv_flush(log, NULL, 0);
+        }
+    }
+#if APR_HAS_THREADS
+    if (log->mutex) {
+        apr_thread_mutex_unlock(log->mutex);
+    }
+#endif
+}
+
+static int notes_log_transaction(request_rec *r) {
+    /* The notes are on the request that made the response */
+    while (r->next) {
+        r = r->next;
+    }
+    if (export_buf.fd >= 0) {
+        note_export_log(r);
+    }
+    if (slow_ring != NULL) {
+        note_slow_log(r, apr_time_now());
+    }
+    if (hist_shm.hists > 0) {
+        note_hist_add(r);
+    }
+    if (ltsv_logs->nelts > 0) {
+        notes_server_conf *conf =
+            ap_get_module_config(r->server->module_config, &notes_module);
+        if (conf->ltsv_log) {
+            note_ltsv_log_request(r, (note_ltsv_log *)ltsv_logs->elts
+                                  + conf->ltsv_log - 1, apr_time_now());
+        }
+    }
+    return DECLINED;
+}
+
+#if defined(NOTES_BENCHMARK)
+static ap_filter_rec_t *bench_sink_rec = NULL;
+
+static apr_status_t note_bench_sink(ap_filter_t *f, apr_bucket_brigade *bb) {
+    return APR_SUCCESS;
+}
+
+/* A request whose response has the given number of headers, pct percent
+ * of them NOTE headers, and a filter chain of NOTE_FILTER, if capture is
+ * set, and a sink that throws brigades away */
+static request_rec *note_bench_request(request_rec *parent, apr_pool_t *p,
+                                       int headers, int pct, int capture) {
+    request_rec *r = apr_pcalloc(p, sizeof(*r));
+    ap_filter_t *sink = apr_pcalloc(p, sizeof(*sink));
+    int i;
+
+    r->pool = p;
+    r->server = parent->server;
+    r->connection = parent->connection;
+    r->headers_out = apr_table_make(p, headers);
+    r->notes = apr_table_make(p, 8);
+    r->subprocess_env = apr_table_make(p, 8);
+    r->request_config = ap_create_request_config(p);
+    for (i = 0; i < headers; i++) {
+        int is_note = (i * pct / 100) != ((i + 1) * pct / 100);
+        apr_table_addn(r->headers_out,
+                       apr_psprintf(p, is_note ? "NOTE-Bench-%d" : "X-Bench-%d", i),
+                       "12345");
+    }
+
+    sink->frec = bench_sink_rec;
+    sink->r = r;
+    sink->c = r->connection;
+    r->output_filters = r->proto_output_filters = sink;
+    if (capture) {
+        ap_filter_t *f = apr_pcalloc(p, sizeof(*f));
+        f->frec = note_filter_rec;
+        f->r = r;
+        f->c = r->connection;
+        f->next = sink;
+        r->output_filters = f;
+    }
+    return r;
+}
+
+/* Microseconds to pass the brigades of n such requests down their chains */
+static apr_interval_time_t note_bench_run(request_rec *parent, int headers, int pct,
+                                          int brigades, int n, int capture) {
+    apr_pool_t *p;
+    request_rec **reqs;
+    apr_bucket_brigade *bb;
+    apr_time_t start;
+    apr_interval_time_t took;
+    int i, b;
+
+    apr_pool_create(&p, parent->pool);
+    reqs = apr_palloc(p, n * sizeof(*reqs));
+    for (i = 0; i < n; i++) {
+        reqs[i] = note_bench_request(parent, p, headers, pct, capture);
+    }
+    bb = apr_brigade_create(p, parent->connection->bucket_alloc);
+
+    start = apr_time_now();
+    for (i = 0; i < n; i++) {
+        for (b = 0; b < brigades; b++) {
+            ap_pass_brigade(reqs[i]->output_filters, bb);
+        }
+    }
+    took = apr_time_now() - start;
+
+    apr_pool_destroy(p);
+    return took;
+}
+
+static int note_bench_handler(request_rec *r) {
+    static const int headers[] = { 10, 50, 100, 200 };
+    static const int pcts[] = { 0, 10, 50 };
+    static const int brigades[] = { 1, 10, 100, 1000 };
+    int n = 1000;
+    int h, p, b;
+
+    if (r->handler == NULL || strcmp(r->handler, "note-benchmark")) {
+        return DECLINED;
+    }
+    if (r->args && !strncmp(r->args, "iterations=", 11)) {
+        n = atoi(r->args + 11);
+        if (n < 1) {
+            n = 1;
+        }
+    }
+    ap_set_content_type(r, "text/plain");
+    if (r->header_only) {
+        return OK;
+    }
+
+    ap_rprintf(r, "# %d requests each, ns per request\n"
+               "# headers notes%% brigades off on filter\n", n);
+    for (h = 0; h < sizeof(headers) / sizeof(*headers); h++) {
+        for (p = 0; p < sizeof(pcts) / sizeof(*pcts); p++) {
+            for (b = 0; b < sizeof(brigades) / sizeof(*brigades); b++) {
+                apr_interval_time_t off =
+                    note_bench_run(r, headers[h], pcts[p], brigades[b], n, 0);
+                apr_interval_time_t on =
+                    note_bench_run(r, headers[h], pcts[p], brigades[b], n, 1);
+                ap_rprintf(r, "%d %d %d %" APR_TIME_T_FMT " %" APR_TIME_T_FMT
+                           " %" APR_TIME_T_FMT "\n", headers[h], pcts[p],
+                           brigades[b], off * 1000 / n, on * 1000 / n,
+                           (on - off) * 1000 / n);
+            }
+        }
+    }
+    return OK;
+}
+#endif
 
 static void notes_register_hooks(apr_pool_t *p) {
-    ap_register_output_filter("NOTE_FILTER", note_output_filter, NULL, AP_FTYPE_RESOURCE);
+    note_filter_rec = ap_register_output_filter("NOTE_FILTER", note_output_filter, NULL, AP_FTYPE_RESOURCE);
+    ap_hook_insert_filter(note_insert_filter, NULL, NULL, APR_HOOK_MIDDLE);
+#if defined(NOTES_TRAILERS)
+    note_trailers_rec = ap_register_input_filter("NOTE_TRAILERS", note_trailers_filter,
+                                                 NULL, AP_FTYPE_RESOURCE);
+    proxy_hook_create_req(note_proxy_create_req, NULL, NULL, APR_HOOK_MIDDLE);
+#endif
+    ap_hook_pre_config(notes_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    /* Run last, so other modules' post_config can still register names */
+    ap_hook_post_config(notes_post_config, NULL, NULL, APR_HOOK_REALLY_LAST);
+    ap_hook_open_logs(notes_open_logs, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(notes_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_log_transaction(notes_log_transaction, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(note_hist_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(note_slow_handler, NULL, NULL, APR_HOOK_MIDDLE);
+#if defined(NOTES_BENCHMARK)
+    bench_sink_rec = ap_register_output_filter("NOTES_BENCH_SINK", note_bench_sink,
+                                               NULL, AP_FTYPE_PROTOCOL);
+    ap_hook_handler(note_bench_handler, NULL, NULL, APR_HOOK_MIDDLE);
+#endif
+    APR_REGISTER_OPTIONAL_FN(notes_slot);
+    APR_REGISTER_OPTIONAL_FN(notes_get_slot);
+    APR_REGISTER_OPTIONAL_FN(notes_set_slot);
 }
 
 /* Dispatch list for API hooks */
@@ -73,9 +1813,9 @@ module AP_MODULE_DECLARE_DATA notes_module = {
     STANDARD20_MODULE_STUFF, 
     NULL,                  /* create per-dir    config structures */
     NULL,                  /* merge  per-dir    config structures */
-    NULL,                  /* create per-server config structures */
-    NULL,                  /* merge  per-server config structures */
-    NULL,                  /* table of config file commands       */
+    create_notes_server_config, /* create per-server config structures */
+    merge_notes_server_config,  /* merge  per-server config structures */
+    notes_cmds,            /* table of config file commands       */
     notes_register_hooks   /* register hooks                      */
 };
 
@@ -0,0 +1,43 @@
+/*
+**  mod_notes.h -- API of mod_notes for other modules
+**
+**  Note names are registered while the configuration is read and each
+**  gets a slot.  A request's notes can then be read and written by slot
+**  without searching r->notes, which mod_notes keeps populated too:
+**
+**    static APR_OPTIONAL_FN_TYPE(notes_get_slot) *get_note;
+**    static int app_time;
+**
+**    // in post_config, or a directive handler
+**    APR_OPTIONAL_FN_TYPE(notes_slot) *slot =
+**        APR_RETRIEVE_OPTIONAL_FN(notes_slot);
+**    get_note = APR_RETRIEVE_OPTIONAL_FN(notes_get_slot);
+**    app_time = slot ? slot("NOTE-App-Time") : -1;
+**
+**    // at request time
+**    const char *v = get_note ? get_note(r, app_time) : NULL;
+**
+**  Only names registered before post_config get a slot; notes_slot()
+**  returns -1 for others after that.
+**
+**  mod_notes.c doesn't include this header, so the module builds from
+**  its one source file, and declares the same functions itself.
+*/
+
+#ifndef MOD_NOTES_H
+#define MOD_NOTES_H
+
+#include "httpd.h"
+#include "apr_optional.h"
+
+/* The slot of a note name, registering it if the configuration is still
+ * being read, or -1.  Names are matched without regard to case. */
+APR_DECLARE_OPTIONAL_FN(int, notes_slot, (const char *name));
+
+/* The value of a note captured or set for this request, or NULL */
+APR_DECLARE_OPTIONAL_FN(const char *, notes_get_slot, (request_rec *r, int slot));
+
+/* Set a note for this request, in r->notes as well */
+APR_DECLARE_OPTIONAL_FN(void, notes_set_slot, (request_rec *r, int slot, const char *value));
+
+#endif /* MOD_NOTES_H */
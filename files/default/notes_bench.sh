@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# notes_bench.sh -- requests/s and latency through a local httpd with
+# NOTE_FILTER off and on
+#
+# Needs mod_notes, mod_headers and two locations serving the same thing,
+# with NOTE headers to capture, only one of them through the filter:
+#
+#   Alias /bench-off /var/www/index.html
+#   Alias /bench-on  /var/www/index.html
+#   <LocationMatch ^/bench-(off|on)$>
+#     Header set NOTE-App-Time 12
+#     Header set NOTE-DB-Time 3
+#   </LocationMatch>
+#   <Location /bench-on>
+#     SetOutputFilter NOTE_FILTER
+#   </Location>
+#
+# Usage: notes_bench.sh [base-url] [requests] [concurrency]
+#
+
+BASE=${1:-http://127.0.0.1}
+REQUESTS=${2:-20000}
+CONCURRENCY=${3:-16}
+
+echo "filter requests/s p50_ms p90_ms p99_ms"
+for MODE in off on; do
+    ab -q -k -n "$REQUESTS" -c "$CONCURRENCY" "$BASE/bench-$MODE" 2>/dev/null |
+    awk -v mode="$MODE" '
+        /^Requests per second:/ { rps = $4 }
+        /^ +50%/ { p50 = $2 }
+        /^ +90%/ { p90 = $2 }
+        /^ +99%/ { p99 = $2 }
+        END { print mode, rps, p50, p90, p99 }'
+done
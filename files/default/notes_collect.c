@@ -0,0 +1,129 @@
+/*
+**  notes_collect.c -- print the notes mod_notes sends to NoteExport
+**
+**  A small collector for trying out NoteExport.  It binds the socket and
+**  prints each record as a line of LTSV:
+**
+**    $ cc -o notes_collect notes_collect.c
+**    $ ./notes_collect /var/run/notes.sock
+**    server:www.example.com  status:200  time_us:5120  NOTE-App-Time:4
+**
+**  and a line whenever the count of records a child dropped goes up:
+**
+**    pid:4711  dropped:3
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static unsigned get16(const unsigned char *c) {
+    return (c[0] << 8) | c[1];
+}
+
+static unsigned long get32(const unsigned char *c) {
+    return ((unsigned long)get16(c) << 16) | get16(c + 2);
+}
+
+static unsigned long long get64(const unsigned char *c) {
+    return ((unsigned long long)get32(c) << 32) | get32(c + 4);
+}
+
+/* The last dropped count seen from each child, by pid */
+#define CHILDREN 4096
+
+static struct {
+    unsigned long pid;
+    unsigned long dropped;
+} children[CHILDREN];
+
+/* Note a child's dropped count, returning whether it went up.  A child
+ * with a pid seen before counts from 0 again, so a lower count starts
+ * afresh.  Once the table is full, children share the slot pid falls
+ * in. */
+static int count_dropped(unsigned long pid, unsigned long dropped) {
+    int i = pid % CHILDREN;
+    int n;
+
+    for (n = 0; n < CHILDREN; n++) {
+        int j = (i + n) % CHILDREN;
+        if (children[j].pid == pid || children[j].pid == 0) {
+            i = j;
+            break;
+        }
+    }
+    if (children[i].pid != pid || dropped < children[i].dropped) {
+        children[i].pid = pid;
+        children[i].dropped = 0;
+    }
+    if (dropped > children[i].dropped) {
+        children[i].dropped = dropped;
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static unsigned char frame[65536];
+    struct sockaddr_un addr;
+    int fd;
+
+    if (argc != 2 || strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "usage: %s socket\n", argv[0]);
+        return 1;
+    }
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, argv[1]);
+    unlink(argv[1]);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    for (;;) {
+        ssize_t len = recv(fd, frame, sizeof(frame), 0);
+        const unsigned char *c = frame + 16;
+        int records;
+
+        if (len < 16 || memcmp(frame, "NOTE", 4) || frame[4] != 3) {
+            continue;
+        }
+        if (count_dropped(get32(frame + 8), get32(frame + 12))) {
+            printf("pid:%lu\tdropped:%lu\n", get32(frame + 8), get32(frame + 12));
+        }
+        for (records = frame[5]; records > 0; records--) {
+            const unsigned char *end;
+            int notes;
+
+            /* Every length is checked against the record, and the record
+             * against the frame, before what it covers is read */
+            if (c + 2 > frame + len) {
+                break;
+            }
+            end = c + get16(c);
+            if (end > frame + len || end < c + 14 || c + 14 + c[12] > end) {
+                break;
+            }
+            printf("server:%.*s\tstatus:%u\ttime_us:%llu",
+                   c[12], (const char *)c + 13, get16(c + 2), get64(c + 4));
+            c += 13 + c[12];
+            for (notes = *c++; notes > 0 && c < end; notes--) {
+                const unsigned char *val = c + 1 + c[0];
+                if (val + 2 > end || val + 2 + get16(val) > end) {
+                    break;
+                }
+                printf("\t%.*s:%.*s", c[0], (const char *)c + 1,
+                       get16(val), (const char *)val + 2);
+                c = val + 2 + get16(val);
+            }
+            printf("\n");
+            c = end;
+        }
+        fflush(stdout);
+    }
+}